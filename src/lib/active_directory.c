@@ -18,7 +18,7 @@
 #	include <config.h>
 #endif
 
-#include "active_directory.h"
+#include "ad_private.h"
 #include <ldap.h>
 #include <lber.h>
 #include <stdio.h>
@@ -28,9 +28,31 @@
 #include <stdlib.h>
 #include <ctype.h>
 
-#define MAX_ERR_LENGTH 1024
-char ad_error_msg[MAX_ERR_LENGTH];
-int ad_error_code;
+#include <pthread.h>
+
+pthread_key_t ad_thread_key;
+pthread_once_t ad_thread_key_once=PTHREAD_ONCE_INIT;
+
+void ad_thread_key_create() {
+	pthread_key_create(&ad_thread_key, free);
+}
+
+struct ad_thread_state *ad_thread_state() {
+	struct ad_thread_state *state;
+
+	pthread_once(&ad_thread_key_once, ad_thread_key_create);
+	state=pthread_getspecific(ad_thread_key);
+	if(state==NULL) {
+		state=malloc(sizeof(struct ad_thread_state));
+		state->error_msg[0]='\0';
+		state->error_code=AD_SUCCESS;
+		state->pool_slot=-1;
+		state->op=NULL;
+		state->connecting=NULL;
+		pthread_setspecific(ad_thread_key, state);
+	}
+	return state;
+}
 
 #define MAX_PASSWORD_LENGTH 255
 
@@ -45,22 +67,47 @@ char *uri=NULL;
 char *binddn=NULL;
 char *bindpw=NULL;
 char *search_base=NULL;
+int page_size=-1;
+char *cache_file=NULL;
+int cache_ttl=-1;
+char *tls_cache_file=NULL;
+
+/* connection pool, see ad_pool_init() */
+struct ad_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	int size;
+	LDAP **connections;
+	int *in_use;
+};
+
+struct ad_pool pool={PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+			0, NULL, NULL};
+
+pthread_mutex_t login_lock=PTHREAD_MUTEX_INITIALIZER;
 
 /* private functions */
 
-/* connect and authenticate to active directory server.
-	returns an ldap connection identifier or 0 on error */
-LDAP *ad_login() {
-	static LDAP *ds=NULL;
+/* read uri, binddn, bindpw and searchbase from the config file
+	unless they've already been set.  the settings are kept for
+	the life of the process so that connections can be reopened.
+	returns AD_SUCCESS or AD_MISSING_CONFIG_PARAMETER */
+int ad_read_config() {
+	static int config_read=0;
+	static pthread_mutex_t config_lock=PTHREAD_MUTEX_INITIALIZER;
 
 	FILE *options_fd=NULL;
 	int options_path_length;
+	struct timespec start;
 	char item[1024];
 	char option[1024];
 
-	int version, result, bindresult;
-
-	if(ds!=NULL) return ds;
+	pthread_mutex_lock(&config_lock);
+	if(config_read) {
+		pthread_mutex_unlock(&config_lock);
+		return AD_SUCCESS;
+	}
+	ad_stats_now(&start);
 
 	/* get active directory host info
 		user name and password from options file */
@@ -93,6 +140,14 @@ LDAP *ad_login() {
 				bindpw=strdup(option);
 			else if(!search_base&&(strcmp(item, "searchbase")==0))
 				search_base=strdup(option);
+			else if(page_size<0&&(strcmp(item, "pagesize")==0))
+				page_size=atoi(option);
+			else if(!cache_file&&(strcmp(item, "cachefile")==0))
+				cache_file=strdup(option);
+			else if(cache_ttl<0&&(strcmp(item, "cachettl")==0))
+				cache_ttl=atoi(option);
+			else if(!tls_cache_file&&(strcmp(item, "tlscachefile")==0))
+				tls_cache_file=strdup(option);
 		}
 		fclose(options_fd);
 	}
@@ -100,19 +155,36 @@ LDAP *ad_login() {
 	if(!uri) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory uri parameter from config file %s, ~/.adtool.cfg or command line", config_file);
 		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
-		return 0;
+		pthread_mutex_unlock(&config_lock);
+		return ad_error_code;
 	}
 	if(!binddn) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory binddn parameter from config file %s, ~/.adtool.cfg or command line", config_file);
 		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
-		return 0;
+		pthread_mutex_unlock(&config_lock);
+		return ad_error_code;
 	}
 	if(!bindpw) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory bindpw (bind password) parameter from config file %s, ~/.adtool.cfg or command line", config_file);
 		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
-		return 0;
+		pthread_mutex_unlock(&config_lock);
+		return ad_error_code;
 	}
 
+	config_read=1;
+	ad_stats_phase(AD_PHASE_CONFIG, &start);
+	pthread_mutex_unlock(&config_lock);
+	return AD_SUCCESS;
+}
+
+/* open a new connection to the server and bind to it.
+	returns an ldap connection identifier or 0 on error */
+LDAP *ad_connect() {
+	LDAP *ds;
+	struct ad_op op;
+	struct ad_connect_timing timing;
+	int version, result, bindresult;
+
 	/* open the connection to the ldap server */
 	result=ldap_initialize(&ds, uri);
 	if(result!=LDAP_SUCCESS) {
@@ -126,6 +198,7 @@ LDAP *ad_login() {
 	if(result!=LDAP_OPT_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_set_option (protocol->v3): %s", ldap_err2string(result));
 		ad_error_code=AD_SERVER_CONNECT_FAILURE;
+		ldap_unbind_ext(ds, NULL, NULL);
 		return 0;
 	}
 
@@ -134,26 +207,46 @@ LDAP *ad_login() {
 	if(result!=LDAP_OPT_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_set_option (referrals=0): %s", ldap_err2string(result));
 		ad_error_code=AD_SERVER_CONNECT_FAILURE;
+		ldap_unbind_ext(ds, NULL, NULL);
 		return 0;
 	}
 
+	ad_tls_prepare(ds);
+
+	ad_stats_connecting(ds, &timing);
+	ad_op_start(&op, AD_OP_BIND, binddn);
 	bindresult=ldap_simple_bind_s(ds, binddn, bindpw);
+	ad_op_end(&op, bindresult);
+	ad_stats_connected(&timing);
 	if(bindresult!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_bind %s", ldap_err2string(bindresult));
 		ad_error_code=AD_SERVER_CONNECT_FAILURE;
 		ldap_perror(ds, "bind: ");
+		ldap_unbind_ext(ds, NULL, NULL);
 		return 0;
 	}
-
-	if(uri!=NULL) free(uri);
-	if(binddn!=NULL) free(binddn);
-	if(bindpw!=NULL) {
-		memset(bindpw, 0, sizeof(bindpw));
-		free(bindpw);
-	}
+	ad_tls_established(ds);
 
 	return ds;
+}
+
+/* connect and authenticate to active directory server.
+	returns the connection checked out of the pool by the calling
+	thread, or else the process wide connection, opening it on the
+	first call.  returns 0 on error */
+LDAP *ad_login() {
+	static LDAP *ds=NULL;
+	struct ad_thread_state *state;
+
+	state=ad_thread_state();
+	if(state->pool_slot>=0) return pool.connections[state->pool_slot];
 
+	pthread_mutex_lock(&login_lock);
+	if(ds==NULL && ad_read_config()==AD_SUCCESS)
+		ds=ad_connect();
+	pthread_mutex_unlock(&login_lock);
+
+	return ds;
 }
 
 /* 
@@ -183,6 +276,146 @@ char *dn2domain(char *dn) {
 	return dc;
 }
 
+int ad_dnlist_append(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct dnlist *list=data;
+
+	if(list->count+1>=list->size) {
+		list->size=list->size?list->size*2:64;
+		list->dns=realloc(list->dns, sizeof(char *)*list->size);
+	}
+	list->dns[list->count++]=strdup(dn);
+	list->dns[list->count]=NULL;
+	return 0;
+}
+
+/* read the results of search msgid one message at a time, calling
+	callback for each entry.  response_controls is set to the controls
+	of the final result, if any, for the caller to free.  if the
+	callback returns non-zero the search is abandoned and stop set.
+	returns the ldap result code of the search */
+int ad_search_results(LDAP *ds, int msgid, ad_search_callback callback,
+		void *data, LDAPControl ***response_controls, int *stop) {
+	LDAPMessage *res;
+	char *dn;
+	int result=LDAP_SUCCESS, parse_result, type=0;
+
+	*response_controls=NULL;
+	*stop=0;
+	while(type!=LDAP_RES_SEARCH_RESULT) {
+		if(ldap_result(ds, msgid, LDAP_MSG_ONE, NULL, &res)<=0) {
+			ldap_get_option(ds, LDAP_OPT_RESULT_CODE, &result);
+			if(result==LDAP_SUCCESS) result=LDAP_SERVER_DOWN;
+			return result;
+		}
+
+		type=ldap_msgtype(res);
+		if(type==LDAP_RES_SEARCH_ENTRY) {
+			ad_op_entry();
+			dn=ldap_get_dn(ds, res);
+			/* the caller's time isn't the search's */
+			ad_op_pause();
+			*stop=callback(ds, res, dn, data);
+			ad_op_resume();
+			ldap_memfree(dn);
+			ldap_msgfree(res);
+			if(*stop) {
+				ldap_abandon_ext(ds, msgid, NULL, NULL);
+				return LDAP_SUCCESS;
+			}
+		} else if(type==LDAP_RES_SEARCH_RESULT) {
+			parse_result=ldap_parse_result(ds, res, &result,
+				NULL, NULL, NULL, response_controls, 1);
+			if(parse_result!=LDAP_SUCCESS) result=parse_result;
+		} else {
+			/* referrals are turned off, skip references */
+			ldap_msgfree(res);
+		}
+	}
+	return result;
+}
+
+/*
+run a search using the simple paged results control (rfc 2696),
+calling callback for every entry as it arrives from the server.
+entries are freed as soon as the callback returns, so memory use
+doesn't grow with the size of the result set.  a page_size of 0
+turns paging off.  if the callback returns non-zero the search is
+abandoned.  control, if it isn't NULL, is sent along with the
+paging control.
+returns the ldap result code of the search
+*/
+int ad_paged_search_ext(LDAP *ds, char *base, int scope, char *filter,
+		char **attrs, int attrsonly, LDAPControl *control,
+		ad_search_callback callback, void *data) {
+	LDAPControl *page_control=NULL;
+	LDAPControl *server_controls[3];
+	LDAPControl **response_controls;
+	LDAPControl *page_response;
+	struct berval cookie;
+	struct ad_op op;
+	ber_int_t count;
+	int i, size, msgid, result, stop=0;
+
+	size=(page_size<0)?AD_DEFAULT_PAGE_SIZE:page_size;
+	cookie.bv_val=NULL;
+	cookie.bv_len=0;
+
+	ad_op_start(&op, AD_OP_SEARCH, base);
+
+	do {
+		i=0;
+		if(size>0) {
+			result=ldap_create_page_control(ds, size,
+				cookie.bv_val?&cookie:NULL, 0, &page_control);
+			if(result!=LDAP_SUCCESS) break;
+			server_controls[i++]=page_control;
+		}
+		if(control!=NULL) server_controls[i++]=control;
+		server_controls[i]=NULL;
+
+		ad_op_round_trip();
+		result=ldap_search_ext(ds, base, scope, filter, attrs,
+			attrsonly, i>0?server_controls:NULL, NULL,
+			NULL, LDAP_NO_LIMIT, &msgid);
+		if(page_control!=NULL) {
+			ldap_control_free(page_control);
+			page_control=NULL;
+		}
+		if(cookie.bv_val!=NULL) {
+			ldap_memfree(cookie.bv_val);
+			cookie.bv_val=NULL;
+			cookie.bv_len=0;
+		}
+		if(result!=LDAP_SUCCESS) break;
+
+		result=ad_search_results(ds, msgid, callback, data,
+			&response_controls, &stop);
+		if(stop) break;
+		if(response_controls!=NULL) {
+			page_response=ldap_control_find(
+				LDAP_CONTROL_PAGEDRESULTS,
+				response_controls, NULL);
+			if(page_response!=NULL)
+				ldap_parse_pageresponse_control(
+					ds, page_response,
+					&count, &cookie);
+			ldap_controls_free(response_controls);
+		}
+	} while(result==LDAP_SUCCESS && cookie.bv_val!=NULL
+			&& cookie.bv_len>0);
+
+	ad_op_end(&op, result);
+	if(cookie.bv_val!=NULL) ldap_memfree(cookie.bv_val);
+	return result;
+}
+
+int ad_paged_search(LDAP *ds, char *base, int scope, char *filter,
+		char **attrs, int attrsonly,
+		ad_search_callback callback, void *data) {
+	return ad_paged_search_ext(ds, base, scope, filter, attrs, attrsonly,
+		NULL, callback, data);
+}
+
 /* public functions */
 
 /* get a pointer to the last error message */
@@ -206,57 +439,98 @@ int ad_get_error_num() {
 	returns AD_SUCCESS on success 
 */
 int ad_create_user(char *username, char *dn) {
-	LDAP *ds;
-	LDAPMod *attrs[5];
-	LDAPMod attr1, attr2, attr3, attr4;
-	int result;
+	return ad_provision_user(username, dn, NULL, NULL);
+}
 
-	char *objectClass_values[]={"user", NULL};
-	char *name_values[2];
-	char *accountControl_values[]={"66050", NULL};
+/* put quotes around the password and convert it to the little endian
+	utf-16 that unicodePwd expects.  buffer must hold
+	(MAX_PASSWORD_LENGTH+2)*2 bytes.
+	returns the length of the encoded password */
+int ad_encode_password(char *password, char *buffer) {
+	char quoted_password[MAX_PASSWORD_LENGTH+3];
+	int i, length;
+
+	snprintf(quoted_password, sizeof(quoted_password), "\"%s\"", password);
+	length=strlen(quoted_password);
+	memset(buffer, 0, (MAX_PASSWORD_LENGTH+2)*2);
+	for(i=0; i<length; i++)
+		buffer[i*2]=quoted_password[i];
+	return length*2;
+}
+
+/* creates a user with the given attributes in a single add request.
+	with a password the account is created enabled with
+	userAccountControl=66048 (NORMAL_ACCOUNT|DONT_EXPIRE_PASSWORD),
+	without one it is locked as by ad_create_user().
+	returns AD_SUCCESS on success */
+int ad_provision_user(char *username, char *dn, char *password, ad_change *attributes) {
+	LDAP *ds;
+	struct ad_op op;
+	LDAPMod **attrs;
+	ad_change *changes;
+	char unicode_password[(MAX_PASSWORD_LENGTH+2)*2];
 	char *upn, *domain;
-	char *upn_values[2];
+	int i, n, num_attributes, result;
+	int have_account_control=0;
 
 	ds=ad_login();
 	if(!ds) return ad_error_code;
 
-	attr1.mod_op = LDAP_MOD_ADD;
-	attr1.mod_type = "objectClass";
-	attr1.mod_values = objectClass_values;
-
-	name_values[0]=username;
-	name_values[1]=NULL;
-	attr2.mod_op = LDAP_MOD_ADD;
-	attr2.mod_type = "sAMAccountName";
-	attr2.mod_values = name_values;
-	
-	attr3.mod_op = LDAP_MOD_ADD;
-	attr3.mod_type = "userAccountControl";
-	attr3.mod_values = accountControl_values;
+	num_attributes=0;
+	if(attributes!=NULL) {
+		for(; attributes[num_attributes].attribute!=NULL; num_attributes++) {
+			if(!strcasecmp(attributes[num_attributes].attribute, "userAccountControl"))
+				have_account_control=1;
+		}
+	}
 
 	domain=dn2domain(dn);
 	upn=malloc(strlen(username)+strlen(domain)+2);
 	sprintf(upn, "%s@%s", username, domain);
-	upn_values[0]=upn;
-	upn_values[1]=NULL;
-	attr4.mod_op = LDAP_MOD_ADD;
-	attr4.mod_type = "userPrincipalName";
-	attr4.mod_values = upn_values;
 
-	attrs[0]=&attr1;
-	attrs[1]=&attr2;
-	attrs[2]=&attr3;
-	attrs[3]=&attr4;
-	attrs[4]=NULL;
+	changes=malloc(sizeof(ad_change)*(num_attributes+6));
+	n=0;
+	changes[n].attribute="objectClass";
+	changes[n].value="user";
+	changes[n++].length=-1;
+	changes[n].attribute="sAMAccountName";
+	changes[n].value=username;
+	changes[n++].length=-1;
+	changes[n].attribute="userPrincipalName";
+	changes[n].value=upn;
+	changes[n++].length=-1;
+	if(!have_account_control) {
+		changes[n].attribute="userAccountControl";
+		changes[n].value=(password!=NULL)?"66048":"66050";
+		changes[n++].length=-1;
+	}
+	if(password!=NULL) {
+		changes[n].attribute="unicodePwd";
+		changes[n].value=unicode_password;
+		changes[n++].length=ad_encode_password(password, unicode_password);
+	}
+	for(i=0; i<num_attributes; i++) {
+		changes[n++]=attributes[i];
+	}
+	changes[n].attribute=NULL;
+	for(i=0; i<n; i++) changes[i].op=LDAP_MOD_ADD;
 
-	result=ldap_add_s(ds, dn, attrs);
+	attrs=ad_build_mods(changes);
+	ad_op_start(&op, AD_OP_ADD, dn);
+	result=ldap_add_ext_s(ds, dn, attrs, NULL, NULL);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_add %s", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, NULL);
 	}
 
+	memset(unicode_password, 0, sizeof(unicode_password));
+	ad_free_mods(attrs);
+	free(changes);
+	free(upn);
 	free(domain);
 	return ad_error_code;
 }
@@ -271,6 +545,7 @@ int ad_create_user(char *username, char *dn) {
 */
 int ad_create_computer(char *name, char *dn) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[4];
 	LDAPMod attr1, attr2, attr3;
 	int i, result;
@@ -305,12 +580,15 @@ int ad_create_computer(char *name, char *dn) {
 	attrs[2]=&attr3;
 	attrs[3]=NULL;
 
+	ad_op_start(&op, AD_OP_ADD, dn);
 	result=ldap_add_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_add %s", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, NULL);
 	}
 	return ad_error_code;
 }
@@ -319,17 +597,21 @@ int ad_create_computer(char *name, char *dn) {
 	returns non-zero on success */
 int ad_object_delete(char *dn) {
 	LDAP *ds;
+	struct ad_op op;
 	int result;
 
 	ds=ad_login();
 	if(!ds) return ad_error_code;
 
+	ad_op_start(&op, AD_OP_DELETE, dn);
 	result=ldap_delete_s(ds, dn);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_delete: %s", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, NULL);
 	}
 	return ad_error_code;
 }
@@ -338,9 +620,8 @@ int ad_object_delete(char *dn) {
 	returns AD_SUCCESS on success */
 int ad_setpass(char *dn, char *password) {
 	LDAP *ds;
-	char quoted_password[MAX_PASSWORD_LENGTH+2];
+	struct ad_op op;
 	char unicode_password[(MAX_PASSWORD_LENGTH+2)*2];
-	int i;
 	LDAPMod *attrs[2];
 	LDAPMod attr1;
 	struct berval *bervalues[2];
@@ -350,15 +631,8 @@ int ad_setpass(char *dn, char *password) {
 	ds=ad_login();
 	if(!ds) return ad_error_code;
 
-	/* put quotes around the password */
-	snprintf(quoted_password, sizeof(quoted_password), "\"%s\"", password);
-	/* unicode the password string */
-	memset(unicode_password, 0, sizeof(unicode_password));
-	for(i=0; i<strlen(quoted_password); i++)
-		unicode_password[i*2]=quoted_password[i];
-
 	pw.bv_val = unicode_password;
-	pw.bv_len = strlen(quoted_password)*2;
+	pw.bv_len = ad_encode_password(password, unicode_password);
 
 	bervalues[0]=&pw;
 	bervalues[1]=NULL;
@@ -370,7 +644,9 @@ int ad_setpass(char *dn, char *password) {
 	attrs[0]=&attr1;
 	attrs[1]=NULL;
 
+	ad_op_start(&op, AD_OP_MODIFY, dn);
 	result = ldap_modify_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_modify for password: %s", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
@@ -386,11 +662,8 @@ char **ad_search(char *attribute, char *value) {
 	char *filter;
 	int filter_length;
 	char *attrs[]={"1.1", NULL};
-	LDAPMessage *res;
-	LDAPMessage *entry;
-	int i, result, num_results;
-	char **dnlist;
-	char *dn;
+	struct dnlist list={NULL, 0, 0};
+	int result, i;
 
 	ds=ad_login();
 	if(!ds) return (char **)-1;
@@ -405,46 +678,63 @@ char **ad_search(char *attribute, char *value) {
 	filter=malloc(filter_length);
 	snprintf(filter, filter_length, "(%s=%s)", attribute, value);
 
-	result=ldap_search_s(ds, search_base, LDAP_SCOPE_SUBTREE, filter, attrs, 1, &res);
+	result=ad_paged_search(ds, search_base, LDAP_SCOPE_SUBTREE, filter, attrs, 1, ad_dnlist_append, &list);
+	free(filter);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, 
-			"Error in ldap_search_s for ad_search: %s", 
+			"Error in ldap_search_ext for ad_search: %s", 
 			ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+		for(i=0; i<list.count; i++) free(list.dns[i]);
+		if(list.dns!=NULL) free(list.dns);
 		return (char **)-1;
 	}
-	free(filter);
 
-	num_results=ldap_count_entries(ds, res);
-	if(num_results==0) {
-		ldap_msgfree(res);
+	if(list.count==0) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH,
 			"%s not found", value);
 		ad_error_code=AD_OBJECT_NOT_FOUND;
 		return NULL;
 	}
 
-	dnlist=malloc(sizeof(char *)*(num_results+1));
+	ad_error_code=AD_SUCCESS;
+	return list.dns;
+}
 
-	entry=ldap_first_entry(ds, res);
-	dn=ldap_get_dn(ds, entry);
-	dnlist[0]=strdup(dn);
+/* streaming search, calls callback for each entry as it arrives */
+int ad_search_each(char *base, int scope, char *filter, char **attrs,
+		ad_search_callback callback, void *data) {
+	LDAP *ds;
+	char *default_attrs[]={"1.1", NULL};
+	int result;
 
-	for(i=1; (entry=ldap_next_entry(ds, entry))!=NULL; i++) {
-		dn=ldap_get_dn(ds, entry);
-		dnlist[i]=strdup(dn);
-	}
-	dnlist[i]=NULL;
+	ds=ad_login();
+	if(!ds) return ad_error_code;
 
-	ldap_memfree(dn);
-	ldap_msgfree(res);
+	if(base==NULL) base=search_base;
+	if(!base) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+		return ad_error_code;
+	}
+	if(filter==NULL) filter="(objectclass=*)";
+	if(attrs==NULL) attrs=default_attrs;
 
-	ad_error_code=AD_SUCCESS;
-	return dnlist;
+	result=ad_paged_search(ds, base, scope, filter, attrs, 0, callback, data);
+	if(result!=LDAP_SUCCESS) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ldap_search_ext for ad_search_each: %s",
+			ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	} else {
+		ad_error_code=AD_SUCCESS;
+	}
+	return ad_error_code;
 }
 
 int ad_mod_add(char *dn, char *attribute, char *value) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[2];
 	LDAPMod attr;
 	char *values[2];
@@ -463,18 +753,22 @@ int ad_mod_add(char *dn, char *attribute, char *value) {
 	attrs[0] = &attr;
 	attrs[1] = NULL;
 
+	ad_op_start(&op, AD_OP_MODIFY, dn);
 	result = ldap_modify_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ad_mod_add, ldap_mod_s: %s\n", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, attribute);
 	}
 	return ad_error_code;
 }
 
 int ad_mod_add_binary(char *dn, char *attribute, char *data, int data_length) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[2];
 	LDAPMod attr;
 	struct berval *values[2];
@@ -497,18 +791,22 @@ int ad_mod_add_binary(char *dn, char *attribute, char *data, int data_length) {
 	attrs[0] = &attr;
 	attrs[1] = NULL;
 
+	ad_op_start(&op, AD_OP_MODIFY, dn);
 	result = ldap_modify_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ad_mod_add_binary, ldap_mod_s: %s\n", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, attribute);
 	}
 	return ad_error_code;
 }
 
 int ad_mod_replace(char *dn, char *attribute, char *value) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[2];
 	LDAPMod attr;
 	char *values[2];
@@ -527,18 +825,22 @@ int ad_mod_replace(char *dn, char *attribute, char *value) {
 	attrs[0] = &attr;
 	attrs[1] = NULL;
 
+	ad_op_start(&op, AD_OP_MODIFY, dn);
 	result = ldap_modify_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ad_mod_replace, ldap_mod_s: %s\n", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, attribute);
 	}
 	return ad_error_code;
 }
 
 int ad_mod_replace_binary(char *dn, char *attribute, char *data, int data_length) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[2];
 	LDAPMod attr;
 	struct berval *values[2];
@@ -561,18 +863,22 @@ int ad_mod_replace_binary(char *dn, char *attribute, char *data, int data_length
 	attrs[0] = &attr;
 	attrs[1] = NULL;
 
+	ad_op_start(&op, AD_OP_MODIFY, dn);
 	result = ldap_modify_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ad_mod_replace_binary, ldap_mod_s: %s\n", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, attribute);
 	}
 	return ad_error_code;
 }
 
 int ad_mod_delete(char *dn, char *attribute, char *value) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[2];
 	LDAPMod attr;
 	char *values[2];
@@ -591,72 +897,437 @@ int ad_mod_delete(char *dn, char *attribute, char *value) {
 	attrs[0] = &attr;
 	attrs[1] = NULL;
 
+	ad_op_start(&op, AD_OP_MODIFY, dn);
 	result = ldap_modify_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ad_mod_replace, ldap_mod_s: %s\n", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, attribute);
+	}
+	return ad_error_code;
+}
+
+/* turn a list of ad_changes into an ldap modification list.
+	consecutive changes of the same kind to an attribute are merged
+	into one modification with several values, as long as no other
+	change to that attribute comes between them.
+	free the result with ad_free_mods() */
+LDAPMod **ad_build_mods(ad_change *changes) {
+	LDAPMod **mods;
+	LDAPMod *mod;
+	struct berval *value;
+	int num_changes, num_mods=0, num_values;
+	int i, j;
+
+	for(num_changes=0; changes[num_changes].attribute!=NULL; num_changes++);
+	mods=malloc(sizeof(LDAPMod *)*(num_changes+1));
+
+	for(i=0; i<num_changes; i++) {
+		/* find the last modification of this attribute */
+		mod=NULL;
+		for(j=num_mods-1; j>=0; j--) {
+			if(!strcasecmp(mods[j]->mod_type, changes[i].attribute)) {
+				mod=mods[j];
+				break;
+			}
+		}
+		if(mod==NULL || (mod->mod_op&~LDAP_MOD_BVALUES)!=changes[i].op
+				|| mod->mod_bvalues==NULL
+				|| changes[i].value==NULL) {
+			mod=malloc(sizeof(LDAPMod));
+			mod->mod_op=changes[i].op|LDAP_MOD_BVALUES;
+			mod->mod_type=changes[i].attribute;
+			mod->mod_bvalues=NULL;
+			mods[num_mods++]=mod;
+			/* a NULL value deletes or replaces every value */
+			if(changes[i].value==NULL) continue;
+		}
+
+		for(num_values=0; mod->mod_bvalues!=NULL
+				&& mod->mod_bvalues[num_values]!=NULL; num_values++);
+		mod->mod_bvalues=realloc(mod->mod_bvalues,
+				sizeof(struct berval *)*(num_values+2));
+		value=malloc(sizeof(struct berval));
+		value->bv_val=changes[i].value;
+		value->bv_len=(changes[i].length<0)?strlen(changes[i].value)
+				:changes[i].length;
+		mod->mod_bvalues[num_values]=value;
+		mod->mod_bvalues[num_values+1]=NULL;
+	}
+	mods[num_mods]=NULL;
+	return mods;
+}
+
+/* free a list made by ad_build_mods(), the values themselves
+	belong to the caller */
+void ad_free_mods(LDAPMod **mods) {
+	int i, j;
+
+	for(i=0; mods[i]!=NULL; i++) {
+		if(mods[i]->mod_bvalues!=NULL) {
+			for(j=0; mods[i]->mod_bvalues[j]!=NULL; j++)
+				free(mods[i]->mod_bvalues[j]);
+			free(mods[i]->mod_bvalues);
+		}
+		free(mods[i]);
+	}
+	free(mods);
+}
+
+/* make several changes to an object in a single modify request */
+int ad_modify(char *dn, ad_change *changes) {
+	LDAP *ds;
+	struct ad_op op;
+	LDAPMod **mods;
+	int i, result;
+
+	ds=ad_login();
+	if(!ds) return ad_error_code;
+
+	mods=ad_build_mods(changes);
+	if(mods[0]==NULL) {
+		ad_free_mods(mods);
+		ad_error_code=AD_SUCCESS;
+		return ad_error_code;
+	}
+
+	ad_op_start(&op, AD_OP_MODIFY, dn);
+	result=ldap_modify_ext_s(ds, dn, mods, NULL, NULL);
+	ad_op_end(&op, result);
+	if(result!=LDAP_SUCCESS) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ad_modify, ldap_modify_ext_s: %s\n", ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	} else {
+		ad_error_code=AD_SUCCESS;
+		for(i=0; mods[i]!=NULL; i++)
+			ad_cache_forget(dn, mods[i]->mod_type);
+	}
+	ad_free_mods(mods);
+	return ad_error_code;
+}
+
+/* ranged retrieval.  active directory returns at most MaxValRange
+	(1500 by default) values of an attribute at once, naming the
+	attribute "member;range=0-1499" when it has held some back.  the
+	rest are asked for as "member;range=1500-*" and so on until a
+	range ending in * comes back */
+
+struct range_search {
+	char *attribute;
+	int length;
+	ad_value_callback callback;
+	void *data;
+	int entries;
+	int next;
+	int stop;
+};
+
+/* the low end of the next range to ask for if the attribute name
+	returned has a range option that doesn't end in *, otherwise -1 */
+int ad_next_range(char *attribute) {
+	char *option, *high;
+
+	for(option=strchr(attribute, ';'); option!=NULL; option=strchr(option, ';')) {
+		option++;
+		if(strncasecmp(option, "range=", 6)) continue;
+		high=strchr(option, '-');
+		if(high==NULL || high[1]=='*') return -1;
+		return atoi(high+1)+1;
+	}
+	return -1;
+}
+
+/* whether attribute is the one asked for, allowing for options */
+int ad_attribute_matches(char *attribute, char *requested) {
+	int length;
+
+	length=strlen(requested);
+	return !strncasecmp(attribute, requested, length)
+		&& (attribute[length]=='\0' || attribute[length]==';');
+}
+
+int ad_range_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct range_search *search=data;
+	BerElement *ber;
+	struct berval **values;
+	char *attribute;
+	int i;
+
+	search->entries++;
+	for(attribute=ldap_first_attribute(ds, entry, &ber);
+			attribute!=NULL;
+			attribute=ldap_next_attribute(ds, entry, ber)) {
+		if(!search->stop && ad_attribute_matches(attribute, search->attribute)) {
+			search->next=ad_next_range(attribute);
+			values=ldap_get_values_len(ds, entry, attribute);
+			for(i=0; values!=NULL && values[i]!=NULL; i++) {
+				if(search->callback(values[i], search->data)) {
+					search->stop=1;
+					break;
+				}
+			}
+			if(values!=NULL) ldap_value_free_len(values);
+		}
+		ldap_memfree(attribute);
+	}
+	if(ber!=NULL) ber_free(ber, 0);
+	return search->stop;
+}
+
+/* fetch the values of attribute starting at value number first */
+int ad_get_range_values(char *dn, char *attribute, int first, ad_value_callback callback, void *data) {
+	LDAP *ds;
+	struct range_search search;
+	char *attrs[2];
+	int request_length, result;
+
+	ds=ad_login();
+	if(!ds) return ad_error_code;
+
+	search.attribute=attribute;
+	search.length=strlen(attribute);
+	search.callback=callback;
+	search.data=data;
+	search.stop=0;
+
+	request_length=search.length+32;
+	attrs[0]=malloc(request_length);
+	attrs[1]=NULL;
+	/* small attributes come back whole when asked for without a range */
+	if(first==0) strcpy(attrs[0], attribute);
+	else snprintf(attrs[0], request_length, "%s;range=%d-*", attribute, first);
+
+	for(;;) {
+		search.entries=0;
+		search.next=-1;
+		result=ad_paged_search(ds, dn, LDAP_SCOPE_BASE, "(objectclass=*)", attrs, 0, ad_range_entry, &search);
+		if(result==LDAP_NO_SUCH_OBJECT || (result==LDAP_SUCCESS && search.entries==0)) {
+			snprintf(ad_error_msg, MAX_ERR_LENGTH,
+				"No entries found in ad_get_values_each for %s.", dn);
+			ad_error_code=AD_OBJECT_NOT_FOUND;
+			break;
+		} else if(result!=LDAP_SUCCESS) {
+			snprintf(ad_error_msg, MAX_ERR_LENGTH,
+				"Error in ldap_search_ext for ad_get_values_each: %s",
+				ldap_err2string(result));
+			ad_error_code=AD_LDAP_OPERATION_FAILURE;
+			break;
+		}
+		ad_error_code=AD_SUCCESS;
+		if(search.stop || search.next<0) break;
+		snprintf(attrs[0], request_length, "%s;range=%d-*", attribute, search.next);
 	}
+
+	free(attrs[0]);
 	return ad_error_code;
 }
 
+int ad_get_values_each(char *dn, char *attribute, ad_value_callback callback, void *data) {
+	return ad_get_range_values(dn, attribute, 0, callback, data);
+}
+
+struct value_list {
+	char **values;
+	int count;
+	int size;
+};
+
+int ad_value_list_append(struct berval *value, void *data) {
+	struct value_list *list=data;
+
+	if(list->count+1>=list->size) {
+		list->size=list->size?list->size*2:64;
+		list->values=realloc(list->values, sizeof(char *)*list->size);
+	}
+	list->values[list->count]=malloc(value->bv_len+1);
+	memcpy(list->values[list->count], value->bv_val, value->bv_len);
+	list->values[list->count][value->bv_len]='\0';
+	list->count++;
+	list->values[list->count]=NULL;
+	return 0;
+}
+
 /* ad_get_attribute returns a NULL terminated array of character strings
 	with one entry for each attribute/value pair
 	returns NULL if no values are found */
 char **ad_get_attribute(char *dn, char *attribute) {
+	struct value_list list={NULL, 0, 0};
+
+	if(ad_get_values_each(dn, attribute, ad_value_list_append, &list)!=AD_SUCCESS) {
+		if(list.values!=NULL) free(list.values);
+		return NULL;
+	}
+	if(list.count==0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ldap_get_values for ad_get_attribute:"
+			"no values found for attribute %s in object %s",
+			attribute, dn);
+		ad_error_code=AD_ATTRIBUTE_ENTRY_NOT_FOUND;
+		return NULL;
+	}
+	return list.values;
+}
+
+struct attribute_search {
+	int entries;
+	char *dn;
+	ad_attribute *attributes;
+};
+
+/* ad_paged_search callback keeping the attributes of the first entry */
+int ad_collect_attributes(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct attribute_search *search=data;
+	BerElement *ber;
+	char *attribute;
+	int count=0, size=8;
+
+	search->entries++;
+	if(search->entries>1) return 1;
+
+	search->dn=strdup(dn);
+	search->attributes=malloc(sizeof(ad_attribute)*size);
+	for(attribute=ldap_first_attribute(ds, entry, &ber);
+			attribute!=NULL;
+			attribute=ldap_next_attribute(ds, entry, ber)) {
+		if(count+1==size) {
+			size*=2;
+			search->attributes=realloc(search->attributes, sizeof(ad_attribute)*size);
+		}
+		search->attributes[count].name=strdup(attribute);
+		search->attributes[count].values=ldap_get_values_len(ds, entry, attribute);
+		count++;
+		ldap_memfree(attribute);
+	}
+	if(ber!=NULL) ber_free(ber, 0);
+	search->attributes[count].name=NULL;
+	search->attributes[count].values=NULL;
+	return 0;
+}
+
+struct berval_list {
+	struct berval **values;
+	int count;
+	int size;
+};
+
+int ad_berval_list_append(struct berval *value, void *data) {
+	struct berval_list *list=data;
+
+	if(list->count+1>=list->size) {
+		list->size*=2;
+		list->values=ber_memrealloc(list->values, sizeof(struct berval *)*list->size);
+	}
+	list->values[list->count++]=ber_bvdup(value);
+	list->values[list->count]=NULL;
+	return 0;
+}
+
+/* if attribute holds the first range of a ranged attribute fetch the
+	remaining values onto it, and give it its plain name */
+int ad_complete_range(char *dn, ad_attribute *attribute) {
+	struct berval_list list;
+	char *options;
+	int next;
+
+	next=ad_next_range(attribute->name);
+	options=strchr(attribute->name, ';');
+	if(next<0 || options==NULL) return AD_SUCCESS;
+
+	*options='\0';
+	list.values=attribute->values;
+	list.count=(list.values==NULL)?0:ldap_count_values_len(list.values);
+	list.size=list.count+1;
+	if(list.values==NULL)
+		list.values=ber_memrealloc(NULL, sizeof(struct berval *)*list.size);
+
+	ad_get_range_values(dn, attribute->name, next, ad_berval_list_append, &list);
+	attribute->values=list.values;
+	return ad_error_code;
+}
+
+ad_attribute *ad_get_attributes(char *object, char **attrs) {
 	LDAP *ds;
-	char **values;
-	int result;
-	char *attrs[2];
-	LDAPMessage *res;
-	LDAPMessage *entry;
-	int num_entries;
+	struct attribute_search search={0, NULL, NULL};
+	char *base, *filter;
+	int i, scope, result;
 
 	ds=ad_login();
 	if(!ds) return NULL;
 
-	attrs[0]=attribute;
-	attrs[1]=NULL;
+	if(object[0]=='(') {
+		if(!search_base) {
+			snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+			ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+			return NULL;
+		}
+		base=search_base;
+		scope=LDAP_SCOPE_SUBTREE;
+		filter=object;
+	} else {
+		base=object;
+		scope=LDAP_SCOPE_BASE;
+		filter="(objectclass=*)";
+	}
 
-	result=ldap_search_s(ds, dn, LDAP_SCOPE_BASE, "(objectclass=*)", attrs, 0, &res);
-	if(result!=LDAP_SUCCESS) {
+	result=ad_paged_search(ds, base, scope, filter, attrs, 0, ad_collect_attributes, &search);
+	if(result!=LDAP_SUCCESS && result!=LDAP_NO_SUCH_OBJECT) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH,
-			"Error in ldap_search_s for ad_get_attribute: %s",
+			"Error in ldap_search_ext for ad_get_attributes: %s",
 			ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+		ad_free_attributes(search.attributes);
+		if(search.dn!=NULL) free(search.dn);
 		return NULL;
 	}
-	num_entries=ldap_count_entries(ds, res);
-	if(num_entries==0) {
-		snprintf(ad_error_msg, MAX_ERR_LENGTH, 
-			"No entries found in ad_get_attribute for user %s.",
-			dn);
-		ldap_msgfree(res);
+	if(search.entries==0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"No entries found in ad_get_attributes for %s.", object);
 		ad_error_code=AD_OBJECT_NOT_FOUND;
 		return NULL;
-	} else if(num_entries>1) {
-		snprintf(ad_error_msg, MAX_ERR_LENGTH, 
-			"More than one entry found in "
-			"ad_get_attributes for user %s.",
-			dn);
-		ldap_msgfree(res);
+	} else if(search.entries>1) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"More than one entry found in ad_get_attributes for %s.",
+			object);
+		ad_free_attributes(search.attributes);
+		free(search.dn);
 		ad_error_code=AD_OBJECT_NOT_FOUND;
 		return NULL;
 	}
 
-	entry=ldap_first_entry(ds, res);
-	values=ldap_get_values(ds, entry, attribute);
-	if(values==NULL) {
+	/* fetch the rest of any attributes too big to come back whole */
+	for(i=0; search.attributes[i].name!=NULL; i++) {
+		if(ad_complete_range(search.dn, &search.attributes[i])!=AD_SUCCESS) {
+			ad_free_attributes(search.attributes);
+			free(search.dn);
+			return NULL;
+		}
+	}
+	free(search.dn);
+
+	if(search.attributes[0].name==NULL) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH,
-			"Error in ldap_get_values for ad_get_attribute:"
-			"no values found for attribute %s in object %s",
-			attribute, dn);
+			"no values found for the attributes requested of %s",
+			object);
 		ad_error_code=AD_ATTRIBUTE_ENTRY_NOT_FOUND;
 	} else {
 		ad_error_code=AD_SUCCESS;
 	}
-	return values;
+	return search.attributes;
+}
+
+void ad_free_attributes(ad_attribute *attributes) {
+	int i;
+
+	if(attributes==NULL) return;
+	for(i=0; attributes[i].name!=NULL; i++) {
+		free(attributes[i].name);
+		if(attributes[i].values!=NULL)
+			ldap_value_free_len(attributes[i].values);
+	}
+	free(attributes);
 }
 
 /* 
@@ -666,6 +1337,7 @@ char **ad_get_attribute(char *dn, char *attribute) {
 */
 int ad_rename_user(char *dn, char *new_username) {
 	LDAP *ds;
+	struct ad_op op;
 	int result;
 	char *new_rdn;
 	char *domain, *upn;
@@ -687,7 +1359,9 @@ int ad_rename_user(char *dn, char *new_username) {
 	new_rdn=malloc(strlen(new_username)+4);
 	sprintf(new_rdn, "cn=%s", new_username);
 
+	ad_op_start(&op, AD_OP_RENAME, dn);
 	result=ldap_modrdn2_s(ds, dn, new_rdn, 1);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH,
 		"Error in ldap_modrdn2_s for ad_rename_user: %s\n",
@@ -698,6 +1372,7 @@ int ad_rename_user(char *dn, char *new_username) {
 	}
 
 	ad_error_code=AD_SUCCESS;
+	ad_cache_forget(dn, NULL);
 	free(new_rdn);
 	return ad_error_code;
 }
@@ -709,6 +1384,7 @@ int ad_rename_user(char *dn, char *new_username) {
 */
 int ad_move_user(char *current_dn, char *new_container) {
 	LDAP *ds;
+	struct ad_op op;
 	int result;
 	char **exdn;
 	char **username, *domain, *upn;
@@ -741,8 +1417,10 @@ int ad_move_user(char *current_dn, char *new_container) {
 		return ad_error_code;
 	}
 
+	ad_op_start(&op, AD_OP_RENAME, current_dn);
 	result=ldap_rename_s(ds, current_dn, exdn[0], new_container,
 				1, NULL, NULL);
+	ad_op_end(&op, result);
 	ldap_memfree(exdn);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH,
@@ -751,6 +1429,7 @@ int ad_move_user(char *current_dn, char *new_container) {
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(current_dn, NULL);
 	}
 	return ad_error_code;
 }
@@ -811,6 +1490,7 @@ int ad_unlock_user(char *dn) {
 */
 int ad_group_create(char *group_name, char *dn) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[4];
 	LDAPMod attr1, attr2, attr3;
 	int result;
@@ -843,12 +1523,15 @@ int ad_group_create(char *group_name, char *dn) {
 	attrs[2]=&attr3;
 	attrs[3]=NULL;
 
+	ad_op_start(&op, AD_OP_ADD, dn);
 	result=ldap_add_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_add: %s", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, NULL);
 	}
 	return ad_error_code;
 }
@@ -861,57 +1544,682 @@ int ad_group_remove_user(char *group_dn, char *user_dn) {
 	return ad_mod_delete(group_dn, "member", user_dn);
 }
 
-/* Remove the user from all groups below the given container */
-int ad_group_subtree_remove_user(char *container_dn, char *user_dn) {
-	LDAP *ds;
-	char *filter;
-	int filter_length;
-	char *attrs[]={"1.1", NULL};
-	LDAPMessage *res;
-	LDAPMessage *entry;
-	int result, num_results;
-	char *group_dn=NULL;
+/* group membership sync.  the wanted members are put in a hash keyed
+	by normalized dn holding the dn as given.  current members are
+	streamed through it with ranged retrieval: those not wanted are
+	removed and wanted ones have their value cleared, leaving the
+	members to add.  changes go through a pipeline in multi-valued
+	chunks.  a chunk fails as a whole if any one value is bad, so
+	failed chunks are retried a value at a time to apply the rest */
+
+#define AD_SYNC_CHUNK 500
+
+struct group_sync {
+	struct ad_hash *wanted;
+	char **removes;
+	int remove_count;
+	int remove_size;
+	char **adds;
+	int add_count;
+	int *failed;
+	int failures;
+	char message[MAX_ERR_LENGTH];
+};
+
+int ad_group_sync_member(struct berval *value, void *data) {
+	struct group_sync *sync=data;
+	char *dn, *normal;
+	void **wanted;
+
+	dn=malloc(value->bv_len+1);
+	memcpy(dn, value->bv_val, value->bv_len);
+	dn[value->bv_len]='\0';
+	normal=ad_normalize_dn(dn);
+
+	wanted=ad_hash_find(sync->wanted, normal);
+	if(wanted!=NULL) {
+		*wanted=NULL;
+		free(dn);
+	} else {
+		if(sync->remove_count==sync->remove_size) {
+			sync->remove_size=sync->remove_size?sync->remove_size*2:256;
+			sync->removes=realloc(sync->removes, sizeof(char *)*sync->remove_size);
+		}
+		sync->removes[sync->remove_count++]=dn;
+	}
+	free(normal);
+	return 0;
+}
 
-	ds=ad_login();
-	if(!ds) return ad_error_code;
+void ad_group_sync_add(char *key, void *value, void *data) {
+	struct group_sync *sync=data;
 
-	filter_length=(strlen(user_dn)+255);
-	filter=malloc(filter_length);
-	snprintf(filter, filter_length, 
-		"(&(objectclass=group)(member=%s))", user_dn);
+	if(value!=NULL) sync->adds[sync->add_count++]=value;
+}
+
+void ad_group_sync_result(int sequence, char *dn, int result, char *message, void *data) {
+	struct group_sync *sync=data;
+
+	if(result==LDAP_SUCCESS) return;
+	if(sync->failed!=NULL) sync->failed[sequence]=1;
+	if(sync->failures++==0)
+		snprintf(sync->message, MAX_ERR_LENGTH, "%s", message);
+}
+
+/* send values as chunks of op on the member attribute */
+void ad_group_sync_send(ad_pipeline *p, char *group_dn, int op, char **values, int count, int chunk_size) {
+	ad_change changes[AD_SYNC_CHUNK+1];
+	int i, j;
+
+	for(i=0; i<count; i+=chunk_size) {
+		for(j=0; j<chunk_size && i+j<count; j++) {
+			changes[j].op=op;
+			changes[j].attribute="member";
+			changes[j].value=values[i+j];
+			changes[j].length=-1;
+		}
+		changes[j].attribute=NULL;
+		ad_pipeline_change(p, group_dn, changes);
+	}
+}
+
+int ad_group_sync(char *group_dn, char **members, int *added, int *removed) {
+	struct group_sync sync;
+	ad_pipeline *p;
+	void **slot;
+	char *normal;
+	int *failed;
+	int i, j, count, add_chunks, chunks, result;
+	int add_failures, remove_failures;
+
+	*added=0;
+	*removed=0;
+	for(count=0; members[count]!=NULL; count++);
+
+	memset(&sync, 0, sizeof(sync));
+	sync.wanted=ad_hash_new(count);
+	for(i=0; i<count; i++) {
+		normal=ad_normalize_dn(members[i]);
+		slot=ad_hash_insert(sync.wanted, normal, NULL);
+		*slot=members[i];
+		free(normal);
+	}
+
+	result=ad_get_values_each(group_dn, "member", ad_group_sync_member, &sync);
+	if(result!=AD_SUCCESS) goto done;
+
+	sync.adds=malloc(sizeof(char *)*(ad_hash_count(sync.wanted)+1));
+	ad_hash_each(sync.wanted, ad_group_sync_add, &sync);
+
+	add_chunks=(sync.add_count+AD_SYNC_CHUNK-1)/AD_SYNC_CHUNK;
+	chunks=add_chunks+(sync.remove_count+AD_SYNC_CHUNK-1)/AD_SYNC_CHUNK;
+	sync.failed=calloc(chunks+1, sizeof(int));
+
+	p=ad_pipeline_new(0, ad_group_sync_result, &sync);
+	if(p==NULL) {
+		result=ad_error_code;
+		goto done;
+	}
+	ad_group_sync_send(p, group_dn, LDAP_MOD_ADD, sync.adds, sync.add_count, AD_SYNC_CHUNK);
+	ad_group_sync_send(p, group_dn, LDAP_MOD_DELETE, sync.removes, sync.remove_count, AD_SYNC_CHUNK);
+	ad_pipeline_flush(p);
+
+	/* retry the values of failed chunks one at a time, adds and then
+		removes so their failures can be counted apart */
+	failed=sync.failed;
+	sync.failed=NULL;
+	add_failures=0;
+	remove_failures=0;
+	for(i=0; i<chunks; i++) {
+		if(!failed[i]) continue;
+		if(i<add_chunks) {
+			j=i*AD_SYNC_CHUNK;
+			count=(sync.add_count-j<AD_SYNC_CHUNK)?sync.add_count-j:AD_SYNC_CHUNK;
+			sync.failures=0;
+			ad_group_sync_send(p, group_dn, LDAP_MOD_ADD, sync.adds+j, count, 1);
+			ad_pipeline_flush(p);
+			add_failures+=sync.failures;
+		} else {
+			j=(i-add_chunks)*AD_SYNC_CHUNK;
+			count=(sync.remove_count-j<AD_SYNC_CHUNK)?sync.remove_count-j:AD_SYNC_CHUNK;
+			sync.failures=0;
+			ad_group_sync_send(p, group_dn, LDAP_MOD_DELETE, sync.removes+j, count, 1);
+			ad_pipeline_flush(p);
+			remove_failures+=sync.failures;
+		}
+	}
+	free(failed);
+	ad_pipeline_free(p);
+
+	*added=sync.add_count-add_failures;
+	*removed=sync.remove_count-remove_failures;
+	if(add_failures+remove_failures>0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"%d of %d membership changes to %s failed: %.512s",
+			add_failures+remove_failures,
+			sync.add_count+sync.remove_count, group_dn, sync.message);
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	} else {
+		ad_error_code=AD_SUCCESS;
+	}
+	result=ad_error_code;
+
+done:
+	ad_hash_free(sync.wanted, NULL);
+	for(i=0; i<sync.remove_count; i++) free(sync.removes[i]);
+	if(sync.removes!=NULL) free(sync.removes);
+	if(sync.adds!=NULL) free(sync.adds);
+	if(sync.failed!=NULL) free(sync.failed);
+	return result;
+}
+
+/* Group members are found by searching for objects whose memberOf
+	names the group, so that whether each one is itself a group comes
+	back in the same search.  the in chain matching rule has the server
+	follow the nesting; the client side walk expands the groups found
+	several searches at a time, following each group only once.
+	memberOf doesn't list an object's primary group, so each group is
+	followed by a search for the objects whose primaryGroupID is the
+	relative id of the group's sid, which is its primaryGroupToken */
+
+#define AD_MATCHING_RULE_IN_CHAIN "1.2.840.113556.1.4.1941"
+#define AD_WALK_SEARCHES 16
+
+char *ad_member_filter(char *group_dn, int in_chain) {
+	char *escaped, *filter;
+	int filter_length;
+
+	escaped=ad_escape_filter(group_dn);
+	filter_length=strlen(escaped)+50;
+	filter=malloc(filter_length);
+	snprintf(filter, filter_length, "(memberOf%s=%s)",
+		in_chain?":"AD_MATCHING_RULE_IN_CHAIN":":"", escaped);
+	free(escaped);
+	return filter;
+}
+
+char *ad_primary_filter(long token) {
+	char *filter;
+
+	filter=malloc(40);
+	snprintf(filter, 40, "(primaryGroupID=%ld)", token);
+	return filter;
+}
+
+/* the relative id of an entry's objectSid, -1 if it hasn't one */
+long ad_member_token(LDAP *ds, LDAPMessage *entry) {
+	struct berval **values;
+	unsigned char *rid;
+	long token=-1;
+	int count;
+
+	values=ldap_get_values_len(ds, entry, "objectSid");
+	if(values!=NULL && values[0]!=NULL && values[0]->bv_len>=8) {
+		count=(unsigned char)values[0]->bv_val[1];
+		if(count>0 && values[0]->bv_len==8+4*count) {
+			rid=(unsigned char *)values[0]->bv_val+4+4*count;
+			token=rid[0]|(rid[1]<<8)|(rid[2]<<16)|((long)rid[3]<<24);
+		}
+	}
+	if(values!=NULL) ldap_value_free_len(values);
+	return token;
+}
+
+int ad_member_token_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	*(long *)data=ad_member_token(ds, entry);
+	return 0;
+}
+
+int ad_member_flags(LDAP *ds, LDAPMessage *entry) {
+	struct berval **values;
+	int i, flags=0;
+
+	values=ldap_get_values_len(ds, entry, "objectClass");
+	for(i=0; values!=NULL && values[i]!=NULL; i++) {
+		if(values[i]->bv_len==5
+				&& !strncasecmp(values[i]->bv_val, "group", 5))
+			flags|=AD_MEMBER_GROUP;
+	}
+	if(values!=NULL) ldap_value_free_len(values);
+	return flags;
+}
+
+/* a group waiting to be expanded */
+struct member_group {
+	char *dn;
+	long token;
+};
+
+struct member_search {
+	char *dn;
+	char *key;
+	long token;
+	int primary;
+	int msgid;
+	struct berval cookie;
+};
+
+struct member_walk {
+	LDAP *ds;
+	struct ad_hash *seen;
+	struct member_group *queue;
+	int queue_head;
+	int queue_tail;
+	int queue_size;
+	struct member_search searches[AD_WALK_SEARCHES];
+	int active;
+	ad_member_callback callback;
+	void *data;
+	int stop;
+};
+
+int ad_member_search_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct member_walk *walk=data;
+
+	if(walk->callback(dn, ad_member_flags(ds, entry), walk->data)) walk->stop=1;
+	return walk->stop;
+}
+
+void ad_member_queue(struct member_walk *walk, char *dn, long token) {
+	if(walk->queue_tail==walk->queue_size) {
+		walk->queue_size=walk->queue_size?walk->queue_size*2:64;
+		walk->queue=realloc(walk->queue, sizeof(struct member_group)*walk->queue_size);
+	}
+	walk->queue[walk->queue_tail].dn=strdup(dn);
+	walk->queue[walk->queue_tail++].token=token;
+}
+
+/* whether key is the group being expanded or one it was reached through */
+int ad_member_ancestor(struct member_walk *walk, char *group_key, char *key) {
+	void **parent;
+
+	while(group_key!=NULL) {
+		if(!strcmp(group_key, key)) return 1;
+		parent=ad_hash_find(walk->seen, group_key);
+		group_key=(parent!=NULL)?*parent:NULL;
+	}
+	return 0;
+}
+
+/* each object is reported once.  groups are queued to be expanded in
+	turn, remembering the group they were found in */
+void ad_member_walk_entry(struct member_walk *walk, struct member_search *search, LDAPMessage *entry) {
+	char *dn, *key;
+	void **slot;
+	int flags, added;
+
+	ad_op_entry();
+	dn=ldap_get_dn(walk->ds, entry);
+	flags=ad_member_flags(walk->ds, entry);
+	key=ad_normalize_dn(dn);
+
+	ad_op_pause();
+	slot=ad_hash_insert(walk->seen, key, &added);
+	if(added) {
+		if(flags&AD_MEMBER_GROUP) {
+			*slot=strdup(search->key);
+			ad_member_queue(walk, dn, ad_member_token(walk->ds, entry));
+		}
+		if(walk->callback(dn, flags, walk->data)) walk->stop=1;
+	} else if((flags&AD_MEMBER_GROUP)
+			&& ad_member_ancestor(walk, search->key, key)) {
+		if(walk->callback(dn, flags|AD_MEMBER_CYCLE, walk->data))
+			walk->stop=1;
+	}
+	ad_op_resume();
+
+	free(key);
+	ldap_memfree(dn);
+}
+
+/* send the search for the next page of a group's members, or of the
+	objects it is the primary group of */
+int ad_member_walk_send(struct member_walk *walk, struct member_search *search) {
+	LDAPControl *page_control=NULL;
+	LDAPControl *server_controls[2];
+	char *attrs[]={"objectClass", "objectSid", NULL};
+	char *filter;
+	int size, result;
+
+	size=(page_size<0)?AD_DEFAULT_PAGE_SIZE:page_size;
+	if(size>0) {
+		result=ldap_create_page_control(walk->ds, size,
+			search->cookie.bv_val?&search->cookie:NULL, 0,
+			&page_control);
+		if(result!=LDAP_SUCCESS) return result;
+		server_controls[0]=page_control;
+		server_controls[1]=NULL;
+	}
+
+	if(search->primary) filter=ad_primary_filter(search->token);
+	else filter=ad_member_filter(search->dn, 0);
+	ad_op_round_trip();
+	result=ldap_search_ext(walk->ds, search_base, LDAP_SCOPE_SUBTREE,
+		filter, attrs, 0, size>0?server_controls:NULL, NULL,
+		NULL, LDAP_NO_LIMIT, &search->msgid);
+	free(filter);
+	if(page_control!=NULL) ldap_control_free(page_control);
+	if(search->cookie.bv_val!=NULL) {
+		ldap_memfree(search->cookie.bv_val);
+		search->cookie.bv_val=NULL;
+		search->cookie.bv_len=0;
+	}
+	if(result!=LDAP_SUCCESS) search->msgid=-1;
+	return result;
+}
+
+/* read the result of one of the walk's searches, starting its next
+	page if there is one.  returns the ldap result code */
+int ad_member_walk_result(struct member_walk *walk, struct member_search *search, LDAPMessage *res) {
+	LDAPControl **response_controls=NULL;
+	LDAPControl *page_response;
+	ber_int_t count;
+	int result, parse_result;
+
+	parse_result=ldap_parse_result(walk->ds, res, &result, NULL, NULL,
+		NULL, &response_controls, 1);
+	if(parse_result!=LDAP_SUCCESS) result=parse_result;
+	if(response_controls!=NULL) {
+		page_response=ldap_control_find(LDAP_CONTROL_PAGEDRESULTS,
+			response_controls, NULL);
+		if(page_response!=NULL)
+			ldap_parse_pageresponse_control(walk->ds,
+				page_response, &count, &search->cookie);
+		ldap_controls_free(response_controls);
+	}
+
+	if(result==LDAP_SUCCESS && search->cookie.bv_val!=NULL
+			&& search->cookie.bv_len>0) {
+		result=ad_member_walk_send(walk, search);
+		if(result==LDAP_SUCCESS) return result;
+	}
+
+	if(search->cookie.bv_val!=NULL) {
+		ldap_memfree(search->cookie.bv_val);
+		search->cookie.bv_val=NULL;
+		search->cookie.bv_len=0;
+	}
+
+	if(result==LDAP_SUCCESS && !search->primary && search->token>0) {
+		search->primary=1;
+		result=ad_member_walk_send(walk, search);
+		if(result==LDAP_SUCCESS) return result;
+	}
+
+	free(search->dn);
+	free(search->key);
+	search->msgid=-1;
+	walk->active--;
+	return result;
+}
+
+int ad_member_walk(LDAP *ds, char *group_dn, long token, ad_member_callback callback, void *data) {
+	struct member_walk walk;
+	struct member_search *search;
+	struct ad_op op;
+	LDAPMessage *res;
+	char *key;
+	int i, msgid, type, result=LDAP_SUCCESS;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.ds=ds;
+	walk.seen=ad_hash_new(0);
+	walk.callback=callback;
+	walk.data=data;
+	for(i=0; i<AD_WALK_SEARCHES; i++) walk.searches[i].msgid=-1;
+
+	ad_op_start(&op, AD_OP_SEARCH, group_dn);
+	key=ad_normalize_dn(group_dn);
+	ad_hash_insert(walk.seen, key, NULL);
+	free(key);
+	ad_member_queue(&walk, group_dn, token);
+
+	while(!walk.stop && (walk.active>0 || walk.queue_head<walk.queue_tail)) {
+		/* keep a search outstanding for as many queued groups as
+			there is room for */
+		for(i=0; i<AD_WALK_SEARCHES && walk.queue_head<walk.queue_tail; i++) {
+			search=&walk.searches[i];
+			if(search->msgid!=-1) continue;
+			search->dn=walk.queue[walk.queue_head].dn;
+			search->token=walk.queue[walk.queue_head++].token;
+			search->key=ad_normalize_dn(search->dn);
+			search->primary=0;
+			result=ad_member_walk_send(&walk, search);
+			if(result!=LDAP_SUCCESS) {
+				free(search->dn);
+				free(search->key);
+				break;
+			}
+			walk.active++;
+		}
+		if(result!=LDAP_SUCCESS) break;
+
+		if(ldap_result(ds, LDAP_RES_ANY, LDAP_MSG_ONE, NULL, &res)<=0) {
+			ldap_get_option(ds, LDAP_OPT_RESULT_CODE, &result);
+			if(result==LDAP_SUCCESS) result=LDAP_SERVER_DOWN;
+			break;
+		}
+
+		msgid=ldap_msgid(res);
+		search=NULL;
+		for(i=0; i<AD_WALK_SEARCHES; i++) {
+			if(walk.searches[i].msgid==msgid) search=&walk.searches[i];
+		}
+		type=ldap_msgtype(res);
+		if(search!=NULL && type==LDAP_RES_SEARCH_ENTRY) {
+			ad_member_walk_entry(&walk, search, res);
+		} else if(search!=NULL && type==LDAP_RES_SEARCH_RESULT) {
+			result=ad_member_walk_result(&walk, search, res);
+			if(result!=LDAP_SUCCESS) break;
+			continue;
+		}
+		/* referrals are turned off, skip references */
+		ldap_msgfree(res);
+	}
+
+	/* abandon the searches still outstanding after a stop or error */
+	for(i=0; i<AD_WALK_SEARCHES; i++) {
+		search=&walk.searches[i];
+		if(search->msgid==-1) continue;
+		ldap_abandon_ext(ds, search->msgid, NULL, NULL);
+		free(search->dn);
+		free(search->key);
+		if(search->cookie.bv_val!=NULL) ldap_memfree(search->cookie.bv_val);
+	}
+	for(i=walk.queue_head; i<walk.queue_tail; i++) free(walk.queue[i].dn);
+	if(walk.queue!=NULL) free(walk.queue);
+	ad_hash_free(walk.seen, free);
+	ad_op_end(&op, result);
+	return result;
+}
+
+int ad_group_members(char *group_dn, int method, ad_member_callback callback, void *data) {
+	LDAP *ds;
+	struct member_walk walk;
+	char *attrs[]={"objectClass", NULL};
+	char *token_attrs[]={"objectSid", NULL};
+	char *filter;
+	long token=-1;
+	int result;
+
+	ds=ad_login();
+	if(!ds) return ad_error_code;
+
+	if(!search_base) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+		return ad_error_code;
+	}
+
+	result=ad_paged_search(ds, group_dn, LDAP_SCOPE_BASE, "(objectclass=*)",
+		token_attrs, 0, ad_member_token_entry, &token);
+	if(result==LDAP_SUCCESS && method==AD_MEMBERS_WALK) {
+		result=ad_member_walk(ds, group_dn, token, callback, data);
+	} else if(result==LDAP_SUCCESS) {
+		walk.callback=callback;
+		walk.data=data;
+		walk.stop=0;
+		filter=ad_member_filter(group_dn, method==AD_MEMBERS_CHAIN);
+		result=ad_paged_search(ds, search_base, LDAP_SCOPE_SUBTREE,
+			filter, attrs, 0, ad_member_search_entry, &walk);
+		free(filter);
+		if(result==LDAP_SUCCESS && !walk.stop && token>0) {
+			filter=ad_primary_filter(token);
+			result=ad_paged_search(ds, search_base, LDAP_SCOPE_SUBTREE,
+				filter, attrs, 0, ad_member_search_entry, &walk);
+			free(filter);
+		}
+	}
 
-	result=ldap_search_s(ds, container_dn, LDAP_SCOPE_SUBTREE, 
-				filter, attrs, 0, &res);
 	if(result!=LDAP_SUCCESS) {
-		snprintf(ad_error_msg, MAX_ERR_LENGTH, 
-			"Error in ldap_search_s for ad_group_subtree_remove_user: %s", 
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ldap_search_ext for ad_group_members: %s",
 			ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
-		return ad_error_code;
+	} else {
+		ad_error_code=AD_SUCCESS;
+	}
+	return ad_error_code;
+}
+
+int ad_sid_string(struct berval *sid, char *buffer) {
+	unsigned char *bytes;
+	unsigned long long authority;
+	unsigned long sub_authority;
+	int i, count, length;
+
+	bytes=(unsigned char *)sid->bv_val;
+	if(sid->bv_len<8) return 0;
+	count=bytes[1];
+	if(count>15 || sid->bv_len!=8+4*count) return 0;
+
+	/* the authority is big endian, the sub authorities little endian */
+	authority=0;
+	for(i=2; i<8; i++) authority=(authority<<8)|bytes[i];
+	length=sprintf(buffer, "S-%d-%llu", bytes[0], authority);
+	for(i=0; i<count; i++) {
+		sub_authority=bytes[8+4*i]|(bytes[9+4*i]<<8)
+			|(bytes[10+4*i]<<16)|((unsigned long)bytes[11+4*i]<<24);
+		length+=sprintf(buffer+length, "-%lu", sub_authority);
 	}
+	return 1;
+}
+
+int ad_token_group(struct berval *value, void *data) {
+	char sid[AD_SID_LENGTH];
+	struct berval sid_value;
+
+	if(!ad_sid_string(value, sid)) return 0;
+	sid_value.bv_val=sid;
+	sid_value.bv_len=strlen(sid);
+	return ad_value_list_append(&sid_value, data);
+}
+
+/* effective groups come from the sids in the constructed tokenGroups
+	attribute, which covers nesting and the primary group, resolved
+	to dns through the cache with a single search for the rest */
+char **ad_user_groups(char *user_dn, int effective) {
+	struct value_list list={NULL, 0, 0};
+	char **dns;
+	int i;
+
+	if(ad_get_values_each(user_dn, effective?"tokenGroups":"memberOf",
+			effective?ad_token_group:ad_value_list_append,
+			&list)!=AD_SUCCESS) {
+		for(i=0; i<list.count; i++) free(list.values[i]);
+		if(list.values!=NULL) free(list.values);
+		return NULL;
+	}
+	if(list.values==NULL) list.values=calloc(1, sizeof(char *));
+	if(!effective) return list.values;
+
+	dns=ad_resolve_sids(list.values);
+	for(i=0; i<list.count; i++) free(list.values[i]);
+	free(list.values);
+	return dns;
+}
+
+/* Remove the user from all groups below the given container.  the
+	groups are all found first, since changing their members while the
+	search is paging through a member filter could skip some, and the
+	pipeline can't share the connection with the search.  the deletions
+	are then pipelined, and every group is tried however many fail.  the
+	failures are listed in the error message for as many as there is
+	room for, leaving room in ad_error_msg for the user's dn */
+struct subtree_remove {
+	int failures;
+	int length;
+	char message[MAX_ERR_LENGTH/2];
+};
+
+void ad_subtree_remove_result(int sequence, char *dn, int result, char *message, void *data) {
+	struct subtree_remove *remove=data;
+	int length;
+
+	if(result==LDAP_SUCCESS) return;
+	remove->failures++;
+	if(remove->length<(int)sizeof(remove->message)) {
+		length=snprintf(remove->message+remove->length,
+			sizeof(remove->message)-remove->length, "\n%s: %s", dn, message);
+		remove->length+=length;
+	}
+}
+
+int ad_group_subtree_remove_user(char *container_dn, char *user_dn) {
+	LDAP *ds;
+	char *filter, *escaped;
+	int filter_length;
+	char *attrs[]={"1.1", NULL};
+	int i, result;
+	struct subtree_remove remove;
+	struct dnlist groups={NULL, 0, 0};
+	ad_pipeline *p;
+
+	ds=ad_login();
+	if(!ds) return ad_error_code;
+
+	escaped=ad_escape_filter(user_dn);
+	filter_length=(strlen(escaped)+255);
+	filter=malloc(filter_length);
+	snprintf(filter, filter_length, 
+		"(&(objectclass=group)(member=%s))", escaped);
+	free(escaped);
+
+	result=ad_paged_search(ds, container_dn, LDAP_SCOPE_SUBTREE, 
+				filter, attrs, 0, ad_dnlist_append, &groups);
 	free(filter);
 
-	num_results=ldap_count_entries(ds, res);
-	if(num_results==0) {
-		ad_error_code=AD_SUCCESS;
+	if(result!=LDAP_SUCCESS) {
+		for(i=0; i<groups.count; i++) free(groups.dns[i]);
+		if(groups.dns!=NULL) free(groups.dns);
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, 
+			"Error in ldap_search_ext for ad_group_subtree_remove_user: %s", 
+			ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 		return ad_error_code;
 	}
 
-	entry=ldap_first_entry(ds, res);
-	while(entry!=NULL) {
-		group_dn=ldap_get_dn(ds, entry);
-		if(ad_group_remove_user(group_dn, user_dn)!=AD_SUCCESS) {
-			snprintf(ad_error_msg, MAX_ERR_LENGTH, 
-				"Error in ad_group_subtree_remove_user"
-				"\nwhen removing %s from %s:\n%s", 
-				user_dn, group_dn, ad_error_msg);
-			return ad_error_code;
-		}
-		entry=ldap_next_entry(ds, entry);
+	memset(&remove, 0, sizeof(remove));
+	p=NULL;
+	if(groups.count>0) p=ad_pipeline_new(0, ad_subtree_remove_result, &remove);
+	for(i=0; i<groups.count; i++) {
+		if(p!=NULL) ad_pipeline_mod_delete(p, groups.dns[i], "member", user_dn);
+		free(groups.dns[i]);
+	}
+	if(groups.dns!=NULL) free(groups.dns);
+	if(groups.count>0 && p==NULL) return ad_error_code;
+	if(p!=NULL) ad_pipeline_free(p);
+
+	if(remove.failures>0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, 
+			"Error in ad_group_subtree_remove_user"
+			"\nwhen removing %s from %d of %d groups:%s", 
+			user_dn, remove.failures, groups.count,
+			remove.message);
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+		return ad_error_code;
 	}
 
-	if(group_dn!=NULL) ldap_memfree(group_dn);
-	ldap_msgfree(res);
 	ad_error_code=AD_SUCCESS;
 	return ad_error_code; 
 }
@@ -924,6 +2232,7 @@ int ad_group_subtree_remove_user(char *container_dn, char *user_dn) {
 */
 int ad_ou_create(char *ou_name, char *dn) {
 	LDAP *ds;
+	struct ad_op op;
 	LDAPMod *attrs[3];
 	LDAPMod attr1, attr2;
 	int result;
@@ -948,12 +2257,15 @@ int ad_ou_create(char *ou_name, char *dn) {
 	attrs[1]=&attr2;
 	attrs[2]=NULL;
 
+	ad_op_start(&op, AD_OP_ADD, dn);
 	result=ldap_add_s(ds, dn, attrs);
+	ad_op_end(&op, result);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error in ldap_add: %s", ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
 	} else {
 		ad_error_code=AD_SUCCESS;
+		ad_cache_forget(dn, NULL);
 	}
 	return ad_error_code;
 }
@@ -964,12 +2276,8 @@ int ad_ou_create(char *ou_name, char *dn) {
 char **ad_list(char *dn) {
 	LDAP *ds;
 	char *attrs[2];
-	int result;
-	LDAPMessage *res;
-	LDAPMessage *entry;
-	int num_entries;
-	int i;
-	char **dnlist;
+	int result, i;
+	struct dnlist list={NULL, 0, 0};
 
 	ds=ad_login();
 	if(!ds) return NULL;
@@ -977,37 +2285,413 @@ char **ad_list(char *dn) {
 	attrs[0]="1.1";
 	attrs[1]=NULL;
 
-	result=ldap_search_s(ds, dn, LDAP_SCOPE_ONELEVEL, "(objectclass=*)", attrs, 0, &res);
+	result=ad_paged_search(ds, dn, LDAP_SCOPE_ONELEVEL, "(objectclass=*)", attrs, 0, ad_dnlist_append, &list);
 	if(result!=LDAP_SUCCESS) {
 		snprintf(ad_error_msg, MAX_ERR_LENGTH,
-			"Error in ldap_search_s for ad_list: %s",
+			"Error in ldap_search_ext for ad_list: %s",
 			ldap_err2string(result));
 		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+		for(i=0; i<list.count; i++) free(list.dns[i]);
+		if(list.dns!=NULL) free(list.dns);
 		return NULL;
 	}
-	num_entries=ldap_count_entries(ds, res);
 
-	if(num_entries==0) {
-		ldap_msgfree(res);
-		return NULL;
+	ad_error_code=AD_SUCCESS;
+	return list.dns;
+}
+
+/* connection pool */
+
+int ad_pool_init(int size) {
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	if(pool.size>0) {
+		pthread_mutex_unlock(&pool.lock);
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_pool_init: pool already initialised");
+		ad_error_code=AD_SERVER_CONNECT_FAILURE;
+		return ad_error_code;
 	}
 
-	dnlist=malloc(sizeof(char *)*(num_entries+1));
+	if(ad_read_config()!=AD_SUCCESS) {
+		pthread_mutex_unlock(&pool.lock);
+		return ad_error_code;
+	}
 
-	entry=ldap_first_entry(ds, res);
-	dn=ldap_get_dn(ds, entry);
-	dnlist[0]=strdup(dn);
+	pool.connections=malloc(sizeof(LDAP *)*size);
+	pool.in_use=malloc(sizeof(int)*size);
+	for(i=0; i<size; i++) {
+		pool.in_use[i]=0;
+		pool.connections[i]=ad_connect();
+		if(pool.connections[i]==NULL) {
+			while(--i>=0) ldap_unbind_ext(pool.connections[i], NULL, NULL);
+			free(pool.connections);
+			free(pool.in_use);
+			pool.connections=NULL;
+			pool.in_use=NULL;
+			pthread_mutex_unlock(&pool.lock);
+			return ad_error_code;
+		}
+	}
+	pool.size=size;
+	pthread_mutex_unlock(&pool.lock);
+
+	ad_error_code=AD_SUCCESS;
+	return ad_error_code;
+}
 
-	for(i=1; (entry=ldap_next_entry(ds, entry))!=NULL; i++) {
-		dn=ldap_get_dn(ds, entry);
-		dnlist[i]=strdup(dn);
+int ad_pool_checkout() {
+	struct ad_thread_state *state;
+	int i;
+
+	state=ad_thread_state();
+	if(state->pool_slot>=0) {
+		ad_error_code=AD_SUCCESS;
+		return ad_error_code;
 	}
-	dnlist[i]=NULL;
 
-	ldap_memfree(dn);
-	ldap_msgfree(res);
+	pthread_mutex_lock(&pool.lock);
+	if(pool.size==0) {
+		pthread_mutex_unlock(&pool.lock);
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_pool_checkout: no connection pool, call ad_pool_init() first");
+		ad_error_code=AD_SERVER_CONNECT_FAILURE;
+		return ad_error_code;
+	}
+	while(1) {
+		for(i=0; i<pool.size; i++) {
+			if(!pool.in_use[i]) break;
+		}
+		if(i<pool.size) break;
+		pthread_cond_wait(&pool.available, &pool.lock);
+	}
+	pool.in_use[i]=1;
+	pthread_mutex_unlock(&pool.lock);
+
+	/* reopen connections that were dropped on checkin */
+	if(pool.connections[i]==NULL) {
+		pool.connections[i]=ad_connect();
+		if(pool.connections[i]==NULL) {
+			pthread_mutex_lock(&pool.lock);
+			pool.in_use[i]=0;
+			pthread_cond_signal(&pool.available);
+			pthread_mutex_unlock(&pool.lock);
+			return ad_error_code;
+		}
+	}
+
+	state->pool_slot=i;
+	ad_error_code=AD_SUCCESS;
+	return ad_error_code;
+}
+
+void ad_pool_checkin() {
+	struct ad_thread_state *state;
+	LDAP *ds;
+	int i, result;
+
+	state=ad_thread_state();
+	i=state->pool_slot;
+	if(i<0) return;
+	state->pool_slot=-1;
+
+	/* drop connections the server has gone away from so that
+		the next checkout reconnects */
+	ds=pool.connections[i];
+	result=LDAP_SUCCESS;
+	ldap_get_option(ds, LDAP_OPT_RESULT_CODE, &result);
+	if(result==LDAP_SERVER_DOWN||result==LDAP_CONNECT_ERROR) {
+		ldap_unbind_ext(ds, NULL, NULL);
+		pool.connections[i]=NULL;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.in_use[i]=0;
+	pthread_cond_signal(&pool.available);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void ad_pool_destroy() {
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	for(i=0; i<pool.size; i++) {
+		if(pool.connections[i]!=NULL)
+			ldap_unbind_ext(pool.connections[i], NULL, NULL);
+	}
+	if(pool.connections!=NULL) free(pool.connections);
+	if(pool.in_use!=NULL) free(pool.in_use);
+	pool.connections=NULL;
+	pool.in_use=NULL;
+	pool.size=0;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* pipelined writes */
+
+struct ad_pipeline_request {
+	int msgid;
+	int sequence;
+	int kind;
+	struct timespec sent;
+	char *dn;
+	int result;
+	char *message;
+};
+
+struct ad_pipeline {
+	LDAP *ds;
+	int window;
+	struct ad_pipeline_request *requests;
+	int head;
+	int outstanding;
+	int submitted;
+	int failed;
+	ad_pipeline_callback callback;
+	void *callback_data;
+};
+
+ad_pipeline *ad_pipeline_new(int window, ad_pipeline_callback callback, void *callback_data) {
+	LDAP *ds;
+	ad_pipeline *p;
+
+	ds=ad_login();
+	if(!ds) return NULL;
+
+	if(window<=0) window=AD_PIPELINE_WINDOW;
+
+	p=malloc(sizeof(ad_pipeline));
+	p->requests=malloc(sizeof(struct ad_pipeline_request)*window);
+	p->ds=ds;
+	p->window=window;
+	p->head=0;
+	p->outstanding=0;
+	p->submitted=0;
+	p->failed=0;
+	p->callback=callback;
+	p->callback_data=callback_data;
 
 	ad_error_code=AD_SUCCESS;
-	return dnlist;
+	return p;
 }
 
+/* wait for the oldest outstanding request to complete and
+	report its result to the callback */
+void ad_pipeline_complete_head(ad_pipeline *p) {
+	struct ad_pipeline_request *request;
+	LDAPMessage *res;
+	char *errmsg=NULL;
+	int result;
+
+	request=&p->requests[p->head];
+
+	/* requests that failed before reaching the server have no msgid
+		and already hold their result */
+	if(request->msgid>=0) {
+		result=ldap_result(p->ds, request->msgid, LDAP_MSG_ALL, NULL, &res);
+		if(result<=0) {
+			ldap_get_option(p->ds, LDAP_OPT_RESULT_CODE, &request->result);
+			if(request->result==LDAP_SUCCESS)
+				request->result=LDAP_SERVER_DOWN;
+		} else {
+			result=ldap_parse_result(p->ds, res, &request->result, NULL, &errmsg, NULL, NULL, 1);
+			if(result!=LDAP_SUCCESS) request->result=result;
+		}
+		if(request->result!=LDAP_SUCCESS) {
+			request->message=malloc(MAX_ERR_LENGTH);
+			if(errmsg!=NULL && errmsg[0]!='\0')
+				snprintf(request->message, MAX_ERR_LENGTH, "%s: %s", ldap_err2string(request->result), errmsg);
+			else
+				snprintf(request->message, MAX_ERR_LENGTH, "%s", ldap_err2string(request->result));
+		}
+		if(errmsg!=NULL) ldap_memfree(errmsg);
+		ad_op_record(request->kind, request->dn, request->result, &request->sent);
+	}
+
+	if(request->result!=LDAP_SUCCESS) p->failed++;
+	if(p->callback!=NULL)
+		p->callback(request->sequence, request->dn, request->result, request->message, p->callback_data);
+
+	free(request->dn);
+	if(request->message!=NULL) free(request->message);
+	p->head=(p->head+1)%p->window;
+	p->outstanding--;
+}
+
+/* claim the next free request slot, waiting for the oldest request to
+	complete if the window is full */
+struct ad_pipeline_request *ad_pipeline_slot(ad_pipeline *p, int kind, char *dn) {
+	struct ad_pipeline_request *request;
+
+	if(p->outstanding==p->window) ad_pipeline_complete_head(p);
+
+	request=&p->requests[(p->head+p->outstanding)%p->window];
+	p->outstanding++;
+	request->msgid=-1;
+	request->sequence=p->submitted++;
+	request->kind=kind;
+	request->dn=strdup(dn);
+	ad_op_sent(kind, request->dn, &request->sent);
+	request->result=LDAP_SUCCESS;
+	request->message=NULL;
+	return request;
+}
+
+/* record the outcome of sending a request.  a request the library
+	couldn't send is completed in place so it is still reported in
+	submission order */
+int ad_pipeline_sent(struct ad_pipeline_request *request, int result, char *function) {
+	if(result==LDAP_SUCCESS) {
+		ad_error_code=AD_SUCCESS;
+		return ad_error_code;
+	}
+
+	request->msgid=-1;
+	request->result=result;
+	request->message=malloc(MAX_ERR_LENGTH);
+	snprintf(request->message, MAX_ERR_LENGTH, "Error in %s: %s", function, ldap_err2string(result));
+	snprintf(ad_error_msg, MAX_ERR_LENGTH, "%s", request->message);
+	ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	return ad_error_code;
+}
+
+int ad_pipeline_modify(ad_pipeline *p, char *dn, LDAPMod **mods) {
+	struct ad_pipeline_request *request;
+	int i, result;
+
+	for(i=0; mods[i]!=NULL; i++) ad_cache_forget(dn, mods[i]->mod_type);
+
+	request=ad_pipeline_slot(p, AD_OP_MODIFY, dn);
+	result=ldap_modify_ext(p->ds, dn, mods, NULL, NULL, &request->msgid);
+	return ad_pipeline_sent(request, result, "ldap_modify_ext");
+}
+
+int ad_pipeline_add(ad_pipeline *p, char *dn, LDAPMod **attrs) {
+	struct ad_pipeline_request *request;
+	int result;
+
+	ad_cache_forget(dn, NULL);
+
+	request=ad_pipeline_slot(p, AD_OP_ADD, dn);
+	result=ldap_add_ext(p->ds, dn, attrs, NULL, NULL, &request->msgid);
+	return ad_pipeline_sent(request, result, "ldap_add_ext");
+}
+
+int ad_pipeline_delete(ad_pipeline *p, char *dn) {
+	struct ad_pipeline_request *request;
+	int result;
+
+	ad_cache_forget(dn, NULL);
+
+	request=ad_pipeline_slot(p, AD_OP_DELETE, dn);
+	result=ldap_delete_ext(p->ds, dn, NULL, NULL, &request->msgid);
+	return ad_pipeline_sent(request, result, "ldap_delete_ext");
+}
+
+int ad_pipeline_rename(ad_pipeline *p, char *dn, char *new_rdn, char *new_parent, int delete_old_rdn) {
+	struct ad_pipeline_request *request;
+	int result;
+
+	ad_cache_forget(dn, NULL);
+
+	request=ad_pipeline_slot(p, AD_OP_RENAME, dn);
+	result=ldap_rename(p->ds, dn, new_rdn, new_parent, delete_old_rdn, NULL, NULL, &request->msgid);
+	return ad_pipeline_sent(request, result, "ldap_rename");
+}
+
+int ad_pipeline_change(ad_pipeline *p, char *dn, ad_change *changes) {
+	LDAPMod **mods;
+	int result;
+
+	mods=ad_build_mods(changes);
+	result=ad_pipeline_modify(p, dn, mods);
+	ad_free_mods(mods);
+	return result;
+}
+
+int ad_pipeline_create(ad_pipeline *p, char *dn, ad_change *attributes) {
+	LDAPMod **attrs;
+	int i, result;
+
+	for(i=0; attributes[i].attribute!=NULL; i++)
+		attributes[i].op=LDAP_MOD_ADD;
+	attrs=ad_build_mods(attributes);
+	result=ad_pipeline_add(p, dn, attrs);
+	ad_free_mods(attrs);
+	return result;
+}
+
+/* single value modify through the pipeline, as ad_mod_add() and friends */
+int ad_pipeline_mod(ad_pipeline *p, int op, char *dn, char *attribute, char *value) {
+	LDAPMod *attrs[2];
+	LDAPMod attr;
+	char *values[2];
+
+	values[0] = value;
+	values[1] = NULL;
+
+	attr.mod_op = op;
+	attr.mod_type = attribute;
+	attr.mod_values = values;
+
+	attrs[0] = &attr;
+	attrs[1] = NULL;
+
+	/* the request is encoded before ldap_modify_ext returns so
+		the modification can live on the stack */
+	return ad_pipeline_modify(p, dn, attrs);
+}
+
+int ad_pipeline_mod_add(ad_pipeline *p, char *dn, char *attribute, char *value) {
+	return ad_pipeline_mod(p, LDAP_MOD_ADD, dn, attribute, value);
+}
+
+int ad_pipeline_mod_replace(ad_pipeline *p, char *dn, char *attribute, char *value) {
+	return ad_pipeline_mod(p, LDAP_MOD_REPLACE, dn, attribute, value);
+}
+
+int ad_pipeline_mod_delete(ad_pipeline *p, char *dn, char *attribute, char *value) {
+	return ad_pipeline_mod(p, LDAP_MOD_DELETE, dn, attribute, value);
+}
+
+/* wait for every outstanding request to complete */
+int ad_pipeline_flush(ad_pipeline *p) {
+	while(p->outstanding>0) ad_pipeline_complete_head(p);
+
+	if(p->failed>0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"%d of %d pipelined requests failed",
+			p->failed, p->submitted);
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	} else {
+		ad_error_code=AD_SUCCESS;
+	}
+	return ad_error_code;
+}
+
+int ad_pipeline_free(ad_pipeline *p) {
+	int result;
+
+	result=ad_pipeline_flush(p);
+	free(p->requests);
+	free(p);
+	return result;
+}
+
+/* escape the characters that are special in a search filter value */
+char *ad_escape_filter(char *value) {
+	char *escaped, *out;
+
+	escaped=malloc(strlen(value)*3+1);
+	for(out=escaped; *value; value++) {
+		if(*value=='*' || *value=='(' || *value==')' || *value=='\\') {
+			sprintf(out, "\\%02x", (unsigned char)*value);
+			out+=3;
+		} else {
+			*out++=*value;
+		}
+	}
+	*out='\0';
+	return escaped;
+}
@@ -14,6 +14,9 @@
 #ifndef ACTIVE_DIRECTORY_H
 #define ACTIVE_DIRECTORY_H 1
 
+#include <ldap.h>
+#include <stdio.h>
+
 /* Configuration options:
 |  For configuration these functions look first for the file 
 | ~/.adtool.cfg, or failing that
@@ -23,16 +26,70 @@ uri ldaps://dc2.example.com
 binddn cn=administrator,ou=admin,dc=example,dc=com
 bindpw passw0rd
 searchbase ou=users,dc=example,dc=com
+|  Searches are fetched from the server in pages of 1000 entries (the
+| default Active Directory MaxPageSize) so that large result sets aren't
+| truncated.  A different page size can be set with a pagesize line,
+| and pagesize 0 turns paging off.
+|  A cachettl line (in seconds) turns on the name to dn cache used by
+| ad_resolve(), which is kept in ~/.adtool.cache or the file given by a
+| cachefile line.
+|  With an ldaps uri a tlscachefile line names a file in which TLS
+| sessions are saved so that later connections, including those of
+| later processes, can resume them instead of repeating the full
+| handshake.  It holds session secrets and is written readable only by
+| the user.  Resuming needs libldap built with OpenSSL, and OpenSSL
+| 1.1.1 or later found when the library is built.
 |  Any function may return: 
 |	AD_COULDNT_OPEN_CONFIG_FILE or AD_MISSING_CONFIG_PARAMETER.
 | if there is a problem reading the config file, or
 |	AD_SERVER_CONNECT_FAILURE if a connection can't be made.
 */
-char *system_config_file;
-char *uri;
-char *binddn;
-char *bindpw;
-char *search_base;
+extern char *system_config_file;
+extern char *uri;
+extern char *binddn;
+extern char *bindpw;
+extern char *search_base;
+extern int page_size;
+extern char *cache_file;
+extern int cache_ttl;
+extern char *tls_cache_file;
+
+#define AD_DEFAULT_PAGE_SIZE 1000
+
+/* Threads
+|  Error codes and messages are kept per thread, so ad_get_error() and
+| ad_get_error_num() report the last error in the calling thread.
+|  Without a connection pool every thread shares the one connection
+| opened on the first call.  To drive the server from several threads
+| at once create a pool with ad_pool_init() and have each thread call
+| ad_pool_checkout() before and ad_pool_checkin() after a series of
+| ad_ functions, which then use the checked out connection.
+|  The connection settings are kept for the life of the process so
+| that dropped connections can be reopened.
+*/
+
+/* ad_pool_init() opens size bound connections.
+|  Returns AD_SUCCESS, AD_MISSING_CONFIG_PARAMETER or
+| AD_SERVER_CONNECT_FAILURE.
+*/
+int ad_pool_init(int size);
+
+/* ad_pool_checkout() gives the calling thread a connection from the
+| pool, waiting until one is free.  A connection that was lost is
+| reopened.
+|  Returns AD_SUCCESS or AD_SERVER_CONNECT_FAILURE.
+*/
+int ad_pool_checkout();
+
+/* ad_pool_checkin() returns the calling thread's connection to the
+| pool.  Subsequent calls from the thread use the shared connection.
+*/
+void ad_pool_checkin();
+
+/* ad_pool_destroy() closes all of the pool's connections.
+|  No connections may be checked out.
+*/
+void ad_pool_destroy();
 
 /* ad_get_error() returns a pointer to a string containing an
 | explanation of the last error that occured.
@@ -50,6 +107,12 @@ char *ad_get_error();
 */
 int ad_get_error_num();
 
+/* ad_escape_filter() returns a malloc'd copy of value with the
+| characters special in search filters, * ( ) and \, escaped, for
+| building a filter from a name given by the user.
+*/
+char *ad_escape_filter(char *value);
+
 /* ad_create_user() creates a new, locked user account
 | with the given user name and distinguished name
 |  Example usage: 
@@ -110,6 +173,177 @@ int ad_setpass(char *dn, char *password);
 */
 char **ad_search(char *attribute, char *value);
 
+/* ad_resolve() looks up the dn of an object by name
+|  Works like ad_search() but consults a cache of earlier lookups
+| shared by every process run by the user, so resolving the same names
+| again doesn't need a subtree search.
+|  Cached names are trusted for cachettl seconds.  After that the
+| cached dn is checked with a single base search, comparing its
+| objectGUID, before a full search is made.  Names which weren't found
+| are remembered for the same time.  Names that match more than one
+| object are never cached.
+|  Writes made through this library drop the cache entries they could
+| invalidate.
+|  Unlike ad_search() the value is matched literally, so * in a name
+| isn't a wildcard.
+|  Without a cachettl setting this is the same as ad_search().
+*/
+char **ad_resolve(char *attribute, char *value);
+
+/* ad_cache_forget() drops cached lookups of the given dn, or only
+| those by the given attribute if it isn't NULL, along with any cached
+| failed lookups.
+|  Use this after changing the directory by other means.
+*/
+void ad_cache_forget(char *dn, char *attribute);
+
+/* ad_resolve_sids() looks up the dns of a NULL terminated list of sids
+| in S-1-5-21-... form.
+|  Sids in the cache are answered from it, and the rest are found
+| together with searches of up to 200 sids each, so resolving a list
+| of sids typically takes one round trip.  They are cached like names
+| in ad_resolve(), keyed by objectSid.
+|  Returns an array of dns in the same order as the sids, with the sid
+| itself in place of any that couldn't be found below the searchbase.
+|  Returns NULL on failure.
+*/
+char **ad_resolve_sids(char **sids);
+
+/* ad_resolve_names() looks up the dns of a NULL terminated list of
+| names, the values of attribute, eg. "name".
+|  Names in the cache are answered from it, and the rest are found
+| together with searches of up to 200 names each, instead of a search
+| per name as ad_resolve() would make.  They are cached as by
+| ad_resolve().
+|  Returns an array of dns in the same order as the names, with NULL in
+| place of any that weren't found.  The array and each dn in it are
+| malloc'd.
+|  Returns NULL on failure.
+*/
+char **ad_resolve_names(char *attribute, char **values);
+
+/* ad_tls_sessions() returns the number of TLS connections this process
+| has made, and sets resumed, if it isn't NULL, to how many of them
+| resumed an earlier session.
+*/
+int ad_tls_sessions(int *resumed);
+
+/* Statistics
+|  ad_stats_enable() has the library count where its time goes: reading
+| the config, connecting, the TLS handshake and binding, and for each
+| kind of ldap operation the number made, the round trips to the server
+| they took, the entries and bytes they received and the time spent
+| waiting on them.  Call it before anything connects.
+|  Time spent in callbacks isn't counted against the search calling
+| them.  Searches made to find the dn for a name, and names the cache
+| answered, are counted too.
+|  ad_stats_get() copies the counts so far into stats.
+*/
+#define AD_OP_SEARCH 0
+#define AD_OP_ADD 1
+#define AD_OP_MODIFY 2
+#define AD_OP_DELETE 3
+#define AD_OP_RENAME 4
+#define AD_OP_BIND 5
+#define AD_OP_KINDS 6
+
+#define AD_PHASE_CONFIG 0
+#define AD_PHASE_CONNECT 1
+#define AD_PHASE_TLS 2
+#define AD_PHASE_BIND 3
+#define AD_PHASES 4
+
+struct ad_op_stats {
+	long long count;
+	long long failed;
+	long long round_trips;
+	long long entries;
+	long long bytes;
+	double seconds;
+};
+
+typedef struct ad_stats {
+	double phase_seconds[AD_PHASES];
+	int connections;
+	int tls_connections;
+	int tls_resumed;
+	struct ad_op_stats ops[AD_OP_KINDS];
+	long long resolve_searches;
+	long long resolve_cached;
+	long long bytes_sent;
+	long long bytes_received;
+} ad_stats;
+
+void ad_stats_enable();
+void ad_stats_get(ad_stats *stats);
+
+/* ad_op_name() returns the name of an AD_OP_ kind, eg. "search" */
+char *ad_op_name(int kind);
+
+/* Observers
+|  ad_set_observer() has callback called as each ldap operation the
+| library makes starts, with event AD_OBSERVE_START, and again as it
+| ends with AD_OBSERVE_END, the ldap result code, the seconds spent
+| waiting on it and the bytes sent and received for it.  kind is an
+| AD_OP_ constant and dn the object operated on, or a search's base.
+| Bytes are only counted on connections made after the observer is set
+| and are 0 for pipelined requests, which share their connection.
+|  The callback may be called from any thread using the library, so it
+| must be thread safe, and must not make ldap calls itself.  Set the
+| observer before other threads use the library.  A NULL callback
+| removes it, after which operations are no longer timed.
+*/
+#define AD_OBSERVE_START 0
+#define AD_OBSERVE_END 1
+
+typedef void (*ad_observer_callback)(int event, int kind, char *dn,
+	int result, double seconds, long long bytes, void *data);
+void ad_set_observer(ad_observer_callback callback, void *data);
+
+/* Latency histograms
+|  An ad_histogram collects the durations of operations by kind when
+| ad_histogram_observer() is set as the observer, eg.
+|	h=ad_histogram_new();
+|	ad_set_observer(ad_histogram_observer, h);
+| Durations are bucketed logarithmically, each bucket within 2% of the
+| values in it, from a microsecond to over an hour, so the histogram
+| takes fixed memory however many operations are seen.
+|  ad_histogram_percentile() returns the duration in seconds below which
+| percentile percent of the operations of kind took, or 0 if there were
+| none.  ad_histogram_dump() writes a line for each kind of operation
+| seen with its count, failures, mean, percentiles and maximum.
+| ad_histogram_reset() empties the histogram, eg. after each dump.
+*/
+typedef struct ad_histogram ad_histogram;
+
+ad_histogram *ad_histogram_new();
+void ad_histogram_observer(int event, int kind, char *dn, int result,
+	double seconds, long long bytes, void *data);
+double ad_histogram_percentile(ad_histogram *h, int kind, double percentile);
+void ad_histogram_dump(ad_histogram *h, FILE *out);
+void ad_histogram_reset(ad_histogram *h);
+void ad_histogram_free(ad_histogram *h);
+
+/* ad_search_each() is a streaming search
+|  Calls callback once for each entry found below base (the configured
+| searchbase if base is NULL) as it arrives from the server.  The entry
+| is freed when the callback returns, so results are not collected in
+| memory.  If the callback returns non-zero the search is abandoned.
+|  scope is LDAP_SCOPE_BASE, LDAP_SCOPE_ONELEVEL or LDAP_SCOPE_SUBTREE.
+| filter defaults to (objectclass=*) and attrs to no attributes if they
+| are NULL.
+|  Example usage:
+| int print_dn(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+|	printf("%s\n", dn);
+|	return 0;
+| }
+| ad_search_each(NULL, LDAP_SCOPE_SUBTREE, "(mail=*)", NULL, print_dn, NULL);
+|  Returns AD_SUCCESS or AD_LDAP_OPERATION_FAILURE.
+*/
+typedef int (*ad_search_callback)(LDAP *ds, LDAPMessage *entry, char *dn, void *data);
+int ad_search_each(char *base, int scope, char *filter, char **attrs,
+		ad_search_callback callback, void *data);
+
 /* ad_mod_add() adds a value to the given attribute.
 | Example ad_mod_add("cn=nobody,ou=users,dc=example,dc=com",
 |		"mail", "nobody@nowhere");
@@ -148,15 +382,137 @@ int ad_mod_replace_binary(char *dn, char *attribute, char *data, int data_length
 */
 int ad_mod_delete(char *dn, char *attribute, char *value);
 
+/* ad_modify() makes any number of changes to an object in a single
+| modify request, so they take one round trip and are applied
+| atomically: either all of them are made or none are.
+|  changes is an array ending with an entry whose attribute is NULL.
+| op is LDAP_MOD_ADD, LDAP_MOD_REPLACE or LDAP_MOD_DELETE.  length is
+| -1 for a string value or the length of a binary value.  A NULL value
+| with LDAP_MOD_DELETE or LDAP_MOD_REPLACE removes every value of the
+| attribute.  Changes of the same kind to the same attribute become one
+| multi-valued change.
+|  Example usage:
+| ad_change changes[]={
+|	{LDAP_MOD_REPLACE, "description", "some person", -1},
+|	{LDAP_MOD_ADD, "othertelephone", "123", -1},
+|	{LDAP_MOD_ADD, "othertelephone", "456", -1},
+|	{LDAP_MOD_DELETE, "mail", NULL, -1},
+|	{0, NULL, NULL, 0}
+| };
+| ad_modify("cn=nobody,ou=users,dc=example,dc=com", changes);
+|  Returns AD_SUCCESS or AD_LDAP_OPERATION_FAILURE.
+*/
+typedef struct {
+	int op;
+	char *attribute;
+	char *value;
+	int length;
+} ad_change;
+
+int ad_modify(char *dn, ad_change *changes);
+
+/* ad_provision_user() creates a ready to use user account with a
+| single add request.
+|  Sets the same attributes as ad_create_user() along with any given in
+| attributes, an array ending with an entry whose attribute is NULL
+| (see ad_modify(), the op is ignored).  attributes may be NULL.
+|  If password isn't NULL it is set as unicodePwd and the account is
+| created enabled, userAccountControl=66048
+| (NORMAL_ACCOUNT|DONT_EXPIRE_PASSWORD), otherwise it is created locked.
+| A userAccountControl in attributes overrides either.  Setting a
+| password requires a secure connection, as ad_setpass() does.
+|  Example usage:
+| ad_change attributes[]={
+|	{0, "givenName", "No", -1},
+|	{0, "sn", "Body", -1},
+|	{0, NULL, NULL, 0}
+| };
+| ad_provision_user("nobody", "cn=nobody,ou=users,dc=example,dc=com",
+|		"secret", attributes);
+|  Returns AD_SUCCESS or AD_LDAP_OPERATION_FAILURE.
+*/
+int ad_provision_user(char *username, char *dn, char *password, ad_change *attributes);
+
 /* ad_get_attribute() returns a pointer to a NULL terminated
 | array of strings containing values for the given attribute.
 |  Returns NULL on failure or if nothing is found.
 |  Sets error code to AD_SUCCESS, AD_OBJECT_NOT_FOUND, 
 | AD_ATTRIBUTE_ENTRY_NOT_FOUND or AD_LDAP_OPERATION_FAILURE
 | even if there are no values for the given attribute.
+|  Attributes with more values than the server returns at once, such as
+| the member attribute of large groups, are fetched a range at a time
+| until every value has been read.
 */
 char **ad_get_attribute(char *dn, char *attribute);
 
+/* ad_get_values_each() streams the values of an attribute of the
+| given dn to callback as each range of them arrives, so even groups with
+| hundreds of thousands of members can be read without holding all of
+| the values in memory.
+|  The value is freed when the callback returns.  If the callback
+| returns non-zero no more values are fetched.
+|  Example usage:
+| int print_value(struct berval *value, void *data) {
+|	printf("%.*s\n", (int)value->bv_len, value->bv_val);
+|	return 0;
+| }
+| ad_get_values_each(group_dn, "member", print_value, NULL);
+|  Returns AD_SUCCESS, AD_OBJECT_NOT_FOUND or AD_LDAP_OPERATION_FAILURE.
+*/
+typedef int (*ad_value_callback)(struct berval *value, void *data);
+int ad_get_values_each(char *dn, char *attribute, ad_value_callback callback, void *data);
+
+/* ad_next_range() returns the number of the first value still to be
+| fetched of an attribute returned by a search, given its name, or -1 if
+| every value was returned.  Active directory names an attribute it
+| returned only part of with a range option, such as member;range=0-1499.
+|  ad_get_range_values() calls callback with the values of attribute
+| from value number first on, as ad_get_values_each() does.  Together
+| they complete a ranged attribute of an entry found by any search:
+| if((first=ad_next_range(name))>0) {
+|	*strchr(name, ';')='\0';
+|	ad_get_range_values(dn, name, first, print_value, NULL);
+| }
+|  Returns AD_SUCCESS, AD_OBJECT_NOT_FOUND or AD_LDAP_OPERATION_FAILURE.
+*/
+int ad_next_range(char *attribute);
+int ad_get_range_values(char *dn, char *attribute, int first, ad_value_callback callback, void *data);
+
+/* ad_get_attributes() fetches several attributes of one object with a
+| single search.
+|  object is either a dn, or a filter in parentheses which is searched
+| for below the searchbase, so that finding the object and reading it
+| take one round trip.  attrs is a NULL terminated list of attribute
+| names.
+|  Returns an array of the attributes the object has, ending with an
+| entry whose name is NULL.  values are berval arrays so binary
+| attributes come back whole.  Free the result with
+| ad_free_attributes().  Attributes too big to come back in one search
+| are completed with ranged retrieval as in ad_get_attribute().
+|  Example usage:
+| char *attrs[]={"mail", "objectGUID", NULL};
+| ad_attribute *a=ad_get_attributes("(sAMAccountName=nobody)", attrs);
+| for(i=0; a!=NULL && a[i].name!=NULL; i++)
+|	printf("%s has %d values\n", a[i].name, ldap_count_values_len(a[i].values));
+| ad_free_attributes(a);
+|  Returns NULL and sets AD_OBJECT_NOT_FOUND if no object, or more than
+| one, matches, or AD_LDAP_OPERATION_FAILURE.  Sets
+| AD_ATTRIBUTE_ENTRY_NOT_FOUND if the object has none of the attributes.
+*/
+typedef struct {
+	char *name;
+	struct berval **values;
+} ad_attribute;
+
+ad_attribute *ad_get_attributes(char *object, char **attrs);
+void ad_free_attributes(ad_attribute *attributes);
+
+/* ad_attribute_matches() returns non-zero if attribute, a name as
+| returned by the server, is the attribute requested, ignoring case and
+| any options such as ;binary or ;range=0-1499.
+*/
+int ad_attribute_matches(char *attribute, char *requested);
+
 /* ad_rename_user() changes the given user's name
 | Modifies cn, sAMAccountName and userPrincipalName
 |to the new username.  Assumes that the first part of the dn
@@ -199,10 +555,68 @@ int ad_group_remove_user(char *group_dn, char *user_dn);
 
 /* ad_group_subtree_remove_user()
 |  Removes the user from all groups underneath the given container
-|  Returns AD_SUCCESS or AD_LDAP_OPERATION_FAILURE.
+|  The groups are all found first, then the removals are pipelined.  A
+| failure to remove the user from one group doesn't stop the others.
+|  Returns AD_SUCCESS or AD_LDAP_OPERATION_FAILURE, with the groups the
+| user couldn't be removed from listed in the error message.
 */
 int ad_group_subtree_remove_user(char *container_dn, char *user_dn);
 
+/* ad_group_sync()
+|  Makes the members of a group exactly the NULL terminated list of
+| member dns given.  The current members are read with ranged retrieval
+| and compared with the list by normalized dn, then the missing members
+| are added and the extra ones removed several hundred at a time.
+|  added and removed are set to the number of members added and
+| removed.
+|  Returns AD_SUCCESS, AD_OBJECT_NOT_FOUND or AD_LDAP_OPERATION_FAILURE
+| if any of the changes failed, in which case the rest are still made.
+*/
+int ad_group_sync(char *group_dn, char **members, int *added, int *removed);
+
+/* ad_group_members()
+|  Calls callback once for each member of a group, found by searching
+| search_base for objects whose memberOf names the group and then for
+| those that have it as their primary group, which memberOf leaves out.
+| Members outside search_base aren't found.  method is one of
+|	AD_MEMBERS_DIRECT	the group's own members only
+|	AD_MEMBERS_CHAIN	members of nested groups too, with the nesting
+|				followed by the server (the in chain
+|				matching rule).  Members that have a
+|				nested group as their primary group
+|				aren't found
+|	AD_MEMBERS_WALK		members of nested groups too, with the nesting
+|				followed here: the groups found are expanded
+|				with several searches outstanding at once and
+|				each group is expanded only once
+|  flags has AD_MEMBER_GROUP set if the member is itself a group.  The
+| walk reports each member once, and again with AD_MEMBER_CYCLE set when
+| a group turns out to contain a group it was reached through.
+|  If the callback returns non-zero the search is abandoned.
+|  Returns AD_SUCCESS, AD_MISSING_CONFIG_PARAMETER or
+| AD_LDAP_OPERATION_FAILURE.
+*/
+#define AD_MEMBERS_DIRECT 0
+#define AD_MEMBERS_CHAIN 1
+#define AD_MEMBERS_WALK 2
+#define AD_MEMBER_GROUP 1
+#define AD_MEMBER_CYCLE 2
+typedef int (*ad_member_callback)(char *dn, int flags, void *data);
+int ad_group_members(char *group_dn, int method, ad_member_callback callback, void *data);
+
+/* ad_user_groups()
+|  Returns a NULL terminated array of the dns of the groups the user is
+| a member of, which is empty if there are none.
+|  If effective is 0 these are the groups listed in the user's memberOf.
+| Otherwise they are every group the user is effectively in, including
+| through nested groups and the primary group, read from the sids in the
+| constructed tokenGroups attribute with one base search and resolved
+| with ad_resolve_sids().
+|  Returns NULL on failure, with the error code set to
+| AD_OBJECT_NOT_FOUND or AD_LDAP_OPERATION_FAILURE.
+*/
+char **ad_user_groups(char *user_dn, int effective);
+
 /* ad_ou_create()
 |  Create an organizational unit
 |  Sets objectclass=organizationalUnit
@@ -215,6 +629,238 @@ int ad_ou_create(char *ou_name, char *dn);
 */
 char **ad_list(char *dn);
 
+/* ad_changes()
+|  Calls callback once for each object below base (the configured
+| searchbase if base is NULL) matching filter that has changed or been
+| deleted since cookie was given out by an earlier call, or for every
+| object if cookie is NULL.  On success new_cookie is set to a malloc'd
+| cookie for the next call.
+|  The entry passed to the callback holds those of attrs (all if NULL)
+| that changed, and deleted is non-zero if the object has been deleted,
+| in which case dn is the dn it had.  Objects moved out of base are not
+| reported.
+|  method is one of
+|	AD_CHANGES_AUTO		the DirSync control, or uSNChanged searches
+|				where the server or account doesn't allow
+|				DirSync.  The cookie decides which is used
+|				after the first call.
+|	AD_CHANGES_DIRSYNC	the DirSync control, which reports only the
+|				attributes that changed
+|	AD_CHANGES_USN		searches by uSNChanged, which report the whole
+|				of each changed object.  The cookie only
+|				applies to the domain controller it came from,
+|				other servers report every object.
+|  If the callback returns non-zero reading stops and no cookie is given.
+|  Returns AD_SUCCESS, AD_MISSING_CONFIG_PARAMETER or
+| AD_LDAP_OPERATION_FAILURE.
+*/
+#define AD_CHANGES_AUTO 0
+#define AD_CHANGES_DIRSYNC 1
+#define AD_CHANGES_USN 2
+typedef int (*ad_change_callback)(LDAP *ds, LDAPMessage *entry, char *dn, int deleted, void *data);
+int ad_changes(char *base, char *filter, char **attrs, char *cookie,
+		int method, ad_change_callback callback, void *data,
+		char **new_cookie);
+
+/* ad_watch()
+|  Calls callback as objects below base (the configured searchbase if
+| base is NULL) matching filter change, from change notifications the
+| server sends as they happen, until the callback returns non-zero.
+| The entry holds the object's attrs (none if NULL) and deleted is set
+| as for ad_changes().  Deletions are only seen with a
+| LDAP_SCOPE_SUBTREE scope.
+|  The watch has a connection of its own.  If that is lost it is
+| reopened, retrying for as long as it takes, and callback is then
+| called with a NULL entry and dn, as changes made in between were
+| missed.
+|  Returns AD_SUCCESS once the callback stops the watch, or
+| AD_MISSING_CONFIG_PARAMETER, AD_SERVER_CONNECT_FAILURE or
+| AD_LDAP_OPERATION_FAILURE if the server won't send notifications.
+*/
+int ad_watch(char *base, int scope, char *filter, char **attrs,
+		ad_change_callback callback, void *data);
+
+/* Snapshots
+|  A snapshot is a copy of the objects below a base kept in a file,
+| which is queried without the server.  Opening one maps the file into
+| memory with nothing to parse, and lookups by dn, sAMAccountName or
+| objectGUID go through hash indexes in the file.  Values handed to
+| callbacks point into the mapping and stay valid until the snapshot
+| is closed.
+|  Example usage:
+| ad_snapshot_build("users.snap", NULL, "(objectclass=user)", NULL, "mail");
+| s=ad_snapshot_open("users.snap");
+| entry=ad_snapshot_find(s, "sAMAccountName", "jsmith", 6);
+| if(entry>=0) ad_snapshot_values(s, entry, "mail", print_value, NULL);
+| ad_snapshot_close(s);
+*/
+typedef struct ad_snapshot ad_snapshot;
+
+/* ad_snapshot_build() writes a snapshot of the objects below base (the
+| configured searchbase if NULL) matching filter (all if NULL) with
+| attrs ("*" if NULL) to filename, replacing it once complete.
+| sAMAccountName and objectGUID are always kept.  If sorted_attribute
+| isn't NULL its values are also kept sorted, for lookups of a value
+| or a prefix of one.
+|  Returns AD_SUCCESS, AD_MISSING_CONFIG_PARAMETER,
+| AD_LDAP_OPERATION_FAILURE or AD_INVALID_SNAPSHOT if the file can't
+| be written.
+*/
+int ad_snapshot_build(char *filename, char *base, char *filter, char **attrs,
+		char *sorted_attribute);
+
+/* ad_snapshot_open() maps a snapshot written by ad_snapshot_build().
+|  Returns NULL with the error set to AD_INVALID_SNAPSHOT if the file
+| can't be read, isn't a snapshot or is damaged.
+*/
+ad_snapshot *ad_snapshot_open(char *filename);
+void ad_snapshot_close(ad_snapshot *s);
+
+/* entries of a snapshot are numbered from 0 to ad_snapshot_count()-1 */
+int ad_snapshot_count(ad_snapshot *s);
+char *ad_snapshot_dn(ad_snapshot *s, int entry);
+
+/* the base the snapshot was built from */
+char *ad_snapshot_base(ad_snapshot *s);
+
+/* ad_snapshot_find() returns the entry whose attribute is value, of the
+| given length, or -1.  "dn" looks entries up by dn.  dn,
+| sAMAccountName and objectGUID are found through the indexes, other
+| attributes by reading every entry.
+*/
+int ad_snapshot_find(ad_snapshot *s, char *attribute, char *value, int length);
+
+/* ad_snapshot_search() calls callback with each entry with a value of
+| attribute ("dn" for the entry's dn) matching value, in which * matches
+| any characters, until the callback returns non-zero.  Values are
+| compared ignoring case.  The indexes answer exact values and, for the
+| sorted attribute, prefixes; other searches read every entry.
+|  Returns AD_SUCCESS.
+*/
+typedef int (*ad_snapshot_callback)(ad_snapshot *s, int entry, void *data);
+int ad_snapshot_search(ad_snapshot *s, char *attribute, char *value,
+		ad_snapshot_callback callback, void *data);
+
+/* ad_snapshot_children() calls callback with each entry directly below
+| dn in the snapshot, until the callback returns non-zero.
+|  Returns AD_SUCCESS, or AD_OBJECT_NOT_FOUND if dn isn't in the
+| snapshot.
+*/
+int ad_snapshot_children(ad_snapshot *s, char *dn, ad_snapshot_callback callback, void *data);
+
+/* ad_snapshot_values() calls callback with each value of attribute of
+| an entry, as ad_get_values_each() does.  ad_snapshot_attributes()
+| calls callback with every value of the entry and its attribute name.
+|  Returns AD_SUCCESS, or AD_ATTRIBUTE_ENTRY_NOT_FOUND if the entry has
+| no values of attribute.
+*/
+int ad_snapshot_values(ad_snapshot *s, int entry, char *attribute,
+		ad_value_callback callback, void *data);
+int ad_snapshot_attributes(ad_snapshot *s, int entry,
+		int (*callback)(char *attribute, struct berval *value, void *data), void *data);
+
+/* Pipelined writes
+|  The functions above wait a full round trip to the server for each
+| operation.  An ad_pipeline instead keeps up to window requests
+| outstanding on the connection, so bulk writes are limited by server
+| throughput rather than latency.
+|  Example usage:
+| p=ad_pipeline_new(100, report, NULL);
+| for(i=0; users[i]!=NULL; i++)
+|	ad_pipeline_mod_add(p, group_dn, "member", users[i]);
+| ad_pipeline_free(p);
+|  The callback is called once per request, in submission order, with
+| the request's sequence number (counting from 0), its dn, the ldap
+| result code (LDAP_SUCCESS on success) and an error message, or NULL
+| on success.  The callback may be NULL.
+|  Requests are encoded before the submitting function returns, so the
+| arguments don't need to outlive the call.
+|  While a pipeline is open its connection should not be used for
+| other asynchronous operations.
+*/
+#define AD_PIPELINE_WINDOW 64
+
+typedef struct ad_pipeline ad_pipeline;
+typedef void (*ad_pipeline_callback)(int sequence, char *dn, int result, char *message, void *callback_data);
+
+/* ad_pipeline_new() creates a pipeline with the given window size
+| (AD_PIPELINE_WINDOW if window is 0) on the connection used by the
+| other ad_ functions.
+|  Returns NULL if the server can't be connected to.
+*/
+ad_pipeline *ad_pipeline_new(int window, ad_pipeline_callback callback, void *callback_data);
+
+/* ad_pipeline_modify(), ad_pipeline_add() and ad_pipeline_delete()
+| queue an ldap modify, add or delete request, first waiting for the
+| oldest request to complete if the window is full.
+|  Returns AD_SUCCESS, or AD_LDAP_OPERATION_FAILURE if the request
+| couldn't be sent.  Requests which aren't sent are still reported to
+| the callback.
+*/
+int ad_pipeline_modify(ad_pipeline *p, char *dn, LDAPMod **mods);
+int ad_pipeline_add(ad_pipeline *p, char *dn, LDAPMod **attrs);
+int ad_pipeline_delete(ad_pipeline *p, char *dn);
+
+/* ad_pipeline_rename() queues an ldap modrdn request giving dn the
+| rdn new_rdn, and moving it below new_parent unless that is NULL.
+|  delete_old_rdn is non-zero to remove the old rdn's value from the
+| object.
+*/
+int ad_pipeline_rename(ad_pipeline *p, char *dn, char *new_rdn, char *new_parent, int delete_old_rdn);
+
+/* ad_pipeline_mod_add(), ad_pipeline_mod_replace() and
+| ad_pipeline_mod_delete() queue the same changes as ad_mod_add(),
+| ad_mod_replace() and ad_mod_delete().
+*/
+int ad_pipeline_mod_add(ad_pipeline *p, char *dn, char *attribute, char *value);
+int ad_pipeline_mod_replace(ad_pipeline *p, char *dn, char *attribute, char *value);
+int ad_pipeline_mod_delete(ad_pipeline *p, char *dn, char *attribute, char *value);
+
+/* ad_pipeline_change() queues the same request as ad_modify().
+*/
+int ad_pipeline_change(ad_pipeline *p, char *dn, ad_change *changes);
+
+/* ad_pipeline_create() queues an add of a new object with the given
+| attributes, an array of ad_changes as for ad_modify() whose op is
+| ignored.
+*/
+int ad_pipeline_create(ad_pipeline *p, char *dn, ad_change *attributes);
+
+/* ad_pipeline_flush() waits for all outstanding requests to complete.
+|  Returns AD_SUCCESS if every request submitted so far succeeded, or
+| AD_LDAP_OPERATION_FAILURE.
+*/
+int ad_pipeline_flush(ad_pipeline *p);
+
+/* ad_pipeline_free() flushes and then frees the pipeline.
+|  Returns the same as ad_pipeline_flush().
+*/
+int ad_pipeline_free(ad_pipeline *p);
+
+/* Hash tables
+|  An ad_hash maps strings to pointer sized values, eg. to keep a set
+| of dns.  ad_hash_new() makes one with room for size keys before it
+| grows.
+|  ad_hash_insert() returns the key's value slot, adding a copy of the
+| key with a NULL value if it is new, and sets added, if it isn't NULL,
+| to whether it was.  ad_hash_find() returns the slot or NULL if the key
+| isn't present.  ad_hash_remove() drops the key, returning its value.
+|  ad_hash_free() frees the table, calling free_value, if it isn't
+| NULL, on each value that isn't NULL.
+|  ad_normalize_dn() returns a malloc'd copy of dn in the form to use as
+| a key, lower cased and without the spaces allowed around separators,
+| so that different spellings of one dn are the same key.
+*/
+struct ad_hash;
+struct ad_hash *ad_hash_new(int size);
+void **ad_hash_insert(struct ad_hash *h, char *key, int *added);
+void **ad_hash_find(struct ad_hash *h, char *key);
+void *ad_hash_remove(struct ad_hash *h, char *key);
+int ad_hash_count(struct ad_hash *h);
+void ad_hash_each(struct ad_hash *h, void (*callback)(char *key, void *value, void *data), void *data);
+void ad_hash_free(struct ad_hash *h, void (*free_value)(void *));
+char *ad_normalize_dn(char *dn);
+
 /* Error codes */
 #define AD_SUCCESS 1
 #define AD_COULDNT_OPEN_CONFIG_FILE 2
@@ -224,5 +870,6 @@ char **ad_list(char *dn);
 #define AD_OBJECT_NOT_FOUND 6
 #define AD_ATTRIBUTE_ENTRY_NOT_FOUND 7
 #define AD_INVALID_DN 8
+#define AD_INVALID_SNAPSHOT 9
 
 #endif /* ACTIVE_DIRECTORY_H */
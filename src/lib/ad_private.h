@@ -0,0 +1,154 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* ad_private.h
+ * functions and state shared between the library's source files,
+ * not part of the public interface */
+
+#ifndef AD_PRIVATE_H
+#define AD_PRIVATE_H 1
+
+#include "active_directory.h"
+#include <time.h>
+
+#define MAX_ERR_LENGTH 1024
+
+/* an ldap operation being timed, see stats.c.  operations started
+	while another runs on the same thread are stacked on it */
+struct ad_op {
+	int started;
+	int kind;
+	char *dn;
+	int running;
+	struct timespec mark;
+	long long nanoseconds;
+	long long bytes;
+	int round_trips;
+	int entries;
+	struct ad_op *outer;
+	int outer_running;
+};
+
+/* when a new connection's setup reached each stage */
+struct ad_connect_timing {
+	struct timespec start;
+	struct timespec connected;
+	struct timespec sent;
+};
+
+/* error state and the checked out pool connection are kept per thread
+	so the library can be used from several threads at once, as are
+	the operation being timed and the connection being set up */
+struct ad_thread_state {
+	char error_msg[MAX_ERR_LENGTH];
+	int error_code;
+	int pool_slot;
+	struct ad_op *op;
+	struct ad_connect_timing *connecting;
+};
+
+struct ad_thread_state *ad_thread_state();
+
+#define ad_error_msg (ad_thread_state()->error_msg)
+#define ad_error_code (ad_thread_state()->error_code)
+
+extern char *config_file;
+
+/* connect and authenticate to active directory server.
+	returns an ldap connection identifier or 0 on error */
+LDAP *ad_login();
+
+/* open a new bound connection, not shared with the other functions.
+	returns 0 on error */
+LDAP *ad_connect();
+
+/* read the config file once, returns AD_SUCCESS or
+	AD_MISSING_CONFIG_PARAMETER */
+int ad_read_config();
+
+/* convert a dn into its dns domain, free() the result */
+char *dn2domain(char *dn);
+
+/* growable NULL terminated list of dns, built up by
+	ad_dnlist_append() as search results arrive */
+struct dnlist {
+	char **dns;
+	int count;
+	int size;
+};
+
+int ad_dnlist_append(LDAP *ds, LDAPMessage *entry, char *dn, void *data);
+
+/* read a search's results, calling callback for each entry.
+	returns the ldap result code */
+int ad_search_results(LDAP *ds, int msgid, ad_search_callback callback,
+		void *data, LDAPControl ***response_controls, int *stop);
+
+/* paged, streaming search.  returns the ldap result code */
+int ad_paged_search(LDAP *ds, char *base, int scope, char *filter,
+		char **attrs, int attrsonly,
+		ad_search_callback callback, void *data);
+
+/* the same with an extra server control */
+int ad_paged_search_ext(LDAP *ds, char *base, int scope, char *filter,
+		char **attrs, int attrsonly, LDAPControl *control,
+		ad_search_callback callback, void *data);
+
+/* build an ldap modification list from ad_changes, and free it */
+LDAPMod **ad_build_mods(ad_change *changes);
+void ad_free_mods(LDAPMod **mods);
+
+/* quote and utf-16 encode a password for unicodePwd.
+	returns the encoded length */
+int ad_encode_password(char *password, char *buffer);
+
+/* write a binary objectSid as an S-1-5-21-... string, which search
+	filters accept in place of the binary value.  returns 0 if the
+	value isn't a sid */
+#define AD_SID_LENGTH 192
+int ad_sid_string(struct berval *sid, char *buffer);
+
+/* TLS session cache, see tls_cache.c.  ad_tls_prepare() is called
+	before binding a new connection and ad_tls_established() after */
+void ad_tls_prepare(LDAP *ds);
+void ad_tls_established(LDAP *ds);
+
+/* statistics, see stats.c.  each does nothing unless ad_stats_enable()
+	or ad_set_observer() was called.  ad_op_start() and ad_op_end()
+	bracket an operation on
+	the calling thread, which counts as one round trip unless
+	ad_op_round_trip() is called for each request it sends.
+	ad_op_pause() and ad_op_resume() stop the thread's current
+	operation's clock while a callback runs.  a request pipelined with
+	others is stamped by ad_op_sent() when it is sent and counted by
+	ad_op_record() when its result arrives.
+	ad_stats_connecting() is called before binding a new connection and
+	ad_stats_connected() after.  ad_stats_resolve() counts a name
+	resolved from the cache or with a search */
+extern int ad_stats_enabled;
+extern int ad_ops_timed;
+void ad_op_start(struct ad_op *op, int kind, char *dn);
+void ad_op_end(struct ad_op *op, int result);
+void ad_op_pause();
+void ad_op_resume();
+void ad_op_round_trip();
+void ad_op_entry();
+void ad_op_sent(int kind, char *dn, struct timespec *sent);
+void ad_op_record(int kind, char *dn, int result, struct timespec *sent);
+void ad_stats_now(struct timespec *now);
+void ad_stats_phase(int phase, struct timespec *start);
+void ad_stats_connecting(LDAP *ds, struct ad_connect_timing *timing);
+void ad_stats_connected(struct ad_connect_timing *timing);
+void ad_stats_resolve(int cached);
+
+#endif /* AD_PRIVATE_H */
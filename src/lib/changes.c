@@ -0,0 +1,617 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* changes.c
+ * reading what changed in the directory since an earlier run
+ *
+ * ad_changes() prefers the DirSync control, with which the server
+ * keeps track of how far a client has read in an opaque cookie and
+ * returns only the attributes that changed.  It is asked to return
+ * only what the caller may read, so no replication rights are needed.
+ * Where DirSync is refused, changes are found by uSNChanged, the
+ * update sequence number a domain controller stamps on each object it
+ * changes, with deleted objects read through the show deleted control.
+ * USNs are local to one domain controller, so the cookie records which
+ * one and reading from another starts over with every object.
+ *
+ * Cookies are text: "dirsync:" followed by the server's cookie in hex,
+ * or "usn:" followed by the server's dnsHostName, ":" and the first USN
+ * not yet read.
+ *
+ * ad_watch() instead leaves searches with the change notification
+ * control outstanding, which the server answers with an entry each
+ * time an object changes and never completes.  Notifications only
+ * allow the filter (objectclass=*), so another filter is checked with
+ * a base search on each object reported. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ad_private.h"
+#include <ldap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define AD_DIRSYNC_OID "1.2.840.113556.1.4.841"
+#define AD_SHOW_DELETED_OID "1.2.840.113556.1.4.417"
+
+/* LDAP_DIRSYNC_OBJECT_SECURITY, so that only what the caller can read
+	is returned and no replication right is needed, and
+	LDAP_DIRSYNC_ANCESTORS_FIRST_ORDER so parents come before their
+	children */
+#define AD_DIRSYNC_FLAGS (0x1|0x800)
+#define AD_DIRSYNC_MAX_BYTES (1024*1024)
+
+#define AD_NOTIFICATION_OID "1.2.840.113556.1.4.528"
+
+/* the well known guid of a naming context's deleted objects container */
+#define AD_DELETED_OBJECTS_WKGUID "18e2ea80684f11d2b9aa00c04f79f805"
+
+/* seconds without a notification before the connection is checked */
+#define AD_WATCH_KEEPALIVE 300
+
+/* longest pause between attempts to reconnect */
+#define AD_WATCH_RETRY 60
+
+struct change_search {
+	char *base;
+	ad_change_callback callback;
+	void *data;
+	int entries;
+	int stop;
+};
+
+struct change_server {
+	char *host;
+	long long highest_usn;
+};
+
+/* the naming context base is in, where DirSync and deleted objects
+	have to be searched from: its dc= components */
+char *change_naming_context(char *base) {
+	int i;
+
+	for(i=0; base[i]!='\0'; i++) {
+		if((i==0 || base[i-1]==',') && !strncasecmp(base+i, "dc=", 3))
+			return base+i;
+		if(base[i]=='\\' && base[i+1]!='\0') i++;
+	}
+	return base;
+}
+
+/* whether dn is base or below it.  base is normalized */
+int change_below(char *dn, char *base) {
+	char *normal;
+	int dn_length, base_length, below;
+
+	normal=ad_normalize_dn(dn);
+	dn_length=strlen(normal);
+	base_length=strlen(base);
+	below=dn_length>=base_length
+		&& !strcmp(normal+dn_length-base_length, base)
+		&& (dn_length==base_length
+			|| normal[dn_length-base_length-1]==',');
+	free(normal);
+	return below;
+}
+
+/* the dn a deleted object had, from the first part of its rdn in the
+	deleted objects container and its lastKnownParent.  returns NULL if
+	that can't be told */
+char *change_deleted_dn(LDAP *ds, LDAPMessage *entry, char *dn) {
+	struct berval **values;
+	char *mark, *original=NULL;
+	int length;
+
+	mark=strstr(dn, "\\0ADEL:");
+	values=ldap_get_values_len(ds, entry, "lastKnownParent");
+	if(mark!=NULL && values!=NULL && values[0]!=NULL) {
+		length=(mark-dn)+values[0]->bv_len+2;
+		original=malloc(length);
+		snprintf(original, length, "%.*s,%.*s", (int)(mark-dn), dn,
+			(int)values[0]->bv_len, values[0]->bv_val);
+	}
+	if(values!=NULL) ldap_value_free_len(values);
+	return original;
+}
+
+/* attrs along with isDeleted, by which deleted objects are told, and
+	lastKnownParent, which says where they were.  free() the result */
+char **change_attributes(char **attrs) {
+	char **change_attrs;
+	int i;
+
+	for(i=0; attrs[i]!=NULL; i++);
+	change_attrs=malloc(sizeof(char *)*(i+3));
+	memcpy(change_attrs, attrs, sizeof(char *)*i);
+	change_attrs[i]="isDeleted";
+	change_attrs[i+1]="lastKnownParent";
+	change_attrs[i+2]=NULL;
+	return change_attrs;
+}
+
+int change_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct change_search *search=data;
+	struct berval **values;
+	char *original=NULL;
+	int deleted=0, below=1;
+
+	search->entries++;
+	values=ldap_get_values_len(ds, entry, "isDeleted");
+	if(values!=NULL) {
+		deleted=values[0]!=NULL && values[0]->bv_len==4
+			&& !strncasecmp(values[0]->bv_val, "TRUE", 4);
+		ldap_value_free_len(values);
+	}
+	if(deleted) original=change_deleted_dn(ds, entry, dn);
+
+	/* deletions whose old place isn't known are reported anyway */
+	if(search->base!=NULL && (!deleted || original!=NULL))
+		below=change_below(original?original:dn, search->base);
+	if(below)
+		search->stop=search->callback(ds, entry,
+			original?original:dn, deleted, search->data);
+	free(original);
+	return search->stop;
+}
+
+/* read DirSync results from base until the server has no more,
+	leaving cookie holding the server's latest.
+	returns the ldap result code */
+int change_dirsync(LDAP *ds, char *base, char *filter, char **attrs,
+		struct berval *cookie, struct change_search *search) {
+	BerElement *ber;
+	struct berval value, *new_cookie;
+	LDAPControl *control, *server_controls[2];
+	LDAPControl **response_controls, *response;
+	ber_int_t more, unused;
+	int msgid, result, stop;
+
+	do {
+		ber=ber_alloc_t(LBER_USE_DER);
+		if(ber==NULL) return LDAP_NO_MEMORY;
+		if(ber_printf(ber, "{iiO}", AD_DIRSYNC_FLAGS,
+				AD_DIRSYNC_MAX_BYTES, cookie)<0
+				|| ber_flatten2(ber, &value, 0)<0) {
+			ber_free(ber, 1);
+			return LDAP_ENCODING_ERROR;
+		}
+		result=ldap_control_create(AD_DIRSYNC_OID, 1, &value, 1, &control);
+		ber_free(ber, 1);
+		if(result!=LDAP_SUCCESS) return result;
+
+		server_controls[0]=control;
+		server_controls[1]=NULL;
+		ad_op_round_trip();
+		result=ldap_search_ext(ds, base, LDAP_SCOPE_SUBTREE, filter,
+			attrs, 0, server_controls, NULL, NULL,
+			LDAP_NO_LIMIT, &msgid);
+		ldap_control_free(control);
+		if(result!=LDAP_SUCCESS) return result;
+
+		result=ad_search_results(ds, msgid, change_entry, search,
+			&response_controls, &stop);
+		if(stop) {
+			if(response_controls!=NULL)
+				ldap_controls_free(response_controls);
+			return LDAP_SUCCESS;
+		}
+
+		more=0;
+		response=NULL;
+		if(response_controls!=NULL)
+			response=ldap_control_find(AD_DIRSYNC_OID,
+				response_controls, NULL);
+		if(response!=NULL) {
+			ber=ber_init(&response->ldctl_value);
+			if(ber!=NULL && ber_scanf(ber, "{iiO}", &more, &unused,
+					&new_cookie)!=LBER_ERROR) {
+				free(cookie->bv_val);
+				cookie->bv_val=malloc(new_cookie->bv_len+1);
+				memcpy(cookie->bv_val, new_cookie->bv_val,
+					new_cookie->bv_len);
+				cookie->bv_len=new_cookie->bv_len;
+				ber_bvfree(new_cookie);
+			} else if(result==LDAP_SUCCESS) {
+				result=LDAP_DECODING_ERROR;
+			}
+			if(ber!=NULL) ber_free(ber, 1);
+		} else if(result==LDAP_SUCCESS) {
+			result=LDAP_PROTOCOL_ERROR;
+		}
+		if(response_controls!=NULL)
+			ldap_controls_free(response_controls);
+	} while(result==LDAP_SUCCESS && more);
+
+	return result;
+}
+
+int change_server_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct change_server *server=data;
+	struct berval **values;
+
+	values=ldap_get_values_len(ds, entry, "dnsHostName");
+	if(values!=NULL) {
+		if(values[0]!=NULL)
+			server->host=strndup(values[0]->bv_val, values[0]->bv_len);
+		ldap_value_free_len(values);
+	}
+	values=ldap_get_values_len(ds, entry, "highestCommittedUSN");
+	if(values!=NULL) {
+		if(values[0]!=NULL)
+			server->highest_usn=strtoll(values[0]->bv_val, NULL, 10);
+		ldap_value_free_len(values);
+	}
+	return 0;
+}
+
+/* read changes by uSNChanged, from usn on if host is the server
+	connected to.  new_cookie is set on success.
+	returns the ldap result code */
+int change_usn(LDAP *ds, char *base, char *filter, char **attrs,
+		char *host, long long usn, struct change_search *search,
+		char **new_cookie) {
+	char *root_attrs[]={"dnsHostName", "highestCommittedUSN", NULL};
+	struct change_server server={NULL, -1};
+	LDAPControl *show_deleted;
+	char *usn_filter;
+	int length, result;
+
+	/* read the server's position first, anything changed while
+		reading is then read again next time rather than missed */
+	result=ad_paged_search(ds, "", LDAP_SCOPE_BASE, "(objectclass=*)",
+		root_attrs, 0, change_server_entry, &server);
+	if(result==LDAP_SUCCESS && (server.host==NULL || server.highest_usn<0))
+		result=LDAP_NO_SUCH_ATTRIBUTE;
+	if(result!=LDAP_SUCCESS) {
+		free(server.host);
+		return result;
+	}
+	if(host==NULL || strcasecmp(host, server.host)) usn=0;
+
+	length=strlen(filter)+64;
+	usn_filter=malloc(length);
+	snprintf(usn_filter, length, "(&(uSNChanged>=%lld)%s)", usn, filter);
+	result=ad_paged_search(ds, base, LDAP_SCOPE_SUBTREE, usn_filter,
+		attrs, 0, change_entry, search);
+
+	/* an object deleted since the last run is a tombstone in the
+		deleted objects container, seen only with show deleted */
+	if(result==LDAP_SUCCESS && !search->stop && usn>0) {
+		snprintf(usn_filter, length,
+			"(&(isDeleted=TRUE)(uSNChanged>=%lld)%s)", usn, filter);
+		result=ldap_control_create(AD_SHOW_DELETED_OID, 1, NULL, 0,
+			&show_deleted);
+		if(result==LDAP_SUCCESS) {
+			result=ad_paged_search_ext(ds,
+				change_naming_context(base),
+				LDAP_SCOPE_SUBTREE, usn_filter, attrs, 0,
+				show_deleted, change_entry, search);
+			ldap_control_free(show_deleted);
+		}
+	}
+	free(usn_filter);
+
+	if(result==LDAP_SUCCESS && !search->stop) {
+		length=strlen(server.host)+32;
+		*new_cookie=malloc(length);
+		snprintf(*new_cookie, length, "usn:%s:%lld", server.host,
+			server.highest_usn+1);
+	}
+	free(server.host);
+	return result;
+}
+
+/* decode a hex cookie.  returns 0 if it isn't one */
+int change_hex_decode(char *hex, struct berval *value) {
+	unsigned int byte;
+	int i, length;
+
+	length=strlen(hex);
+	if(length%2) return 0;
+	value->bv_val=malloc(length/2+1);
+	value->bv_len=length/2;
+	for(i=0; i<length/2; i++) {
+		if(sscanf(hex+i*2, "%2x", &byte)!=1) {
+			free(value->bv_val);
+			return 0;
+		}
+		value->bv_val[i]=byte;
+	}
+	return 1;
+}
+
+char *change_hex_cookie(struct berval *value) {
+	char *cookie;
+	int i;
+
+	cookie=malloc(value->bv_len*2+9);
+	strcpy(cookie, "dirsync:");
+	for(i=0; i<value->bv_len; i++)
+		sprintf(cookie+8+i*2, "%02x", (unsigned char)value->bv_val[i]);
+	cookie[8+i*2]='\0';
+	return cookie;
+}
+
+int ad_changes(char *base, char *filter, char **attrs, char *cookie,
+		int method, ad_change_callback callback, void *data,
+		char **new_cookie) {
+	LDAP *ds;
+	struct change_search search;
+	struct ad_op op;
+	struct berval dirsync_cookie={0, NULL};
+	char *all_attrs[]={"*", NULL};
+	char **change_attrs;
+	char *host=NULL, *mark;
+	long long usn=0;
+	int result;
+
+	*new_cookie=NULL;
+	ds=ad_login();
+	if(!ds) return ad_error_code;
+
+	if(base==NULL) base=search_base;
+	if(!base) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+		return ad_error_code;
+	}
+	if(filter==NULL) filter="(objectclass=*)";
+	if(attrs==NULL) attrs=all_attrs;
+
+	/* a cookie from the other method starts that one over */
+	if(cookie!=NULL) {
+		if(!strncmp(cookie, "dirsync:", 8)
+				&& change_hex_decode(cookie+8, &dirsync_cookie)) {
+			if(method==AD_CHANGES_AUTO) method=AD_CHANGES_DIRSYNC;
+		} else if(!strncmp(cookie, "usn:", 4)
+				&& (mark=strrchr(cookie+4, ':'))!=NULL) {
+			host=strndup(cookie+4, mark-(cookie+4));
+			usn=strtoll(mark+1, NULL, 10);
+			if(method==AD_CHANGES_AUTO) method=AD_CHANGES_USN;
+		} else {
+			snprintf(ad_error_msg, MAX_ERR_LENGTH,
+				"Error in ad_changes: %s isn't a changes cookie",
+				cookie);
+			ad_error_code=AD_LDAP_OPERATION_FAILURE;
+			return ad_error_code;
+		}
+	}
+	if(dirsync_cookie.bv_val==NULL) dirsync_cookie.bv_val=malloc(1);
+
+	change_attrs=change_attributes(attrs);
+	search.base=ad_normalize_dn(base);
+	search.callback=callback;
+	search.data=data;
+	search.entries=0;
+	search.stop=0;
+
+	result=LDAP_SUCCESS;
+	if(method!=AD_CHANGES_USN) {
+		ad_op_start(&op, AD_OP_SEARCH, base);
+		result=change_dirsync(ds, change_naming_context(base), filter,
+			change_attrs, &dirsync_cookie, &search);
+		ad_op_end(&op, result);
+		if(result==LDAP_SUCCESS && !search.stop)
+			*new_cookie=change_hex_cookie(&dirsync_cookie);
+		if(method==AD_CHANGES_AUTO && search.entries==0
+				&& (result==LDAP_INSUFFICIENT_ACCESS
+				|| result==LDAP_UNAVAILABLE_CRITICAL_EXTENSION
+				|| result==LDAP_UNWILLING_TO_PERFORM))
+			method=AD_CHANGES_USN;
+	}
+	if(method==AD_CHANGES_USN)
+		result=change_usn(ds, base, filter, change_attrs, host, usn,
+			&search, new_cookie);
+
+	if(result!=LDAP_SUCCESS) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_changes: %s", ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	} else {
+		ad_error_code=AD_SUCCESS;
+	}
+
+	free(search.base);
+	free(change_attrs);
+	free(dirsync_cookie.bv_val);
+	free(host);
+	return ad_error_code;
+}
+
+/* whether a notification search ending with result should be started
+	again rather than given up on */
+int watch_transient(int result) {
+	return result<0 || result==LDAP_SUCCESS || result==LDAP_BUSY
+		|| result==LDAP_UNAVAILABLE
+		|| result==LDAP_ADMINLIMIT_EXCEEDED
+		|| result==LDAP_TIMELIMIT_EXCEEDED;
+}
+
+/* start notifications of changes below base and, for a subtree, of
+	objects deleted into the deleted objects container, whose old place
+	change_entry() checks.  returns the ldap result code */
+int watch_start(LDAP *ds, char *base, int scope, char **attrs, int *msgids) {
+	LDAPControl *notification, *show_deleted, *server_controls[3];
+	char *deleted_base;
+	int length, result;
+
+	result=ldap_control_create(AD_NOTIFICATION_OID, 1, NULL, 0, &notification);
+	if(result!=LDAP_SUCCESS) return result;
+	result=ldap_control_create(AD_SHOW_DELETED_OID, 1, NULL, 0, &show_deleted);
+	if(result!=LDAP_SUCCESS) {
+		ldap_control_free(notification);
+		return result;
+	}
+
+	server_controls[0]=notification;
+	server_controls[1]=NULL;
+	msgids[1]=-1;
+	result=ldap_search_ext(ds, base, scope, "(objectclass=*)", attrs, 0,
+		server_controls, NULL, NULL, LDAP_NO_LIMIT, &msgids[0]);
+	if(result==LDAP_SUCCESS && scope==LDAP_SCOPE_SUBTREE) {
+		length=strlen(change_naming_context(base))+48;
+		deleted_base=malloc(length);
+		snprintf(deleted_base, length, "<WKGUID=%s,%s>",
+			AD_DELETED_OBJECTS_WKGUID, change_naming_context(base));
+		server_controls[1]=show_deleted;
+		server_controls[2]=NULL;
+		result=ldap_search_ext(ds, deleted_base, LDAP_SCOPE_ONELEVEL,
+			"(objectclass=*)", attrs, 0, server_controls, NULL,
+			NULL, LDAP_NO_LIMIT, &msgids[1]);
+		free(deleted_base);
+	}
+
+	ldap_control_free(notification);
+	ldap_control_free(show_deleted);
+	return result;
+}
+
+/* whether the object dn matches filter, asked with a base search.
+	returns the ldap result code, LDAP_NO_SUCH_OBJECT if it doesn't */
+int watch_matches(LDAP *ds, char *dn, char *filter) {
+	LDAPControl *show_deleted, *server_controls[2];
+	LDAPMessage *res=NULL;
+	struct ad_op op;
+	char *attrs[]={"1.1", NULL};
+	int result;
+
+	result=ldap_control_create(AD_SHOW_DELETED_OID, 1, NULL, 0, &show_deleted);
+	if(result!=LDAP_SUCCESS) return result;
+	server_controls[0]=show_deleted;
+	server_controls[1]=NULL;
+	ad_op_start(&op, AD_OP_SEARCH, dn);
+	result=ldap_search_ext_s(ds, dn, LDAP_SCOPE_BASE, filter, attrs, 0,
+		server_controls, NULL, NULL, 1, &res);
+	ad_op_end(&op, result);
+	ldap_control_free(show_deleted);
+	if(result==LDAP_SUCCESS && ldap_count_entries(ds, res)==0)
+		result=LDAP_NO_SUCH_OBJECT;
+	if(res!=NULL) ldap_msgfree(res);
+	return result;
+}
+
+int ad_watch(char *base, int scope, char *filter, char **attrs,
+		ad_change_callback callback, void *data) {
+	LDAP *ds=NULL;
+	LDAPMessage *res;
+	struct change_search search;
+	struct ad_op op;
+	struct timeval timeout;
+	char *default_attrs[]={"1.1", NULL};
+	char **watch_attrs, *dn;
+	int msgids[2], found, result=LDAP_SUCCESS, type;
+	int watching=0, wait=1, check;
+
+	if(ad_read_config()!=AD_SUCCESS) return ad_error_code;
+	if(base==NULL) base=search_base;
+	if(!base) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+		return ad_error_code;
+	}
+	check=filter!=NULL && strcasecmp(filter, "(objectclass=*)");
+	if(attrs==NULL) attrs=default_attrs;
+	watch_attrs=change_attributes(attrs);
+
+	search.base=ad_normalize_dn(base);
+	search.callback=callback;
+	search.data=data;
+	search.entries=0;
+	search.stop=0;
+
+	while(!search.stop) {
+		if(ds==NULL) {
+			ds=ad_connect();
+			if(ds!=NULL) {
+				result=watch_start(ds, base, scope, watch_attrs, msgids);
+				if(result!=LDAP_SUCCESS) {
+					ldap_unbind_ext(ds, NULL, NULL);
+					ds=NULL;
+					if(!watch_transient(result)) break;
+				}
+			} else if(!watching) {
+				/* nothing to carry on from, so give up */
+				break;
+			}
+			if(ds==NULL) {
+				sleep(wait);
+				wait=(wait*2>AD_WATCH_RETRY)?AD_WATCH_RETRY:wait*2;
+				continue;
+			}
+			wait=1;
+			/* changes while disconnected weren't seen */
+			if(watching) search.stop=callback(ds, NULL, NULL, 0, data);
+			watching=1;
+			continue;
+		}
+
+		timeout.tv_sec=AD_WATCH_KEEPALIVE;
+		timeout.tv_usec=0;
+		found=ldap_result(ds, LDAP_RES_ANY, LDAP_MSG_ONE, &timeout, &res);
+		if(found==0) {
+			/* a connection dropped along the way only shows when
+				it is used */
+			res=NULL;
+			ad_op_start(&op, AD_OP_SEARCH, "");
+			result=ldap_search_ext_s(ds, "", LDAP_SCOPE_BASE,
+				"(objectclass=*)", default_attrs, 0, NULL, NULL,
+				&timeout, 1, &res);
+			ad_op_end(&op, result);
+			if(res!=NULL) ldap_msgfree(res);
+			if(result==LDAP_SUCCESS) continue;
+		}
+		if(found<=0) {
+			ldap_unbind_ext(ds, NULL, NULL);
+			ds=NULL;
+			continue;
+		}
+
+		type=ldap_msgtype(res);
+		if(type==LDAP_RES_SEARCH_ENTRY) {
+			dn=ldap_get_dn(ds, res);
+			if(!check || watch_matches(ds, dn, filter)==LDAP_SUCCESS)
+				change_entry(ds, res, dn, &search);
+			ldap_memfree(dn);
+			ldap_msgfree(res);
+		} else if(type==LDAP_RES_SEARCH_RESULT) {
+			/* the server ended a notification search */
+			if(ldap_parse_result(ds, res, &result, NULL, NULL, NULL,
+					NULL, 1)!=LDAP_SUCCESS)
+				result=LDAP_SUCCESS;
+			ldap_unbind_ext(ds, NULL, NULL);
+			ds=NULL;
+			if(!watch_transient(result)) break;
+		} else {
+			ldap_msgfree(res);
+		}
+	}
+
+	if(ds!=NULL) ldap_unbind_ext(ds, NULL, NULL);
+	free(search.base);
+	free(watch_attrs);
+
+	if(search.stop) {
+		ad_error_code=AD_SUCCESS;
+	} else if(result!=LDAP_SUCCESS) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_watch: %s", ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	}
+	return ad_error_code;
+}
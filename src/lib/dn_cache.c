@@ -0,0 +1,878 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* dn_cache.c
+ * persistent name to dn cache used by ad_resolve()
+ *
+ * The cache is a fixed size hash table in a file which is mapped
+ * straight into memory, so looking a name up costs no parsing and no
+ * round trip to the server.  Each name hashes to a bucket of
+ * CACHE_BUCKET_SLOTS slots; a new name takes a free slot in its bucket
+ * or else replaces the oldest.  flock() keeps concurrent adtool
+ * processes from tearing each other's updates.
+ *
+ * Writes have to drop the entries they could make stale without
+ * walking the whole table, so found entries are also chained by the
+ * hash of their dn, and names that weren't found only count while the
+ * table's generation, which every write that could create a name
+ * bumps, is the one they were stored in.  The header lists the
+ * attributes names are keyed by, so writes to other attributes
+ * needn't touch the cache at all. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ad_private.h"
+#include <ldap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#define CACHE_MAGIC "ADTDNC3"
+#define CACHE_SLOTS 4096
+#define CACHE_BUCKET_SLOTS 8
+#define CACHE_KEY_LENGTH 512
+#define CACHE_DN_LENGTH 512
+#define CACHE_GUID_LENGTH 16
+#define CACHE_ATTRIBUTES 16
+#define CACHE_ATTRIBUTE_LENGTH 64
+
+/* objectSid terms in each search for sids not in the cache */
+#define AD_SID_BATCH 200
+/* and name terms in each search for names not in the cache */
+#define AD_NAME_BATCH 200
+
+#define CACHE_EMPTY 0
+#define CACHE_FOUND 1
+#define CACHE_NOT_FOUND 2
+
+struct cache_header {
+	char magic[8];
+	int slots;
+	int slot_size;
+	unsigned int generation;
+	int attributes_full;
+	char attributes[CACHE_ATTRIBUTES][CACHE_ATTRIBUTE_LENGTH];
+	int dn_heads[CACHE_SLOTS];
+};
+
+struct cache_slot {
+	unsigned int hash;
+	int state;
+	unsigned int generation;
+	unsigned int dn_hash;
+	int dn_next;
+	time_t stored;
+	int guid_length;
+	unsigned char guid[CACHE_GUID_LENGTH];
+	char key[CACHE_KEY_LENGTH];
+	char dn[CACHE_DN_LENGTH];
+};
+
+int cache_fd=-1;
+int cache_opened=0;
+struct cache_header *cache=NULL;
+struct cache_slot *cache_slots;
+size_t cache_size;
+pthread_mutex_t cache_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/* map the cache file, creating or resetting it if it's missing or
+	has the wrong layout.  returns 0 if the cache can't be used */
+int cache_open() {
+	char *home, *filename;
+	int filename_length;
+	struct stat cache_stat;
+
+	if(cache_opened) return cache!=NULL;
+	cache_opened=1;
+
+	if(cache_ttl<=0) return 0;
+
+	if(cache_file!=NULL) {
+		filename=cache_file;
+	} else {
+		home=getenv("HOME");
+		if(home==NULL) return 0;
+		filename_length=strlen(home)+strlen("/.adtool.cache")+1;
+		filename=malloc(filename_length);
+		snprintf(filename, filename_length, "%s/.adtool.cache", home);
+	}
+
+	cache_fd=open(filename, O_RDWR|O_CREAT, 0600);
+	if(filename!=cache_file) free(filename);
+	if(cache_fd<0) return 0;
+
+	cache_size=sizeof(struct cache_header)
+			+sizeof(struct cache_slot)*CACHE_SLOTS;
+
+	flock(cache_fd, LOCK_EX);
+	if(fstat(cache_fd, &cache_stat)<0
+			|| (cache_stat.st_size!=cache_size
+			&& ftruncate(cache_fd, cache_size)<0)) {
+		flock(cache_fd, LOCK_UN);
+		close(cache_fd);
+		cache_fd=-1;
+		return 0;
+	}
+
+	cache=mmap(NULL, cache_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			cache_fd, 0);
+	if(cache==MAP_FAILED) {
+		cache=NULL;
+		flock(cache_fd, LOCK_UN);
+		close(cache_fd);
+		cache_fd=-1;
+		return 0;
+	}
+	cache_slots=(struct cache_slot *)(cache+1);
+
+	if(strcmp(cache->magic, CACHE_MAGIC)
+			|| cache->slots!=CACHE_SLOTS
+			|| cache->slot_size!=sizeof(struct cache_slot)) {
+		memset(cache, 0, cache_size);
+		strcpy(cache->magic, CACHE_MAGIC);
+		cache->slots=CACHE_SLOTS;
+		cache->slot_size=sizeof(struct cache_slot);
+	}
+	flock(cache_fd, LOCK_UN);
+	return 1;
+}
+
+/* cache keys are attribute=value followed by the server uri and the
+	searchbase, since the same name can be another object in another
+	domain or outside the base.  lower cased since active directory
+	matches names case insensitively.  returns 0 if it's too long */
+int cache_key(char *key, char *attribute, char *value) {
+	int i;
+
+	if(snprintf(key, CACHE_KEY_LENGTH, "%s=%s\n%s\n%s", attribute, value,
+			uri?uri:"", search_base?search_base:"")
+			>=CACHE_KEY_LENGTH)
+		return 0;
+	for(i=0; key[i]!='\0'; i++) key[i]=tolower((unsigned char)key[i]);
+	return 1;
+}
+
+unsigned int cache_hash(char *key) {
+	unsigned int hash=5381;
+
+	while(*key) hash=hash*33+(unsigned char)*key++;
+	return hash;
+}
+
+/* dns compare case insensitively, so hash them lower cased */
+unsigned int cache_dn_hash(char *dn) {
+	unsigned int hash=5381;
+
+	while(*dn) hash=hash*33+tolower((unsigned char)*dn++);
+	return hash;
+}
+
+/* a slot counts unless it's empty or a name not found before the
+	last write that could have created it */
+int cache_live(struct cache_slot *slot) {
+	return slot->state==CACHE_FOUND || (slot->state==CACHE_NOT_FOUND
+		&& slot->generation==cache->generation);
+}
+
+/* find the slot holding key, or NULL */
+struct cache_slot *cache_find(char *key, unsigned int hash) {
+	struct cache_slot *slot;
+	int i, bucket;
+
+	bucket=(hash%(CACHE_SLOTS/CACHE_BUCKET_SLOTS))*CACHE_BUCKET_SLOTS;
+	for(i=0; i<CACHE_BUCKET_SLOTS; i++) {
+		slot=&cache_slots[bucket+i];
+		if(cache_live(slot) && slot->hash==hash
+				&& !strcmp(slot->key, key))
+			return slot;
+	}
+	return NULL;
+}
+
+/* add a found slot to the chain for its dn, or take it off */
+void cache_dn_link(struct cache_slot *slot) {
+	int *head;
+
+	head=&cache->dn_heads[slot->dn_hash%CACHE_SLOTS];
+	slot->dn_next=*head;
+	*head=slot-cache_slots+1;
+}
+
+void cache_dn_unlink(struct cache_slot *slot) {
+	int *link, index;
+
+	index=slot-cache_slots+1;
+	link=&cache->dn_heads[slot->dn_hash%CACHE_SLOTS];
+	while(*link!=0 && *link!=index) link=&cache_slots[*link-1].dn_next;
+	if(*link==index) *link=slot->dn_next;
+}
+
+/* note the attribute a key is by, the part before its = */
+void cache_register(char *key) {
+	int i, length;
+
+	length=strchr(key, '=')-key+1;
+	if(length>=CACHE_ATTRIBUTE_LENGTH) {
+		cache->attributes_full=1;
+		return;
+	}
+	for(i=0; i<CACHE_ATTRIBUTES && cache->attributes[i][0]!='\0'; i++) {
+		if(!strncmp(cache->attributes[i], key, length)
+				&& cache->attributes[i][length]=='\0')
+			return;
+	}
+	if(i==CACHE_ATTRIBUTES) {
+		cache->attributes_full=1;
+		return;
+	}
+	memcpy(cache->attributes[i], key, length);
+	cache->attributes[i][length]='\0';
+}
+
+/* whether any name is keyed by prefix, an attribute= */
+int cache_keyed(char *prefix) {
+	int i;
+
+	if(cache->attributes_full) return 1;
+	for(i=0; i<CACHE_ATTRIBUTES && cache->attributes[i][0]!='\0'; i++) {
+		if(!strcmp(cache->attributes[i], prefix)) return 1;
+	}
+	return 0;
+}
+
+/* store a lookup result, dn is NULL if the name wasn't found */
+void cache_store(char *key, char *dn, struct berval *guid) {
+	struct cache_slot *slot, *oldest;
+	unsigned int hash;
+	int i, bucket;
+
+	if(dn!=NULL && strlen(dn)>=CACHE_DN_LENGTH) return;
+
+	hash=cache_hash(key);
+	flock(cache_fd, LOCK_EX);
+	slot=cache_find(key, hash);
+	if(slot==NULL) {
+		bucket=(hash%(CACHE_SLOTS/CACHE_BUCKET_SLOTS))*CACHE_BUCKET_SLOTS;
+		oldest=&cache_slots[bucket];
+		for(i=0; i<CACHE_BUCKET_SLOTS; i++) {
+			slot=&cache_slots[bucket+i];
+			if(!cache_live(slot)) break;
+			if(slot->stored<oldest->stored) oldest=slot;
+		}
+		if(i==CACHE_BUCKET_SLOTS) slot=oldest;
+	}
+	if(slot->state==CACHE_FOUND) cache_dn_unlink(slot);
+	cache_register(key);
+
+	slot->hash=hash;
+	slot->stored=time(NULL);
+	strcpy(slot->key, key);
+	if(dn!=NULL) {
+		strcpy(slot->dn, dn);
+		slot->guid_length=0;
+		if(guid!=NULL && guid->bv_len<=CACHE_GUID_LENGTH) {
+			memcpy(slot->guid, guid->bv_val, guid->bv_len);
+			slot->guid_length=guid->bv_len;
+		}
+		slot->state=CACHE_FOUND;
+		slot->dn_hash=cache_dn_hash(dn);
+		cache_dn_link(slot);
+	} else {
+		slot->dn[0]='\0';
+		slot->guid_length=0;
+		slot->state=CACHE_NOT_FOUND;
+		slot->generation=cache->generation;
+	}
+	flock(cache_fd, LOCK_UN);
+}
+
+/* search results collected by ad_resolve() */
+struct resolve_result {
+	struct dnlist list;
+	struct berval *guid;
+};
+
+int resolve_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct resolve_result *result=data;
+	struct berval **values;
+
+	ad_dnlist_append(ds, entry, dn, &result->list);
+	if(result->list.count==1) {
+		values=ldap_get_values_len(ds, entry, "objectGUID");
+		if(values!=NULL) {
+			result->guid=ber_bvdup(values[0]);
+			ldap_value_free_len(values);
+		}
+	}
+	return 0;
+}
+
+/* check that the cached dn still holds the name, by searching for it
+	with base scope and comparing its objectGUID.  cheaper than the
+	subtree search needed to find it again */
+int cache_validate(LDAP *ds, char *attribute, char *value,
+		struct cache_slot *slot) {
+	char *attrs[]={"objectGUID", NULL};
+	char *filter, *escaped;
+	int filter_length, valid;
+	struct resolve_result result={{NULL, 0, 0}, NULL};
+
+	escaped=ad_escape_filter(value);
+	filter_length=strlen(attribute)+strlen(escaped)+4;
+	filter=malloc(filter_length);
+	snprintf(filter, filter_length, "(%s=%s)", attribute, escaped);
+	free(escaped);
+	ad_stats_resolve(0);
+	ad_paged_search(ds, slot->dn, LDAP_SCOPE_BASE, filter, attrs, 0,
+			resolve_entry, &result);
+	free(filter);
+
+	valid=(result.list.count==1 && result.guid!=NULL
+		&& result.guid->bv_len==slot->guid_length
+		&& !memcmp(result.guid->bv_val, slot->guid, slot->guid_length));
+
+	if(result.guid!=NULL) ber_bvfree(result.guid);
+	while(result.list.count>0) free(result.list.dns[--result.list.count]);
+	if(result.list.dns!=NULL) free(result.list.dns);
+	return valid;
+}
+
+/* public functions */
+
+char **ad_resolve(char *attribute, char *value) {
+	LDAP *ds;
+	char key[CACHE_KEY_LENGTH];
+	char dn[CACHE_DN_LENGTH];
+	char *filter, *escaped;
+	int filter_length, result, usable, age, i;
+	char *attrs[]={"objectGUID", NULL};
+	struct cache_slot *slot, cached;
+	struct berval guid;
+	struct resolve_result found={{NULL, 0, 0}, NULL};
+	char **dnlist;
+
+	pthread_mutex_lock(&cache_lock);
+	if(ad_read_config()!=AD_SUCCESS) {
+		pthread_mutex_unlock(&cache_lock);
+		return (char **)-1;
+	}
+	usable=cache_open() && cache_key(key, attribute, value);
+
+	slot=NULL;
+	if(usable) {
+		flock(cache_fd, LOCK_SH);
+		slot=cache_find(key, cache_hash(key));
+		if(slot!=NULL) memcpy(&cached, slot, sizeof(cached));
+		flock(cache_fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	/* the lock isn't held while checking with the server, cached is
+		a copy of the slot */
+	if(slot!=NULL) {
+		age=time(NULL)-cached.stored;
+		if(cached.state==CACHE_NOT_FOUND && age<cache_ttl) {
+			ad_stats_resolve(1);
+			snprintf(ad_error_msg, MAX_ERR_LENGTH,
+				"%s not found", value);
+			ad_error_code=AD_OBJECT_NOT_FOUND;
+			return NULL;
+		}
+		if(cached.state==CACHE_FOUND) {
+			if(age>=cache_ttl) {
+				ds=ad_login();
+				if(ds && cache_validate(ds, attribute, value, &cached)) {
+					guid.bv_val=(char *)cached.guid;
+					guid.bv_len=cached.guid_length;
+					pthread_mutex_lock(&cache_lock);
+					cache_store(key, cached.dn, &guid);
+					pthread_mutex_unlock(&cache_lock);
+					age=0;
+				}
+			} else {
+				ad_stats_resolve(1);
+			}
+			if(age<cache_ttl) {
+				strcpy(dn, cached.dn);
+				dnlist=malloc(sizeof(char *)*2);
+				dnlist[0]=strdup(dn);
+				dnlist[1]=NULL;
+				ad_error_code=AD_SUCCESS;
+				return dnlist;
+			}
+		}
+	}
+
+	escaped=ad_escape_filter(value);
+	if(!usable) {
+		ad_stats_resolve(0);
+		dnlist=ad_search(attribute, escaped);
+		free(escaped);
+		return dnlist;
+	}
+
+	ds=ad_login();
+	if(!ds) {
+		free(escaped);
+		return (char **)-1;
+	}
+	if(!search_base) {
+		dnlist=ad_search(attribute, escaped);
+		free(escaped);
+		return dnlist;
+	}
+
+	filter_length=strlen(attribute)+strlen(escaped)+4;
+	filter=malloc(filter_length);
+	snprintf(filter, filter_length, "(%s=%s)", attribute, escaped);
+	free(escaped);
+	ad_stats_resolve(0);
+	result=ad_paged_search(ds, search_base, LDAP_SCOPE_SUBTREE, filter,
+			attrs, 0, resolve_entry, &found);
+	free(filter);
+	if(result!=LDAP_SUCCESS) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ldap_search_ext for ad_resolve: %s",
+			ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+		if(found.guid!=NULL) ber_bvfree(found.guid);
+		for(i=0; i<found.list.count; i++) free(found.list.dns[i]);
+		if(found.list.dns!=NULL) free(found.list.dns);
+		return (char **)-1;
+	}
+
+	/* only unambiguous names are cached */
+	pthread_mutex_lock(&cache_lock);
+	if(found.list.count==0) cache_store(key, NULL, NULL);
+	else if(found.list.count==1)
+		cache_store(key, found.list.dns[0], found.guid);
+	pthread_mutex_unlock(&cache_lock);
+	if(found.guid!=NULL) ber_bvfree(found.guid);
+
+	if(found.list.count==0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"%s not found", value);
+		ad_error_code=AD_OBJECT_NOT_FOUND;
+		return NULL;
+	}
+
+	ad_error_code=AD_SUCCESS;
+	return found.list.dns;
+}
+
+/* sids resolved by ad_resolve_sids(), each key's value points at its
+	place in the array of dns returned */
+struct sid_search {
+	struct ad_hash *wanted;
+	int usable;
+};
+
+int resolve_sid_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct sid_search *search=data;
+	struct berval **sids, **guids;
+	char sid[AD_SID_LENGTH];
+	char key[CACHE_KEY_LENGTH];
+	void **slot;
+	char **found;
+
+	sids=ldap_get_values_len(ds, entry, "objectSid");
+	if(sids==NULL) return 0;
+	if(ad_sid_string(sids[0], sid)
+			&& (slot=ad_hash_find(search->wanted, sid))!=NULL) {
+		found=*slot;
+		if(*found==NULL) *found=strdup(dn);
+		if(search->usable && cache_key(key, "objectSid", sid)) {
+			guids=ldap_get_values_len(ds, entry, "objectGUID");
+			pthread_mutex_lock(&cache_lock);
+			cache_store(key, dn, guids!=NULL?guids[0]:NULL);
+			pthread_mutex_unlock(&cache_lock);
+			if(guids!=NULL) ldap_value_free_len(guids);
+		}
+	}
+	ldap_value_free_len(sids);
+	return 0;
+}
+
+char **ad_resolve_sids(char **sids) {
+	LDAP *ds;
+	char key[CACHE_KEY_LENGTH];
+	char *attrs[]={"objectSid", "objectGUID", NULL};
+	char *filter;
+	int i, j, count, filter_length, added, result, failed=0;
+	struct cache_slot *slot;
+	void **wanted;
+	struct sid_search search;
+	char **dns;
+
+	for(count=0; sids[count]!=NULL; count++);
+	dns=calloc(count+1, sizeof(char *));
+
+	pthread_mutex_lock(&cache_lock);
+	if(ad_read_config()!=AD_SUCCESS) {
+		pthread_mutex_unlock(&cache_lock);
+		free(dns);
+		return NULL;
+	}
+	search.usable=cache_open();
+	if(search.usable) {
+		flock(cache_fd, LOCK_SH);
+		for(i=0; i<count; i++) {
+			if(!cache_key(key, "objectSid", sids[i])) continue;
+			slot=cache_find(key, cache_hash(key));
+			if(slot==NULL || time(NULL)-slot->stored>=cache_ttl)
+				continue;
+			if(slot->state==CACHE_FOUND)
+				dns[i]=strdup(slot->dn);
+			else if(slot->state==CACHE_NOT_FOUND)
+				dns[i]=strdup(sids[i]);
+			if(dns[i]!=NULL) ad_stats_resolve(1);
+		}
+		flock(cache_fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	/* look the rest up together, AD_SID_BATCH to a filter */
+	search.wanted=ad_hash_new(count);
+	for(i=0; i<count; i++) {
+		if(dns[i]!=NULL) continue;
+		wanted=ad_hash_insert(search.wanted, sids[i], &added);
+		if(added) *wanted=&dns[i];
+	}
+	if(ad_hash_count(search.wanted)>0) {
+		ds=ad_login();
+		if(!ds) {
+			failed=1;
+		} else if(!search_base) {
+			snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+			ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+			failed=1;
+		}
+		for(i=0; !failed && i<count; ) {
+			filter_length=4;
+			for(j=i; j<count && j-i<AD_SID_BATCH; j++)
+				filter_length+=strlen(sids[j])+13;
+			filter=malloc(filter_length);
+			strcpy(filter, "(|");
+			for(; i<j; i++) {
+				if(dns[i]!=NULL) continue;
+				strcat(filter, "(objectSid=");
+				strcat(filter, sids[i]);
+				strcat(filter, ")");
+			}
+			strcat(filter, ")");
+			result=LDAP_SUCCESS;
+			if(strcmp(filter, "(|)")) {
+				ad_stats_resolve(0);
+				result=ad_paged_search(ds, search_base,
+					LDAP_SCOPE_SUBTREE, filter, attrs, 0,
+					resolve_sid_entry, &search);
+			}
+			free(filter);
+			if(result!=LDAP_SUCCESS) {
+				snprintf(ad_error_msg, MAX_ERR_LENGTH,
+					"Error in ldap_search_ext for ad_resolve_sids: %s",
+					ldap_err2string(result));
+				ad_error_code=AD_LDAP_OPERATION_FAILURE;
+				failed=1;
+			}
+		}
+	}
+	ad_hash_free(search.wanted, NULL);
+
+	if(failed) {
+		for(i=0; i<count; i++) if(dns[i]!=NULL) free(dns[i]);
+		free(dns);
+		return NULL;
+	}
+
+	/* sids from outside the searchbase are given as they are */
+	pthread_mutex_lock(&cache_lock);
+	for(i=0; i<count; i++) {
+		if(dns[i]!=NULL) continue;
+		if(search.usable && cache_key(key, "objectSid", sids[i]))
+			cache_store(key, NULL, NULL);
+		dns[i]=strdup(sids[i]);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	ad_error_code=AD_SUCCESS;
+	return dns;
+}
+
+/* a name wanted by ad_resolve_names(), keyed by its lower cased value */
+struct name_wanted {
+	int index;
+	int matches;
+	struct berval *guid;
+};
+
+struct name_search {
+	char *attribute;
+	struct ad_hash *wanted;
+	char **dns;
+};
+
+void name_wanted_free(void *value) {
+	struct name_wanted *wanted=value;
+
+	if(wanted->guid!=NULL) ber_bvfree(wanted->guid);
+	free(wanted);
+}
+
+/* the lower cased copy of value used to match names */
+char *name_fold(char *value) {
+	char *folded;
+	int i;
+
+	folded=strdup(value);
+	for(i=0; folded[i]!='\0'; i++)
+		folded[i]=tolower((unsigned char)folded[i]);
+	return folded;
+}
+
+int resolve_name_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct name_search *search=data;
+	struct name_wanted *wanted;
+	struct berval **values, **guids;
+	char *name, *folded;
+	void **slot;
+	int i;
+
+	values=ldap_get_values_len(ds, entry, search->attribute);
+	if(values==NULL) return 0;
+	for(i=0; values[i]!=NULL; i++) {
+		name=malloc(values[i]->bv_len+1);
+		memcpy(name, values[i]->bv_val, values[i]->bv_len);
+		name[values[i]->bv_len]='\0';
+		folded=name_fold(name);
+		slot=ad_hash_find(search->wanted, folded);
+		free(folded);
+		free(name);
+		if(slot==NULL) continue;
+		wanted=*slot;
+		/* like ad_resolve(), the first of several objects is given */
+		if(wanted->matches++==0) {
+			search->dns[wanted->index]=strdup(dn);
+			guids=ldap_get_values_len(ds, entry, "objectGUID");
+			if(guids!=NULL) {
+				wanted->guid=ber_bvdup(guids[0]);
+				ldap_value_free_len(guids);
+			}
+		}
+	}
+	ldap_value_free_len(values);
+	return 0;
+}
+
+char **ad_resolve_names(char *attribute, char **values) {
+	LDAP *ds;
+	char key[CACHE_KEY_LENGTH];
+	char *attrs[3];
+	char *filter, *folded, *escaped;
+	int i, j, count, filter_length, added, result, failed=0;
+	struct cache_slot *slot;
+	struct name_wanted *wanted;
+	struct name_search search;
+	int *cached, usable;
+	void **entry;
+
+	for(count=0; values[count]!=NULL; count++);
+	search.attribute=attribute;
+	search.dns=calloc(count+1, sizeof(char *));
+	cached=calloc(count+1, sizeof(int));
+
+	pthread_mutex_lock(&cache_lock);
+	if(ad_read_config()!=AD_SUCCESS) {
+		pthread_mutex_unlock(&cache_lock);
+		free(search.dns);
+		free(cached);
+		return NULL;
+	}
+	usable=cache_open();
+	if(usable) {
+		flock(cache_fd, LOCK_SH);
+		for(i=0; i<count; i++) {
+			if(!cache_key(key, attribute, values[i])) continue;
+			slot=cache_find(key, cache_hash(key));
+			if(slot==NULL || time(NULL)-slot->stored>=cache_ttl)
+				continue;
+			if(slot->state==CACHE_FOUND)
+				search.dns[i]=strdup(slot->dn);
+			cached[i]=(slot->state!=CACHE_EMPTY);
+			if(cached[i]) ad_stats_resolve(1);
+		}
+		flock(cache_fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	/* look the rest up together, AD_NAME_BATCH to a filter.  a name
+		given twice is searched for once */
+	search.wanted=ad_hash_new(count);
+	for(i=0; i<count; i++) {
+		if(cached[i]) continue;
+		folded=name_fold(values[i]);
+		entry=ad_hash_insert(search.wanted, folded, &added);
+		free(folded);
+		if(!added) {
+			cached[i]=-1;
+			continue;
+		}
+		wanted=malloc(sizeof(struct name_wanted));
+		wanted->index=i;
+		wanted->matches=0;
+		wanted->guid=NULL;
+		*entry=wanted;
+	}
+	if(ad_hash_count(search.wanted)>0) {
+		ds=ad_login();
+		if(!ds) {
+			failed=1;
+		} else if(!search_base) {
+			snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+			ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+			failed=1;
+		}
+		attrs[0]=attribute;
+		attrs[1]="objectGUID";
+		attrs[2]=NULL;
+		for(i=0; !failed && i<count; ) {
+			filter_length=4;
+			for(j=i; j<count && j-i<AD_NAME_BATCH; j++)
+				filter_length+=strlen(attribute)+strlen(values[j])*3+3;
+			filter=malloc(filter_length);
+			strcpy(filter, "(|");
+			for(; i<j; i++) {
+				if(cached[i]) continue;
+				escaped=ad_escape_filter(values[i]);
+				strcat(filter, "(");
+				strcat(filter, attribute);
+				strcat(filter, "=");
+				strcat(filter, escaped);
+				strcat(filter, ")");
+				free(escaped);
+			}
+			strcat(filter, ")");
+			result=LDAP_SUCCESS;
+			if(strcmp(filter, "(|)")) {
+				ad_stats_resolve(0);
+				result=ad_paged_search(ds, search_base,
+					LDAP_SCOPE_SUBTREE, filter, attrs, 0,
+					resolve_name_entry, &search);
+			}
+			free(filter);
+			if(result!=LDAP_SUCCESS) {
+				snprintf(ad_error_msg, MAX_ERR_LENGTH,
+					"Error in ldap_search_ext for ad_resolve_names: %s",
+					ldap_err2string(result));
+				ad_error_code=AD_LDAP_OPERATION_FAILURE;
+				failed=1;
+			}
+		}
+	}
+
+	/* only unambiguous names are cached, and repeated names take
+		the dn found for their first appearance */
+	if(!failed) {
+		pthread_mutex_lock(&cache_lock);
+		for(i=0; i<count; i++) {
+			if(cached[i]>0) continue;
+			folded=name_fold(values[i]);
+			wanted=*ad_hash_find(search.wanted, folded);
+			free(folded);
+			if(cached[i]<0) {
+				if(search.dns[wanted->index]!=NULL)
+					search.dns[i]=strdup(search.dns[wanted->index]);
+				continue;
+			}
+			if(!usable || wanted->matches>1
+					|| !cache_key(key, attribute, values[i]))
+				continue;
+			cache_store(key, search.dns[i], wanted->guid);
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+	ad_hash_free(search.wanted, name_wanted_free);
+	free(cached);
+
+	if(failed) {
+		for(i=0; i<count; i++) if(search.dns[i]!=NULL) free(search.dns[i]);
+		free(search.dns);
+		return NULL;
+	}
+	ad_error_code=AD_SUCCESS;
+	return search.dns;
+}
+
+void ad_cache_forget(char *dn, char *attribute) {
+	char prefix[CACHE_KEY_LENGTH];
+	int i, prefix_length=0, keyed, *link;
+	unsigned int dn_hash;
+	struct cache_slot *slot;
+
+	pthread_mutex_lock(&cache_lock);
+	if(ad_read_config()!=AD_SUCCESS || !cache_open()) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	/* a change shows in every searchbase, so match the attribute
+		alone.  most writes are to attributes no name is keyed by,
+		which can't make anything in the cache stale */
+	if(attribute!=NULL) {
+		prefix_length=snprintf(prefix, CACHE_KEY_LENGTH, "%s=", attribute);
+		if(prefix_length>=CACHE_KEY_LENGTH) {
+			pthread_mutex_unlock(&cache_lock);
+			return;
+		}
+		for(i=0; i<prefix_length; i++)
+			prefix[i]=tolower((unsigned char)prefix[i]);
+		flock(cache_fd, LOCK_SH);
+		keyed=cache_keyed(prefix);
+		flock(cache_fd, LOCK_UN);
+		if(!keyed) {
+			pthread_mutex_unlock(&cache_lock);
+			return;
+		}
+	}
+
+	/* names not found may exist now, and entries for the dn are
+		found through its chain */
+	dn_hash=cache_dn_hash(dn);
+	flock(cache_fd, LOCK_EX);
+	cache->generation++;
+	link=&cache->dn_heads[dn_hash%CACHE_SLOTS];
+	while(*link!=0) {
+		slot=&cache_slots[*link-1];
+		if(slot->dn_hash==dn_hash && !strcasecmp(slot->dn, dn)
+				&& (attribute==NULL
+				|| !strncmp(slot->key, prefix, prefix_length))) {
+			*link=slot->dn_next;
+			slot->state=CACHE_EMPTY;
+		} else {
+			link=&slot->dn_next;
+		}
+	}
+	flock(cache_fd, LOCK_UN);
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* hash.c
+ * string keyed hash table used for set operations on dns
+ *
+ * Open addressing with linear probing, doubling when more than two
+ * thirds full.  Each key holds a pointer sized value for the caller. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ad_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+struct ad_hash_entry {
+	char *key;
+	unsigned int hash;
+	void *value;
+};
+
+struct ad_hash {
+	struct ad_hash_entry *entries;
+	int size;
+	int count;
+};
+
+unsigned int ad_hash_string(char *key) {
+	unsigned int hash=2166136261u;
+
+	for(; *key; key++) {
+		hash^=(unsigned char)*key;
+		hash*=16777619u;
+	}
+	return hash;
+}
+
+struct ad_hash *ad_hash_new(int size) {
+	struct ad_hash *h;
+	int i;
+
+	/* start with room for size keys without growing */
+	for(i=16; i<size+size/2; i*=2);
+	h=malloc(sizeof(struct ad_hash));
+	h->entries=calloc(i, sizeof(struct ad_hash_entry));
+	h->size=i;
+	h->count=0;
+	return h;
+}
+
+struct ad_hash_entry *ad_hash_slot(struct ad_hash *h, char *key, unsigned int hash) {
+	struct ad_hash_entry *entry;
+	int i;
+
+	for(i=hash&(h->size-1); ; i=(i+1)&(h->size-1)) {
+		entry=&h->entries[i];
+		if(entry->key==NULL) return entry;
+		if(entry->hash==hash && !strcmp(entry->key, key)) return entry;
+	}
+}
+
+void ad_hash_grow(struct ad_hash *h) {
+	struct ad_hash_entry *old;
+	int i, old_size;
+
+	old=h->entries;
+	old_size=h->size;
+	h->size*=2;
+	h->entries=calloc(h->size, sizeof(struct ad_hash_entry));
+	for(i=0; i<old_size; i++) {
+		if(old[i].key!=NULL)
+			*ad_hash_slot(h, old[i].key, old[i].hash)=old[i];
+	}
+	free(old);
+}
+
+void **ad_hash_insert(struct ad_hash *h, char *key, int *added) {
+	struct ad_hash_entry *entry;
+	unsigned int hash;
+
+	if((h->count+1)*3>h->size*2) ad_hash_grow(h);
+
+	hash=ad_hash_string(key);
+	entry=ad_hash_slot(h, key, hash);
+	if(added!=NULL) *added=(entry->key==NULL);
+	if(entry->key==NULL) {
+		entry->key=strdup(key);
+		entry->hash=hash;
+		entry->value=NULL;
+		h->count++;
+	}
+	return &entry->value;
+}
+
+void **ad_hash_find(struct ad_hash *h, char *key) {
+	struct ad_hash_entry *entry;
+
+	entry=ad_hash_slot(h, key, ad_hash_string(key));
+	if(entry->key==NULL) return NULL;
+	return &entry->value;
+}
+
+/* with linear probing a key can't simply be cleared, as that would
+	cut off the keys probed past it.  each later key in the run is
+	moved back into the gap unless its home slot lies after the gap */
+void *ad_hash_remove(struct ad_hash *h, char *key) {
+	struct ad_hash_entry *entry;
+	void *value;
+	int gap, i, home;
+
+	entry=ad_hash_slot(h, key, ad_hash_string(key));
+	if(entry->key==NULL) return NULL;
+	value=entry->value;
+	free(entry->key);
+	h->count--;
+
+	gap=entry-h->entries;
+	for(i=(gap+1)&(h->size-1); h->entries[i].key!=NULL; i=(i+1)&(h->size-1)) {
+		home=h->entries[i].hash&(h->size-1);
+		if(((i-home)&(h->size-1))>=((i-gap)&(h->size-1))) {
+			h->entries[gap]=h->entries[i];
+			gap=i;
+		}
+	}
+	h->entries[gap].key=NULL;
+	return value;
+}
+
+int ad_hash_count(struct ad_hash *h) {
+	return h->count;
+}
+
+void ad_hash_each(struct ad_hash *h, void (*callback)(char *key, void *value, void *data), void *data) {
+	int i;
+
+	for(i=0; i<h->size; i++) {
+		if(h->entries[i].key!=NULL)
+			callback(h->entries[i].key, h->entries[i].value, data);
+	}
+}
+
+void ad_hash_free(struct ad_hash *h, void (*free_value)(void *)) {
+	int i;
+
+	for(i=0; i<h->size; i++) {
+		if(h->entries[i].key==NULL) continue;
+		free(h->entries[i].key);
+		if(free_value!=NULL && h->entries[i].value!=NULL)
+			free_value(h->entries[i].value);
+	}
+	free(h->entries);
+	free(h);
+}
+
+/* a copy of dn in the form used as a hash key: lower case, without the
+	spaces allowed around the separators */
+char *ad_normalize_dn(char *dn) {
+	char *normal, *out;
+	char *start;
+
+	normal=malloc(strlen(dn)+1);
+	out=normal;
+	while(*dn==' ') dn++;
+	start=out;
+	for(; *dn; dn++) {
+		if(*dn=='\\' && dn[1]!='\0') {
+			*out++=*dn++;
+			*out++=tolower((unsigned char)*dn);
+			start=out;
+			continue;
+		}
+		if(*dn==',' || *dn=='=' || *dn=='+') {
+			/* drop spaces before the separator, then after it */
+			while(out>start && out[-1]==' ') out--;
+			*out++=*dn;
+			while(dn[1]==' ') dn++;
+			start=out;
+			continue;
+		}
+		*out++=tolower((unsigned char)*dn);
+	}
+	while(out>start && out[-1]==' ') out--;
+	*out='\0';
+	return normal;
+}
@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* histogram.c
+ * latency histograms for ad_set_observer(), see ad_histogram_new()
+ *
+ * Durations are counted in microseconds.  Those under
+ * HISTOGRAM_SUB_BUCKETS each have a bucket of their own; above that
+ * each power of two is split into HISTOGRAM_SUB_BUCKETS equal buckets,
+ * so a bucket is never wider than 1/HISTOGRAM_SUB_BUCKETS of the
+ * values in it.  Longer durations than the last bucket are counted in
+ * it. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "active_directory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1<<HISTOGRAM_SUB_BITS)
+/* up to 2^32 microseconds, over an hour */
+#define HISTOGRAM_MAX_SHIFT (32-HISTOGRAM_SUB_BITS-1)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT+2)*HISTOGRAM_SUB_BUCKETS)
+
+struct histogram_kind {
+	long long count;
+	long long failed;
+	double total;
+	double max;
+	long long buckets[HISTOGRAM_BUCKETS];
+};
+
+struct ad_histogram {
+	pthread_mutex_t lock;
+	struct histogram_kind kinds[AD_OP_KINDS];
+};
+
+int histogram_bucket(long long microseconds) {
+	int shift=0;
+
+	if(microseconds<HISTOGRAM_SUB_BUCKETS) return microseconds;
+	while((microseconds>>shift)>=2*HISTOGRAM_SUB_BUCKETS) shift++;
+	if(shift>HISTOGRAM_MAX_SHIFT) return HISTOGRAM_BUCKETS-1;
+	return (shift+1)*HISTOGRAM_SUB_BUCKETS
+		+(microseconds>>shift)-HISTOGRAM_SUB_BUCKETS;
+}
+
+/* the largest duration counted in bucket, in microseconds */
+long long histogram_bucket_top(int bucket) {
+	int shift;
+
+	if(bucket<HISTOGRAM_SUB_BUCKETS) return bucket;
+	shift=bucket/HISTOGRAM_SUB_BUCKETS-1;
+	return (((long long)(bucket%HISTOGRAM_SUB_BUCKETS
+		+HISTOGRAM_SUB_BUCKETS+1))<<shift)-1;
+}
+
+/* called with the lock held */
+double histogram_percentile(struct histogram_kind *kind, double percentile) {
+	long long rank, seen=0;
+	double top;
+	int i;
+
+	if(kind->count==0) return 0;
+	rank=(long long)(percentile/100*kind->count+0.5);
+	if(rank<1) rank=1;
+	if(rank>kind->count) rank=kind->count;
+	for(i=0; i<HISTOGRAM_BUCKETS; i++) {
+		seen+=kind->buckets[i];
+		if(seen>=rank) break;
+	}
+	/* report the bucket's highest value, but no more than was seen */
+	top=histogram_bucket_top(i)/1e6;
+	return (top>kind->max)?kind->max:top;
+}
+
+/* public functions */
+
+ad_histogram *ad_histogram_new() {
+	ad_histogram *h;
+
+	h=calloc(1, sizeof(ad_histogram));
+	pthread_mutex_init(&h->lock, NULL);
+	return h;
+}
+
+void ad_histogram_observer(int event, int kind, char *dn, int result,
+		double seconds, long long bytes, void *data) {
+	ad_histogram *h=data;
+	struct histogram_kind *k;
+
+	if(event!=AD_OBSERVE_END || kind<0 || kind>=AD_OP_KINDS) return;
+
+	pthread_mutex_lock(&h->lock);
+	k=&h->kinds[kind];
+	k->count++;
+	if(result!=LDAP_SUCCESS) k->failed++;
+	k->total+=seconds;
+	if(seconds>k->max) k->max=seconds;
+	k->buckets[histogram_bucket((long long)(seconds*1e6))]++;
+	pthread_mutex_unlock(&h->lock);
+}
+
+double ad_histogram_percentile(ad_histogram *h, int kind, double percentile) {
+	double value;
+
+	if(kind<0 || kind>=AD_OP_KINDS) return 0;
+	pthread_mutex_lock(&h->lock);
+	value=histogram_percentile(&h->kinds[kind], percentile);
+	pthread_mutex_unlock(&h->lock);
+	return value;
+}
+
+void ad_histogram_dump(ad_histogram *h, FILE *out) {
+	struct histogram_kind *k;
+	int i;
+
+	pthread_mutex_lock(&h->lock);
+	for(i=0; i<AD_OP_KINDS; i++) {
+		k=&h->kinds[i];
+		if(k->count==0) continue;
+		fprintf(out, "%s: %lld operations, %lld failed, mean %.3fms, "
+			"p50 %.3fms, p90 %.3fms, p99 %.3fms, p99.9 %.3fms, "
+			"max %.3fms\n",
+			ad_op_name(i), k->count, k->failed,
+			k->total/k->count*1e3,
+			histogram_percentile(k, 50)*1e3,
+			histogram_percentile(k, 90)*1e3,
+			histogram_percentile(k, 99)*1e3,
+			histogram_percentile(k, 99.9)*1e3,
+			k->max*1e3);
+	}
+	pthread_mutex_unlock(&h->lock);
+	fflush(out);
+}
+
+void ad_histogram_reset(ad_histogram *h) {
+	pthread_mutex_lock(&h->lock);
+	memset(h->kinds, 0, sizeof(h->kinds));
+	pthread_mutex_unlock(&h->lock);
+}
+
+void ad_histogram_free(ad_histogram *h) {
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
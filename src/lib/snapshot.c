@@ -0,0 +1,884 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* snapshot.c
+ * read only copies of a subtree kept in a file and queried offline
+ *
+ * A snapshot is laid out to be used straight from the mapped file:
+ * opening one is an mmap and a check of the header, with nothing to
+ * parse.  The file holds, in order, the header, each entry's dn,
+ * values and table of values as the search returned them, then the
+ * entry table sorted by parent so the children of an entry are
+ * consecutive, the attribute names each value refers to by number,
+ * open addressing hash indexes of the entries by dn, sAMAccountName
+ * and objectGUID, and optionally the values of one attribute sorted.
+ * Offsets are 32 bits, so a snapshot is limited to 4GB.
+ *
+ * Strings are stored NUL terminated and every table starts on a four
+ * byte boundary.  A snapshot is written to a temporary file which is
+ * renamed over the old one once complete, so readers never see half a
+ * snapshot. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ad_private.h"
+#include <ldap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define SNAPSHOT_MAGIC "ADTSNP1"
+#define SNAPSHOT_NONE 0xffffffffu
+#define SNAPSHOT_MAX_SIZE 0xffffffffull
+
+struct snapshot_header {
+	char magic[8];
+	unsigned int size;
+	unsigned int entry_count;
+	unsigned int entries;
+	unsigned int name_count;
+	unsigned int names;
+	unsigned int base;
+	unsigned int dn_index;
+	unsigned int account_index;
+	unsigned int guid_index;
+	unsigned int index_slots;
+	unsigned int sorted_attribute;
+	unsigned int sorted;
+	unsigned int sorted_count;
+	long long built;
+};
+
+struct snapshot_entry {
+	unsigned int dn;
+	unsigned int parent;
+	unsigned int first_child;
+	unsigned int children;
+	unsigned int values;
+	unsigned int value_count;
+};
+
+struct snapshot_value {
+	unsigned int attribute;
+	unsigned int offset;
+	unsigned int length;
+};
+
+/* entry is the entry number plus one, 0 for an empty slot */
+struct snapshot_slot {
+	unsigned int hash;
+	unsigned int entry;
+};
+
+struct snapshot_sorted {
+	unsigned int entry;
+	unsigned int offset;
+	unsigned int length;
+};
+
+struct ad_snapshot {
+	char *map;
+	size_t size;
+	struct snapshot_header *header;
+	struct snapshot_entry *entries;
+	unsigned int *names;
+};
+
+/* state while a snapshot is written */
+struct snapshot_build {
+	FILE *file;
+	unsigned long long offset;
+	struct ad_hash *names;
+	char **name_list;
+	int name_count, name_size;
+	struct snapshot_entry *entries;
+	char **dns;
+	int count, size;
+	/* the entry being read */
+	struct snapshot_value *values;
+	int value_count, value_size;
+	char *data;
+	int data_length, data_size;
+	unsigned int attribute;
+	int failed;
+};
+
+/* an entry while the entry table is ordered */
+struct snapshot_order {
+	char *parent;
+	char *dn;
+	int entry;
+};
+
+/* a sorted index value while the index is ordered */
+struct snapshot_sort_value {
+	char *value;
+	struct snapshot_sorted sorted;
+};
+
+unsigned int snapshot_hash(char *data, int length, int fold) {
+	unsigned int hash=2166136261u;
+	int i;
+
+	for(i=0; i<length; i++) {
+		hash^=fold ? tolower((unsigned char)data[i]) : (unsigned char)data[i];
+		hash*=16777619u;
+	}
+	return hash;
+}
+
+/* case insensitive ordering of two values, shorter first on a tie */
+int snapshot_compare(char *a, int a_length, char *b, int b_length) {
+	int i, difference;
+
+	for(i=0; i<a_length && i<b_length; i++) {
+		difference=tolower((unsigned char)a[i])-tolower((unsigned char)b[i]);
+		if(difference) return difference;
+	}
+	return a_length-b_length;
+}
+
+/* the parent part of a normalized dn, "" for a top level dn */
+char *snapshot_parent(char *dn) {
+	for(; *dn; dn++) {
+		if(*dn=='\\' && dn[1]!='\0') dn++;
+		else if(*dn==',') return dn+1;
+	}
+	return dn;
+}
+
+/* whether value matches pattern, where * matches any run of
+	characters, ignoring case */
+int snapshot_match(char *pattern, char *value, int length) {
+	char *star=NULL;
+	int i=0, retry=0;
+
+	while(i<length) {
+		if(*pattern=='*') {
+			star=++pattern;
+			retry=i;
+			continue;
+		}
+		if(*pattern!='\0'
+				&& tolower((unsigned char)*pattern)==tolower((unsigned char)value[i])) {
+			pattern++;
+			i++;
+			continue;
+		}
+		if(star==NULL) return 0;
+		pattern=star;
+		i=++retry;
+	}
+	while(*pattern=='*') pattern++;
+	return *pattern=='\0';
+}
+
+/* write to the snapshot, padding to a four byte boundary */
+void snapshot_write(struct snapshot_build *build, void *data, int length) {
+	static char padding[4];
+	int pad=(4-length%4)%4;
+
+	if(length>0 && fwrite(data, length, 1, build->file)!=1) build->failed=1;
+	if(pad && fwrite(padding, pad, 1, build->file)!=1) build->failed=1;
+	build->offset+=length+pad;
+	if(build->offset>SNAPSHOT_MAX_SIZE) build->failed=1;
+}
+
+/* the number of an attribute name, adding it if it is new.  names
+	differing only in case are the same attribute */
+unsigned int snapshot_name(struct snapshot_build *build, char *name) {
+	void **slot;
+	char *key;
+	int i, added;
+
+	key=strdup(name);
+	for(i=0; key[i]; i++) key[i]=tolower((unsigned char)key[i]);
+	slot=ad_hash_insert(build->names, key, &added);
+	free(key);
+	if(added) {
+		if(build->name_count==build->name_size) {
+			build->name_size=build->name_size ? build->name_size*2 : 64;
+			build->name_list=realloc(build->name_list,
+				sizeof(char *)*build->name_size);
+		}
+		build->name_list[build->name_count]=strdup(name);
+		*slot=(void *)(long)++build->name_count;
+	}
+	return (unsigned int)(long)*slot-1;
+}
+
+int snapshot_value(struct berval *value, void *data) {
+	struct snapshot_build *build=data;
+	struct snapshot_value *v;
+	int padded;
+
+	if(build->value_count==build->value_size) {
+		build->value_size=build->value_size ? build->value_size*2 : 64;
+		build->values=realloc(build->values,
+			sizeof(struct snapshot_value)*build->value_size);
+	}
+	padded=(value->bv_len+4)&~3;
+	while(build->data_length+padded>build->data_size) {
+		build->data_size=build->data_size ? build->data_size*2 : 4096;
+		build->data=realloc(build->data, build->data_size);
+	}
+	v=&build->values[build->value_count++];
+	v->attribute=build->attribute;
+	v->offset=build->data_length;
+	v->length=value->bv_len;
+	memcpy(build->data+build->data_length, value->bv_val, value->bv_len);
+	memset(build->data+build->data_length+value->bv_len, 0,
+		padded-value->bv_len);
+	build->data_length+=padded;
+	return 0;
+}
+
+int snapshot_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	struct snapshot_build *build=data;
+	struct snapshot_entry *e;
+	BerElement *ber;
+	struct berval **values;
+	char *attribute, *option;
+	int i, next;
+
+	build->value_count=0;
+	build->data_length=0;
+	for(attribute=ldap_first_attribute(ds, entry, &ber);
+			attribute!=NULL;
+			attribute=ldap_next_attribute(ds, entry, ber)) {
+		next=ad_next_range(attribute);
+		values=ldap_get_values_len(ds, entry, attribute);
+		/* values of a ranged attribute are stored under its name */
+		option=strchr(attribute, ';');
+		if(option!=NULL && !strncasecmp(option, ";range=", 7)) *option='\0';
+		build->attribute=snapshot_name(build, attribute);
+		for(i=0; values!=NULL && values[i]!=NULL; i++)
+			snapshot_value(values[i], build);
+		if(values!=NULL) ldap_value_free_len(values);
+		if(next>0 && ad_get_range_values(dn, attribute, next, snapshot_value, build)!=AD_SUCCESS)
+			build->failed=1;
+		ldap_memfree(attribute);
+	}
+	if(ber!=NULL) ber_free(ber, 0);
+
+	if(build->count==build->size) {
+		build->size=build->size ? build->size*2 : 1024;
+		build->entries=realloc(build->entries,
+			sizeof(struct snapshot_entry)*build->size);
+		build->dns=realloc(build->dns, sizeof(char *)*build->size);
+	}
+	e=&build->entries[build->count];
+	build->dns[build->count++]=ad_normalize_dn(dn);
+
+	e->dn=build->offset;
+	snapshot_write(build, dn, strlen(dn)+1);
+	/* the data is already padded, so offsets within it carry over */
+	for(i=0; i<build->value_count; i++)
+		build->values[i].offset+=build->offset;
+	snapshot_write(build, build->data, build->data_length);
+	e->values=build->offset;
+	e->value_count=build->value_count;
+	snapshot_write(build, build->values,
+		sizeof(struct snapshot_value)*build->value_count);
+	return build->failed;
+}
+
+int snapshot_order_compare(const void *a, const void *b) {
+	const struct snapshot_order *x=a, *y=b;
+	int difference;
+
+	difference=strcmp(x->parent, y->parent);
+	if(difference) return difference;
+	return strcmp(x->dn, y->dn);
+}
+
+int snapshot_sort_compare(const void *a, const void *b) {
+	const struct snapshot_sort_value *x=a, *y=b;
+	int difference;
+
+	difference=snapshot_compare(x->value, x->sorted.length,
+		y->value, y->sorted.length);
+	if(difference) return difference;
+	return (int)x->sorted.entry-(int)y->sorted.entry;
+}
+
+void snapshot_index_add(struct snapshot_slot *slots, unsigned int size,
+		unsigned int hash, unsigned int entry) {
+	unsigned int i;
+
+	for(i=hash&(size-1); slots[i].entry; i=(i+1)&(size-1));
+	slots[i].hash=hash;
+	slots[i].entry=entry+1;
+}
+
+/* the first value of attribute in an entry of the mapped data */
+struct snapshot_value *snapshot_first_value(char *map, struct snapshot_entry *e,
+		unsigned int attribute) {
+	struct snapshot_value *values=(struct snapshot_value *)(map+e->values);
+	unsigned int i;
+
+	for(i=0; i<e->value_count; i++)
+		if(values[i].attribute==attribute) return &values[i];
+	return NULL;
+}
+
+/* order the entries and write the tables after the entries' data */
+int snapshot_index(struct snapshot_build *build, char *base, char *sorted_attribute,
+		struct snapshot_header *header) {
+	char *map;
+	struct snapshot_order *order;
+	struct snapshot_entry *entries;
+	struct snapshot_slot *slots;
+	struct snapshot_sort_value *sort_values=NULL;
+	struct snapshot_sorted *sorted;
+	struct snapshot_value *value, *values;
+	struct ad_hash *positions;
+	unsigned int *names, size, account, guid, attribute;
+	void **position;
+	size_t map_size;
+	int i, j, added, sort_count=0, sort_size=0;
+
+	fflush(build->file);
+	map_size=build->offset;
+	map=mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(build->file), 0);
+	if(map==MAP_FAILED) return 0;
+
+	order=malloc(sizeof(struct snapshot_order)*(build->count+1));
+	for(i=0; i<build->count; i++) {
+		order[i].dn=build->dns[i];
+		order[i].parent=snapshot_parent(build->dns[i]);
+		order[i].entry=i;
+	}
+	qsort(order, build->count, sizeof(struct snapshot_order), snapshot_order_compare);
+
+	positions=ad_hash_new(build->count);
+	for(i=0; i<build->count; i++)
+		*ad_hash_insert(positions, order[i].dn, &added)=(void *)(long)(i+1);
+
+	/* siblings are consecutive once sorted */
+	entries=malloc(sizeof(struct snapshot_entry)*(build->count+1));
+	for(i=0; i<build->count; i++) {
+		entries[i]=build->entries[order[i].entry];
+		entries[i].parent=SNAPSHOT_NONE;
+		entries[i].first_child=SNAPSHOT_NONE;
+		entries[i].children=0;
+	}
+	for(i=0; i<build->count; i++) {
+		position=ad_hash_find(positions, order[i].parent);
+		if(position==NULL) continue;
+		j=(int)(long)*position-1;
+		entries[i].parent=j;
+		if(entries[j].children++==0) entries[j].first_child=i;
+	}
+	ad_hash_free(positions, NULL);
+	header->entry_count=build->count;
+	header->entries=build->offset;
+	snapshot_write(build, entries, sizeof(struct snapshot_entry)*build->count);
+
+	/* the indexed attributes need numbers even if no entry has them */
+	account=snapshot_name(build, "sAMAccountName");
+	guid=snapshot_name(build, "objectGUID");
+	attribute=sorted_attribute!=NULL ? snapshot_name(build, sorted_attribute) : SNAPSHOT_NONE;
+
+	header->name_count=build->name_count;
+	names=malloc(sizeof(unsigned int)*(build->name_count+1));
+	for(i=0; i<build->name_count; i++) {
+		names[i]=build->offset;
+		snapshot_write(build, build->name_list[i], strlen(build->name_list[i])+1);
+	}
+	header->names=build->offset;
+	snapshot_write(build, names, sizeof(unsigned int)*build->name_count);
+	free(names);
+	header->base=build->offset;
+	snapshot_write(build, base, strlen(base)+1);
+
+	/* at most half full */
+	for(size=16; size<(unsigned int)build->count*2; size*=2);
+	header->index_slots=size;
+	slots=malloc(sizeof(struct snapshot_slot)*size);
+
+	memset(slots, 0, sizeof(struct snapshot_slot)*size);
+	for(i=0; i<build->count; i++)
+		snapshot_index_add(slots, size,
+			snapshot_hash(order[i].dn, strlen(order[i].dn), 0), i);
+	header->dn_index=build->offset;
+	snapshot_write(build, slots, sizeof(struct snapshot_slot)*size);
+
+	memset(slots, 0, sizeof(struct snapshot_slot)*size);
+	for(i=0; i<build->count; i++) {
+		value=snapshot_first_value(map, &entries[i], account);
+		if(value!=NULL)
+			snapshot_index_add(slots, size,
+				snapshot_hash(map+value->offset, value->length, 1), i);
+	}
+	header->account_index=build->offset;
+	snapshot_write(build, slots, sizeof(struct snapshot_slot)*size);
+
+	memset(slots, 0, sizeof(struct snapshot_slot)*size);
+	for(i=0; i<build->count; i++) {
+		value=snapshot_first_value(map, &entries[i], guid);
+		if(value!=NULL)
+			snapshot_index_add(slots, size,
+				snapshot_hash(map+value->offset, value->length, 0), i);
+	}
+	header->guid_index=build->offset;
+	snapshot_write(build, slots, sizeof(struct snapshot_slot)*size);
+	free(slots);
+
+	header->sorted_attribute=SNAPSHOT_NONE;
+	header->sorted=0;
+	header->sorted_count=0;
+	if(attribute!=SNAPSHOT_NONE) {
+		for(i=0; i<build->count; i++) {
+			values=(struct snapshot_value *)(map+entries[i].values);
+			for(j=0; j<entries[i].value_count; j++) {
+				if(values[j].attribute!=attribute) continue;
+				if(sort_count==sort_size) {
+					sort_size=sort_size ? sort_size*2 : 1024;
+					sort_values=realloc(sort_values,
+						sizeof(struct snapshot_sort_value)*sort_size);
+				}
+				sort_values[sort_count].value=map+values[j].offset;
+				sort_values[sort_count].sorted.entry=i;
+				sort_values[sort_count].sorted.offset=values[j].offset;
+				sort_values[sort_count].sorted.length=values[j].length;
+				sort_count++;
+			}
+		}
+		qsort(sort_values, sort_count, sizeof(struct snapshot_sort_value),
+			snapshot_sort_compare);
+		sorted=malloc(sizeof(struct snapshot_sorted)*(sort_count+1));
+		for(i=0; i<sort_count; i++) sorted[i]=sort_values[i].sorted;
+		header->sorted_attribute=attribute;
+		header->sorted=build->offset;
+		header->sorted_count=sort_count;
+		snapshot_write(build, sorted, sizeof(struct snapshot_sorted)*sort_count);
+		free(sorted);
+		free(sort_values);
+	}
+	munmap(map, map_size);
+	free(entries);
+	free(order);
+	return 1;
+}
+
+int ad_snapshot_build(char *filename, char *base, char *filter, char **attrs,
+		char *sorted_attribute) {
+	LDAP *ds;
+	struct snapshot_build build;
+	struct snapshot_header header;
+	char *all_attrs[]={"*", NULL};
+	char **build_attrs;
+	char *temp_file;
+	int i, count, result, temp_length, fd;
+
+	ds=ad_login();
+	if(!ds) return ad_error_code;
+
+	if(base==NULL) base=search_base;
+	if(!base) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH, "Error: couldn't read active directory searchbase parameter from config file %s, ~/.adtool.cfg or command line", config_file);
+		ad_error_code=AD_MISSING_CONFIG_PARAMETER;
+		return ad_error_code;
+	}
+	if(filter==NULL) filter="(objectclass=*)";
+	if(attrs==NULL) attrs=all_attrs;
+
+	/* the indexed attributes are always kept */
+	for(count=0; attrs[count]!=NULL; count++);
+	build_attrs=malloc(sizeof(char *)*(count+4));
+	memcpy(build_attrs, attrs, sizeof(char *)*count);
+	build_attrs[count++]="sAMAccountName";
+	build_attrs[count++]="objectGUID";
+	if(sorted_attribute!=NULL) build_attrs[count++]=sorted_attribute;
+	build_attrs[count]=NULL;
+
+	temp_length=strlen(filename)+32;
+	temp_file=malloc(temp_length);
+	snprintf(temp_file, temp_length, "%s.%d", filename, (int)getpid());
+	fd=open(temp_file, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if(fd<0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_build: couldn't create %s", temp_file);
+		ad_error_code=AD_INVALID_SNAPSHOT;
+		free(temp_file);
+		free(build_attrs);
+		return ad_error_code;
+	}
+
+	memset(&build, 0, sizeof(build));
+	build.file=fdopen(fd, "w+");
+	build.names=ad_hash_new(256);
+	memset(&header, 0, sizeof(header));
+	snapshot_write(&build, &header, sizeof(header));
+
+	result=ad_paged_search(ds, base, LDAP_SCOPE_SUBTREE, filter, build_attrs, 0,
+		snapshot_entry, &build);
+	if(result!=LDAP_SUCCESS) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ldap_search_ext for ad_snapshot_build: %s",
+			ldap_err2string(result));
+		ad_error_code=AD_LDAP_OPERATION_FAILURE;
+	} else if(build.failed || !snapshot_index(&build, base, sorted_attribute, &header)
+			|| build.failed) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_build: couldn't write %s%s", temp_file,
+			build.offset>SNAPSHOT_MAX_SIZE ? ", snapshots are limited to 4GB" : "");
+		ad_error_code=AD_INVALID_SNAPSHOT;
+	} else {
+		memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.size=build.offset;
+		header.built=time(NULL);
+		if(fseek(build.file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, build.file)!=1)
+			build.failed=1;
+		ad_error_code=AD_SUCCESS;
+	}
+	if(fclose(build.file) && ad_error_code==AD_SUCCESS) build.failed=1;
+	if(ad_error_code==AD_SUCCESS && build.failed) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_build: couldn't write %s", temp_file);
+		ad_error_code=AD_INVALID_SNAPSHOT;
+	}
+	if(ad_error_code==AD_SUCCESS) rename(temp_file, filename);
+	else unlink(temp_file);
+
+	for(i=0; i<build.count; i++) free(build.dns[i]);
+	for(i=0; i<build.name_count; i++) free(build.name_list[i]);
+	free(build.dns);
+	free(build.entries);
+	free(build.name_list);
+	free(build.values);
+	free(build.data);
+	ad_hash_free(build.names, NULL);
+	free(build_attrs);
+	free(temp_file);
+	return ad_error_code;
+}
+
+/* whether count items of width bytes from offset lie within the file,
+	after the header and on a four byte boundary */
+int snapshot_table_fits(struct snapshot_header *header, unsigned int offset,
+		unsigned int count, size_t width) {
+	return offset%4==0 && offset>=sizeof(struct snapshot_header)
+		&& offset<=header->size
+		&& (unsigned long long)count*width<=header->size-offset;
+}
+
+/* whether the tables the header points to are all within the file, so
+	that a damaged or truncated snapshot is refused rather than read out
+	of bounds */
+int snapshot_header_valid(char *map, struct snapshot_header *header) {
+	unsigned int slots=header->index_slots;
+	size_t index=sizeof(struct snapshot_slot);
+
+	if(!snapshot_table_fits(header, header->entries, header->entry_count,
+			sizeof(struct snapshot_entry))) return 0;
+	if(!snapshot_table_fits(header, header->names, header->name_count,
+			sizeof(unsigned int))) return 0;
+	if(header->base<sizeof(struct snapshot_header) || header->base>=header->size
+			|| memchr(map+header->base, '\0', header->size-header->base)==NULL)
+		return 0;
+	/* lookups wrap with index_slots-1 as a mask */
+	if(slots==0 || (slots&(slots-1))!=0) return 0;
+	if(!snapshot_table_fits(header, header->dn_index, slots, index)
+			|| !snapshot_table_fits(header, header->account_index, slots, index)
+			|| !snapshot_table_fits(header, header->guid_index, slots, index))
+		return 0;
+	if(header->sorted_attribute==SNAPSHOT_NONE) return 1;
+	return header->sorted_attribute<header->name_count
+		&& snapshot_table_fits(header, header->sorted, header->sorted_count,
+			sizeof(struct snapshot_sorted));
+}
+
+ad_snapshot *ad_snapshot_open(char *filename) {
+	ad_snapshot *s;
+	struct snapshot_header *header;
+	struct stat file_stat;
+	char *map;
+	int fd;
+
+	fd=open(filename, O_RDONLY);
+	if(fd<0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_open: couldn't open %s", filename);
+		ad_error_code=AD_INVALID_SNAPSHOT;
+		return NULL;
+	}
+	if(fstat(fd, &file_stat)<0 || file_stat.st_size<sizeof(struct snapshot_header)) {
+		close(fd);
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_open: %s isn't a snapshot", filename);
+		ad_error_code=AD_INVALID_SNAPSHOT;
+		return NULL;
+	}
+	map=mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map==MAP_FAILED) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_open: couldn't map %s", filename);
+		ad_error_code=AD_INVALID_SNAPSHOT;
+		return NULL;
+	}
+	header=(struct snapshot_header *)map;
+	if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))
+			|| header->size!=file_stat.st_size
+			|| !snapshot_header_valid(map, header)) {
+		munmap(map, file_stat.st_size);
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_open: %s isn't a snapshot", filename);
+		ad_error_code=AD_INVALID_SNAPSHOT;
+		return NULL;
+	}
+
+	s=malloc(sizeof(ad_snapshot));
+	s->map=map;
+	s->size=file_stat.st_size;
+	s->header=header;
+	s->entries=(struct snapshot_entry *)(map+header->entries);
+	s->names=(unsigned int *)(map+header->names);
+	ad_error_code=AD_SUCCESS;
+	return s;
+}
+
+void ad_snapshot_close(ad_snapshot *s) {
+	munmap(s->map, s->size);
+	free(s);
+}
+
+char *ad_snapshot_base(ad_snapshot *s) {
+	return s->map+s->header->base;
+}
+
+int ad_snapshot_count(ad_snapshot *s) {
+	return s->header->entry_count;
+}
+
+char *ad_snapshot_dn(ad_snapshot *s, int entry) {
+	return s->map+s->entries[entry].dn;
+}
+
+/* the number of an attribute name, SNAPSHOT_NONE if no entry has it */
+unsigned int snapshot_attribute(ad_snapshot *s, char *attribute) {
+	unsigned int i;
+
+	for(i=0; i<s->header->name_count; i++)
+		if(!strcasecmp(s->map+s->names[i], attribute)) return i;
+	return SNAPSHOT_NONE;
+}
+
+/* look value up in a hash index.  returns the entry or -1 */
+int snapshot_lookup(ad_snapshot *s, unsigned int index, unsigned int attribute,
+		char *value, int length, int fold) {
+	struct snapshot_slot *slots=(struct snapshot_slot *)(s->map+index);
+	struct snapshot_value *found;
+	unsigned int size=s->header->index_slots, hash, i;
+	char *normal, *dn;
+	int entry, same;
+
+	if(attribute==SNAPSHOT_NONE) {
+		normal=ad_normalize_dn(value);
+		value=normal;
+		length=strlen(normal);
+	} else normal=NULL;
+
+	hash=snapshot_hash(value, length, fold);
+	for(i=hash&(size-1); slots[i].entry; i=(i+1)&(size-1)) {
+		if(slots[i].hash!=hash) continue;
+		entry=slots[i].entry-1;
+		if(attribute==SNAPSHOT_NONE) {
+			dn=ad_normalize_dn(ad_snapshot_dn(s, entry));
+			same=!strcmp(dn, normal);
+			free(dn);
+			if(same) {
+				free(normal);
+				return entry;
+			}
+			continue;
+		}
+		found=snapshot_first_value(s->map, &s->entries[entry], attribute);
+		if(found!=NULL && found->length==length
+				&& (fold ? !strncasecmp(s->map+found->offset, value, length)
+				: !memcmp(s->map+found->offset, value, length)))
+			return entry;
+	}
+	free(normal);
+	return -1;
+}
+
+int ad_snapshot_find(ad_snapshot *s, char *attribute, char *value, int length) {
+	unsigned int id;
+	struct snapshot_value *values;
+	unsigned int i, j;
+
+	if(!strcasecmp(attribute, "dn") || !strcasecmp(attribute, "distinguishedName"))
+		return snapshot_lookup(s, s->header->dn_index, SNAPSHOT_NONE, value, length, 0);
+	id=snapshot_attribute(s, attribute);
+	if(id==SNAPSHOT_NONE) return -1;
+	if(!strcasecmp(attribute, "sAMAccountName"))
+		return snapshot_lookup(s, s->header->account_index, id, value, length, 1);
+	if(!strcasecmp(attribute, "objectGUID"))
+		return snapshot_lookup(s, s->header->guid_index, id, value, length, 0);
+
+	for(i=0; i<s->header->entry_count; i++) {
+		values=(struct snapshot_value *)(s->map+s->entries[i].values);
+		for(j=0; j<s->entries[i].value_count; j++)
+			if(values[j].attribute==id && values[j].length==length
+					&& !strncasecmp(s->map+values[j].offset, value, length))
+				return i;
+	}
+	return -1;
+}
+
+/* the first position in the sorted index not before value */
+unsigned int snapshot_lower_bound(ad_snapshot *s, char *value, int length) {
+	struct snapshot_sorted *sorted=(struct snapshot_sorted *)(s->map+s->header->sorted);
+	unsigned int low=0, high=s->header->sorted_count, middle;
+
+	while(low<high) {
+		middle=low+(high-low)/2;
+		if(snapshot_compare(s->map+sorted[middle].offset, sorted[middle].length,
+				value, length)<0)
+			low=middle+1;
+		else high=middle;
+	}
+	return low;
+}
+
+int ad_snapshot_search(ad_snapshot *s, char *attribute, char *value,
+		ad_snapshot_callback callback, void *data) {
+	struct snapshot_sorted *sorted;
+	struct snapshot_value *values;
+	unsigned int id, i, j;
+	unsigned char *seen;
+	char *star, *dn;
+	int entry, length, prefix;
+
+	star=strchr(value, '*');
+	if(star==NULL && (!strcasecmp(attribute, "dn")
+			|| !strcasecmp(attribute, "distinguishedName")
+			|| !strcasecmp(attribute, "sAMAccountName")
+			|| !strcasecmp(attribute, "objectGUID"))) {
+		entry=ad_snapshot_find(s, attribute, value, strlen(value));
+		if(entry>=0) callback(s, entry, data);
+		return AD_SUCCESS;
+	}
+
+	if(!strcasecmp(attribute, "dn") || !strcasecmp(attribute, "distinguishedName")) {
+		for(i=0; i<s->header->entry_count; i++) {
+			dn=ad_snapshot_dn(s, i);
+			if(snapshot_match(value, dn, strlen(dn)) && callback(s, i, data))
+				break;
+		}
+		return AD_SUCCESS;
+	}
+
+	id=snapshot_attribute(s, attribute);
+	if(id==SNAPSHOT_NONE) return AD_SUCCESS;
+
+	/* an exact value or a prefix can use the sorted index */
+	if(id==s->header->sorted_attribute && *value!='*'
+			&& (star==NULL || star[1]=='\0')) {
+		prefix=star!=NULL;
+		length=prefix ? star-value : strlen(value);
+		sorted=(struct snapshot_sorted *)(s->map+s->header->sorted);
+		/* an entry with several matching values is reported once */
+		seen=calloc(s->header->entry_count/8+1, 1);
+		for(i=snapshot_lower_bound(s, value, length); i<s->header->sorted_count; i++) {
+			if(sorted[i].length<length || (!prefix && sorted[i].length!=length)
+					|| strncasecmp(s->map+sorted[i].offset, value, length))
+				break;
+			entry=sorted[i].entry;
+			if(seen[entry/8]&(1<<(entry%8))) continue;
+			seen[entry/8]|=1<<(entry%8);
+			if(callback(s, entry, data)) break;
+		}
+		free(seen);
+		return AD_SUCCESS;
+	}
+
+	for(i=0; i<s->header->entry_count; i++) {
+		values=(struct snapshot_value *)(s->map+s->entries[i].values);
+		for(j=0; j<s->entries[i].value_count; j++) {
+			if(values[j].attribute==id
+					&& snapshot_match(value, s->map+values[j].offset, values[j].length))
+				break;
+		}
+		if(j<s->entries[i].value_count && callback(s, i, data)) break;
+	}
+	return AD_SUCCESS;
+}
+
+int ad_snapshot_children(ad_snapshot *s, char *dn, ad_snapshot_callback callback, void *data) {
+	struct snapshot_entry *e;
+	unsigned int i;
+	int entry;
+
+	entry=ad_snapshot_find(s, "dn", dn, strlen(dn));
+	if(entry<0) {
+		snprintf(ad_error_msg, MAX_ERR_LENGTH,
+			"Error in ad_snapshot_children: %s isn't in the snapshot", dn);
+		ad_error_code=AD_OBJECT_NOT_FOUND;
+		return ad_error_code;
+	}
+	e=&s->entries[entry];
+	for(i=0; i<e->children; i++)
+		if(callback(s, e->first_child+i, data)) break;
+	ad_error_code=AD_SUCCESS;
+	return ad_error_code;
+}
+
+int ad_snapshot_values(ad_snapshot *s, int entry, char *attribute,
+		ad_value_callback callback, void *data) {
+	struct snapshot_entry *e=&s->entries[entry];
+	struct snapshot_value *values;
+	struct berval value;
+	unsigned int id, i;
+	int found=0;
+
+	id=snapshot_attribute(s, attribute);
+	values=(struct snapshot_value *)(s->map+e->values);
+	for(i=0; id!=SNAPSHOT_NONE && i<e->value_count; i++) {
+		if(values[i].attribute!=id) continue;
+		found=1;
+		value.bv_len=values[i].length;
+		value.bv_val=s->map+values[i].offset;
+		if(callback(&value, data)) break;
+	}
+	return found ? AD_SUCCESS : AD_ATTRIBUTE_ENTRY_NOT_FOUND;
+}
+
+int ad_snapshot_attributes(ad_snapshot *s, int entry,
+		int (*callback)(char *attribute, struct berval *value, void *data), void *data) {
+	struct snapshot_entry *e=&s->entries[entry];
+	struct snapshot_value *values;
+	struct berval value;
+	unsigned int i;
+
+	values=(struct snapshot_value *)(s->map+e->values);
+	for(i=0; i<e->value_count; i++) {
+		value.bv_len=values[i].length;
+		value.bv_val=s->map+values[i].offset;
+		if(callback(s->map+s->names[values[i].attribute], &value, data)) break;
+	}
+	return AD_SUCCESS;
+}
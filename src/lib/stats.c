@@ -0,0 +1,338 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* stats.c
+ * counts and timings of the library's work, see ad_stats_enable()
+ *
+ * Each ldap operation is timed by an ad_op which the calling thread
+ * keeps on a stack while the operation runs.  An operation started
+ * inside another, such as the range searches made from a search's
+ * callback, pauses the outer one, and ad_search_results() pauses the
+ * current one while its callback runs, so time spent by the caller or
+ * in other operations isn't counted twice.
+ *
+ * Bytes are counted by an extra layer pushed on each connection's
+ * Sockbuf above TLS, so they are the sizes of the ldap messages.  The
+ * layer also notes when the first request is written, which together
+ * with libldap's connection callback, run once the TCP connection is
+ * made, splits a connection's setup into connecting, the TLS handshake
+ * and binding.
+ *
+ * The same timings are handed to the observer set by ad_set_observer().
+ * Without stats or an observer, ad_ops_timed is 0 and each of the calls
+ * made around an operation returns at its first test. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ad_private.h"
+#include <ldap.h>
+#include <lber.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+int ad_stats_enabled=0;
+int ad_ops_timed=0;
+
+ad_observer_callback observer=NULL;
+void *observer_data=NULL;
+
+pthread_mutex_t stats_lock=PTHREAD_MUTEX_INITIALIZER;
+ad_stats stats;
+
+char *ad_op_names[AD_OP_KINDS]={
+	"search", "add", "modify", "delete", "rename", "bind"
+};
+
+long long stats_nanoseconds(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec-from->tv_sec)*1000000000LL
+		+(to->tv_nsec-from->tv_nsec);
+}
+
+ber_slen_t stats_read(Sockbuf_IO_Desc *sbiod, void *buf, ber_len_t len) {
+	struct ad_thread_state *state;
+	ber_slen_t length;
+
+	length=LBER_SBIOD_READ_NEXT(sbiod, buf, len);
+	if(length<=0 || !ad_ops_timed) return length;
+
+	/* the connection is read by the thread waiting on it */
+	state=ad_thread_state();
+	if(state->op!=NULL) state->op->bytes+=length;
+	if(!ad_stats_enabled) return length;
+	pthread_mutex_lock(&stats_lock);
+	stats.bytes_received+=length;
+	pthread_mutex_unlock(&stats_lock);
+	return length;
+}
+
+ber_slen_t stats_write(Sockbuf_IO_Desc *sbiod, void *buf, ber_len_t len) {
+	struct ad_thread_state *state;
+	ber_slen_t length;
+
+	if(!ad_ops_timed) return LBER_SBIOD_WRITE_NEXT(sbiod, buf, len);
+
+	/* nothing goes through this layer before the TLS handshake is
+		over, so the first write is the end of it */
+	state=ad_thread_state();
+	if(state->connecting!=NULL && !state->connecting->sent.tv_sec)
+		clock_gettime(CLOCK_MONOTONIC, &state->connecting->sent);
+
+	length=LBER_SBIOD_WRITE_NEXT(sbiod, buf, len);
+	if(length<=0) return length;
+	if(state->op!=NULL) state->op->bytes+=length;
+	if(!ad_stats_enabled) return length;
+	pthread_mutex_lock(&stats_lock);
+	stats.bytes_sent+=length;
+	pthread_mutex_unlock(&stats_lock);
+	return length;
+}
+
+int stats_setup(Sockbuf_IO_Desc *sbiod, void *arg) {
+	return 0;
+}
+
+int stats_remove(Sockbuf_IO_Desc *sbiod) {
+	return 0;
+}
+
+int stats_ctrl(Sockbuf_IO_Desc *sbiod, int option, void *arg) {
+	return LBER_SBIOD_CTRL_NEXT(sbiod, option, arg);
+}
+
+Sockbuf_IO stats_io={
+	stats_setup, stats_remove, stats_ctrl, stats_read, stats_write, NULL
+};
+
+int stats_connection_added(LDAP *ds, Sockbuf *sb, LDAPURLDesc *server,
+		struct sockaddr *address, struct ldap_conncb *callback) {
+	struct ad_thread_state *state;
+
+	state=ad_thread_state();
+	if(state->connecting!=NULL && !state->connecting->connected.tv_sec)
+		clock_gettime(CLOCK_MONOTONIC, &state->connecting->connected);
+	return 0;
+}
+
+void stats_connection_deleted(LDAP *ds, Sockbuf *sb, struct ldap_conncb *callback) {
+}
+
+struct ldap_conncb stats_connection_callback={
+	stats_connection_added, stats_connection_deleted, NULL
+};
+
+void ad_stats_now(struct timespec *now) {
+	if(ad_ops_timed) clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+void ad_stats_phase(int phase, struct timespec *start) {
+	struct timespec now;
+
+	if(!ad_stats_enabled) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&stats_lock);
+	stats.phase_seconds[phase]+=stats_nanoseconds(start, &now)/1e9;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void ad_stats_connecting(LDAP *ds, struct ad_connect_timing *timing) {
+	Sockbuf *sb=NULL;
+
+	if(!ad_ops_timed) return;
+	memset(timing, 0, sizeof(struct ad_connect_timing));
+	if(ldap_get_option(ds, LDAP_OPT_SOCKBUF, &sb)==LDAP_OPT_SUCCESS
+			&& sb!=NULL)
+		ber_sockbuf_add_io(sb, &stats_io, LBER_SBIOD_LEVEL_APPLICATION, NULL);
+	ldap_set_option(ds, LDAP_OPT_CONNECT_CB, &stats_connection_callback);
+	ad_thread_state()->connecting=timing;
+	clock_gettime(CLOCK_MONOTONIC, &timing->start);
+}
+
+void ad_stats_connected(struct ad_connect_timing *timing) {
+	struct timespec now;
+
+	if(!ad_ops_timed) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ad_thread_state()->connecting=NULL;
+	if(!ad_stats_enabled) return;
+
+	pthread_mutex_lock(&stats_lock);
+	stats.connections++;
+	if(timing->connected.tv_sec && timing->sent.tv_sec) {
+		stats.phase_seconds[AD_PHASE_CONNECT]+=
+			stats_nanoseconds(&timing->start, &timing->connected)/1e9;
+		stats.phase_seconds[AD_PHASE_TLS]+=
+			stats_nanoseconds(&timing->connected, &timing->sent)/1e9;
+		stats.phase_seconds[AD_PHASE_BIND]+=
+			stats_nanoseconds(&timing->sent, &now)/1e9;
+	} else {
+		/* the connection failed, or the setup couldn't be split */
+		stats.phase_seconds[AD_PHASE_BIND]+=
+			stats_nanoseconds(&timing->start, &now)/1e9;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void ad_stats_resolve(int cached) {
+	if(!ad_stats_enabled) return;
+	pthread_mutex_lock(&stats_lock);
+	if(cached) stats.resolve_cached++;
+	else stats.resolve_searches++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* add a finished operation to the totals */
+void stats_record(int kind, int result, long long nanoseconds,
+		int round_trips, int entries, long long bytes) {
+	struct ad_op_stats *op_stats;
+
+	pthread_mutex_lock(&stats_lock);
+	op_stats=&stats.ops[kind];
+	op_stats->count++;
+	if(result!=LDAP_SUCCESS) op_stats->failed++;
+	op_stats->round_trips+=round_trips;
+	op_stats->entries+=entries;
+	op_stats->bytes+=bytes;
+	op_stats->seconds+=nanoseconds/1e9;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void ad_op_start(struct ad_op *op, int kind, char *dn) {
+	struct ad_thread_state *state;
+
+	op->started=ad_ops_timed;
+	if(!op->started) return;
+
+	state=ad_thread_state();
+	op->kind=kind;
+	op->dn=dn;
+	op->nanoseconds=0;
+	op->bytes=0;
+	op->round_trips=0;
+	op->entries=0;
+	op->outer=state->op;
+	op->outer_running=op->outer!=NULL && op->outer->running;
+	ad_op_pause();
+	if(observer!=NULL)
+		observer(AD_OBSERVE_START, kind, dn, LDAP_SUCCESS, 0, 0, observer_data);
+	state->op=op;
+	op->running=1;
+	clock_gettime(CLOCK_MONOTONIC, &op->mark);
+}
+
+void ad_op_end(struct ad_op *op, int result) {
+	struct ad_thread_state *state;
+
+	if(!op->started) return;
+	state=ad_thread_state();
+	ad_op_pause();
+	state->op=op->outer;
+	if(ad_stats_enabled)
+		stats_record(op->kind, result, op->nanoseconds,
+			op->round_trips>0 ? op->round_trips : 1, op->entries,
+			op->bytes);
+	if(observer!=NULL)
+		observer(AD_OBSERVE_END, op->kind, op->dn, result,
+			op->nanoseconds/1e9, op->bytes, observer_data);
+	/* an operation started from a callback leaves the outer one
+		paused until the callback returns */
+	if(op->outer_running) ad_op_resume();
+}
+
+void ad_op_pause() {
+	struct ad_op *op;
+	struct timespec now;
+
+	if(!ad_ops_timed) return;
+	op=ad_thread_state()->op;
+	if(op==NULL || !op->running) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	op->nanoseconds+=stats_nanoseconds(&op->mark, &now);
+	op->running=0;
+}
+
+void ad_op_resume() {
+	struct ad_op *op;
+
+	if(!ad_ops_timed) return;
+	op=ad_thread_state()->op;
+	if(op==NULL || op->running) return;
+	op->running=1;
+	clock_gettime(CLOCK_MONOTONIC, &op->mark);
+}
+
+void ad_op_round_trip() {
+	struct ad_op *op;
+
+	if(!ad_ops_timed) return;
+	op=ad_thread_state()->op;
+	if(op!=NULL) op->round_trips++;
+}
+
+void ad_op_entry() {
+	struct ad_op *op;
+
+	if(!ad_ops_timed) return;
+	op=ad_thread_state()->op;
+	if(op!=NULL) op->entries++;
+}
+
+void ad_op_sent(int kind, char *dn, struct timespec *sent) {
+	if(!ad_ops_timed) return;
+	clock_gettime(CLOCK_MONOTONIC, sent);
+	if(observer!=NULL)
+		observer(AD_OBSERVE_START, kind, dn, LDAP_SUCCESS, 0, 0, observer_data);
+}
+
+void ad_op_record(int kind, char *dn, int result, struct timespec *sent) {
+	struct timespec now;
+	long long nanoseconds;
+
+	if(!ad_ops_timed) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nanoseconds=stats_nanoseconds(sent, &now);
+	if(ad_stats_enabled) stats_record(kind, result, nanoseconds, 1, 0, 0);
+	if(observer!=NULL)
+		observer(AD_OBSERVE_END, kind, dn, result, nanoseconds/1e9, 0,
+			observer_data);
+}
+
+/* public functions */
+
+void ad_stats_enable() {
+	ad_stats_enabled=1;
+	ad_ops_timed=1;
+}
+
+void ad_set_observer(ad_observer_callback callback, void *data) {
+	/* never hand the new data to the old callback */
+	observer=NULL;
+	observer_data=data;
+	observer=callback;
+	ad_ops_timed=ad_stats_enabled || observer!=NULL;
+}
+
+void ad_stats_get(ad_stats *s) {
+	pthread_mutex_lock(&stats_lock);
+	memcpy(s, &stats, sizeof(ad_stats));
+	pthread_mutex_unlock(&stats_lock);
+	s->tls_connections=ad_tls_sessions(&s->tls_resumed);
+}
+
+char *ad_op_name(int kind) {
+	if(kind<0 || kind>=AD_OP_KINDS) return NULL;
+	return ad_op_names[kind];
+}
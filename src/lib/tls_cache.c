@@ -0,0 +1,250 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* tls_cache.c
+ * TLS sessions kept between processes so connections can resume them
+ *
+ * After each ldaps:// bind the connection's session is saved to the
+ * file given by the tlscachefile setting, one session per uri.  The
+ * next connection to the same uri offers it from the TLS connect
+ * callback, which libldap runs before the handshake, and the server
+ * can then skip the full handshake.  This needs libldap built with
+ * OpenSSL, and OpenSSL 1.1.1 or later found by configure; otherwise the
+ * cache is compiled out and connections are made as before.
+ *
+ * The file holds records of a four byte uri length, the uri, a four
+ * byte session length and the DER encoded session.  It is only ever
+ * replaced whole, by renaming a new copy over it. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ad_private.h"
+#include <ldap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(LDAP_OPT_X_TLS_CONNECT_CB) && defined(HAVE_SSL_SESSION_IS_RESUMABLE)
+#	define TLS_CACHE 1
+#	include <openssl/ssl.h>
+#endif
+
+/* a session file is small, anything bigger isn't ours */
+#define TLS_CACHE_MAX_SIZE (1024*1024)
+
+pthread_mutex_t tls_lock=PTHREAD_MUTEX_INITIALIZER;
+int tls_connections=0;
+int tls_resumed=0;
+
+#ifdef TLS_CACHE
+
+unsigned int tls_get_int(unsigned char *buffer) {
+	return ((unsigned int)buffer[0]<<24)|(buffer[1]<<16)
+		|(buffer[2]<<8)|buffer[3];
+}
+
+void tls_put_int(unsigned char *buffer, unsigned int value) {
+	buffer[0]=value>>24;
+	buffer[1]=value>>16;
+	buffer[2]=value>>8;
+	buffer[3]=value;
+}
+
+/* whether libldap's TLS is OpenSSL, whose session calls we use */
+int tls_openssl() {
+	char *package=NULL;
+	int openssl;
+
+	if(ldap_get_option(NULL, LDAP_OPT_X_TLS_PACKAGE, &package)!=LDAP_OPT_SUCCESS
+			|| package==NULL)
+		return 0;
+	openssl=!strcmp(package, "OpenSSL");
+	ldap_memfree(package);
+	return openssl;
+}
+
+/* read the whole cache file, returns NULL if there is none */
+unsigned char *tls_cache_read(int *length) {
+	unsigned char *data;
+	struct stat file_stat;
+	int fd;
+
+	fd=open(tls_cache_file, O_RDONLY);
+	if(fd<0) return NULL;
+	if(fstat(fd, &file_stat)<0 || file_stat.st_size>TLS_CACHE_MAX_SIZE) {
+		close(fd);
+		return NULL;
+	}
+	data=malloc(file_stat.st_size+1);
+	*length=read(fd, data, file_stat.st_size);
+	close(fd);
+	if(*length!=file_stat.st_size) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* find the session saved for uri in the cache file data.  returns its
+	offset and sets session_length, or returns -1 */
+int tls_cache_find(unsigned char *data, int length, char *uri, int *session_length) {
+	int offset, uri_length, record_length;
+
+	for(offset=0; offset+8<=length; offset+=record_length) {
+		uri_length=tls_get_int(data+offset);
+		if(uri_length>length-offset-8) return -1;
+		*session_length=tls_get_int(data+offset+4+uri_length);
+		if(*session_length>length-offset-8-uri_length) return -1;
+		record_length=8+uri_length+*session_length;
+		if(uri_length==strlen(uri)
+				&& !memcmp(data+offset+4, uri, uri_length))
+			return offset+8+uri_length;
+	}
+	return -1;
+}
+
+/* libldap calls this between creating the connection's SSL and the
+	handshake, the one point where a session can be offered */
+int tls_connect_callback(LDAP *ds, void *ssl, void *ctx, void *arg) {
+	unsigned char *data;
+	const unsigned char *der;
+	int length, offset, session_length;
+	SSL_SESSION *session;
+
+	pthread_mutex_lock(&tls_lock);
+	data=tls_cache_read(&length);
+	pthread_mutex_unlock(&tls_lock);
+	if(data==NULL) return 0;
+
+	offset=tls_cache_find(data, length, uri, &session_length);
+	if(offset>=0) {
+		der=data+offset;
+		session=d2i_SSL_SESSION(NULL, &der, session_length);
+		if(session!=NULL) {
+			/* the server would refuse an expired session anyway */
+			if(SSL_SESSION_get_time(session)+SSL_SESSION_get_timeout(session)>time(NULL))
+				SSL_set_session((SSL *)ssl, session);
+			SSL_SESSION_free(session);
+		}
+	}
+	free(data);
+	return 0;
+}
+
+/* replace the session saved for uri, writing a new copy of the file */
+void tls_cache_store(SSL_SESSION *session) {
+	unsigned char *data, *new_data, *der;
+	char *temp_file;
+	int length=0, offset, session_length, uri_length;
+	int new_length, der_length, temp_length, fd;
+
+	der_length=i2d_SSL_SESSION(session, NULL);
+	if(der_length<=0) return;
+	uri_length=strlen(uri);
+
+	pthread_mutex_lock(&tls_lock);
+	data=tls_cache_read(&length);
+	if(data==NULL) length=0;
+
+	new_data=malloc(length+8+uri_length+der_length);
+	new_length=0;
+	if(data!=NULL) {
+		/* keep the other uris' sessions */
+		offset=tls_cache_find(data, length, uri, &session_length);
+		if(offset<0) {
+			memcpy(new_data, data, length);
+			new_length=length;
+		} else {
+			memcpy(new_data, data, offset-8-uri_length);
+			new_length=offset-8-uri_length;
+			memcpy(new_data+new_length, data+offset+session_length,
+				length-offset-session_length);
+			new_length+=length-offset-session_length;
+		}
+		free(data);
+	}
+	tls_put_int(new_data+new_length, uri_length);
+	memcpy(new_data+new_length+4, uri, uri_length);
+	tls_put_int(new_data+new_length+4+uri_length, der_length);
+	der=new_data+new_length+8+uri_length;
+	i2d_SSL_SESSION(session, &der);
+	new_length+=8+uri_length+der_length;
+
+	/* the sessions are secrets, so only the user may read them */
+	temp_length=strlen(tls_cache_file)+32;
+	temp_file=malloc(temp_length);
+	snprintf(temp_file, temp_length, "%s.%d", tls_cache_file, (int)getpid());
+	fd=open(temp_file, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if(fd>=0) {
+		if(write(fd, new_data, new_length)==new_length && close(fd)==0)
+			rename(temp_file, tls_cache_file);
+		else
+			unlink(temp_file);
+	}
+	pthread_mutex_unlock(&tls_lock);
+	free(temp_file);
+	free(new_data);
+}
+
+#endif
+
+void ad_tls_prepare(LDAP *ds) {
+#ifdef TLS_CACHE
+	if(tls_cache_file==NULL || strncasecmp(uri, "ldaps://", 8)
+			|| !tls_openssl())
+		return;
+	ldap_set_option(ds, LDAP_OPT_X_TLS_CONNECT_CB, (void *)tls_connect_callback);
+#endif
+}
+
+void ad_tls_established(LDAP *ds) {
+#ifdef TLS_CACHE
+	SSL *ssl=NULL;
+	SSL_SESSION *session;
+
+	if(strncasecmp(uri, "ldaps://", 8) || !tls_openssl()) return;
+	if(ldap_get_option(ds, LDAP_OPT_X_TLS_SSL_CTX, &ssl)!=LDAP_OPT_SUCCESS
+			|| ssl==NULL)
+		return;
+
+	pthread_mutex_lock(&tls_lock);
+	tls_connections++;
+	if(SSL_session_reused(ssl)) tls_resumed++;
+	pthread_mutex_unlock(&tls_lock);
+
+	/* after the bind any session tickets have arrived */
+	if(tls_cache_file==NULL) return;
+	session=SSL_get1_session(ssl);
+	if(session==NULL) return;
+	if(SSL_SESSION_is_resumable(session)) tls_cache_store(session);
+	SSL_SESSION_free(session);
+#endif
+}
+
+int ad_tls_sessions(int *resumed) {
+	int connections;
+
+	pthread_mutex_lock(&tls_lock);
+	connections=tls_connections;
+	if(resumed!=NULL) *resumed=tls_resumed;
+	pthread_mutex_unlock(&tls_lock);
+	return connections;
+}
@@ -18,9 +18,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "output.h"
+#include "ldif.h"
+#include "report.h"
+#include "daemon.h"
 
 void usage() {
 	printf(
@@ -34,11 +45,18 @@ void usage() {
 		"-D binddn      dn to bind to server with\n"
 		"-w password    password to bind to server with\n"
 		"-b basedn      base for operations that involve searches\n"
+		"-j jobs        number of connections to run batch operations over\n"
+		"--stats[=json|histogram]\n"
+		"               report timings and counts on stderr after the operation\n"
 		"\n"
 		"These options may alternatively be read from %s or ~/.adtool.cfg.  Command line options override those in the config file.\n"
 		"\n"
+		"When adtoold is running operations are handed to it, unless -H, -D, -w, -j or --stats are given.\n"
+		"\n"
 		"operations:\n"
 		"usercreate         <username> <container>          create a new user\n"
+		"userprovision      <username> <container> [--password[=password]] [--attr attribute=value]... [--group group]...\n"
+		"                                                   create a ready to use user in one request\n"
 		"userdelete         <username>                      delete a user\n"
 		"userlock           <sAMAccountName>                disable a user account\n"
 		"userunlock         <sAMAccountName>                enable a user account\n"
@@ -52,23 +70,50 @@ void usage() {
 		"groupdelete        <group name>                    delete a group\n"
 		"groupadduser       <group> <user>                  add a user to a group\n"
 		"groupremoveuser    <group> <user>                  remove a user from a group\n"
+		"groupsync          <group> <file|->                make the group's members those listed, one dn or name per line\n"
+		"groupmembers       [--recursive|--walk] <group>    list a group's members, with those of nested groups\n"
+		"                                                   if asked, followed by the server or by --walk here\n"
+		"usergroups         <user> [--effective]            list the groups a user is in, or with --effective\n"
+		"                                                   every group including nested ones\n"
 		"groupsubtreeremove <container> <user>              remove a user from all groups below a given ou\n"
 		"\n"
 		"oucreate           <OU name> <container>           create a new organizational unit\n"
 		"oudelete           <OU name>                       delete an organizational unit\n"
 		"\n"
-		"attributeget       <sAMAccountName> <attribute>    display attribute values\n"
+		"attributeget       <sAMAccountName> <attribute>... [--snapshot file]\n"
+		"                                                   display attribute values\n"
 		"attributeadd       <object> <attribute> <value>    add an attribute\n"
 		"attributeaddbinary <object> <attribute> <filename> add an attribute from a file\n"
 		"attributereplace   <sAMAccountName> <attribute> <value>   replace an attribute\n"
 		"attributedelete    <object> <attribute> [value]    delete an attribute or attribute instance\n"
+		"attributeset       <object> <change>...            make several changes at once, each change one of\n"
+		"                                                   attr=value (replace), +attr=value (add),\n"
+		"                                                   -attr=value (delete value), -attr (delete attribute)\n"
 		"\n"
-		"search             <attribute> <value>             simple ldap search\n"
+		"search             <attribute> <value> [--snapshot file]\n"
+		"                                                   simple ldap search\n"
+		"list               <dn> [--snapshot file]          list the objects directly below dn\n"
+		"export             <base> [--filter filter] [--attrs a,b,c] [--output file] [--compress command]\n"
+		"                                                   write every object below base as LDIF\n"
+		"report             --attrs a,b,c [--filter filter] [--base base] [--format csv|tsv|json] [--join separator] [--output file]\n"
+		"                                                   one row of attribute values per object found\n"
+		"import             <file|-> [--offset offset]      apply the add, modify, delete and modrdn records of an LDIF file\n"
+		"changes            [--since cookie] [--cookie file] [--base base] [--filter filter] [--attrs a,b,c]\n"
+		"                   [--method dirsync|usn] [--output file]\n"
+		"                                                   write the objects changed or deleted since the run that\n"
+		"                                                   gave cookie as LDIF, ending with the next cookie\n"
+		"watch              <base> [--filter filter] [--attrs a,b,c] [--format ldif|json] [--scope base|one|sub]\n"
+		"                                                   write objects below base as they change, until killed\n"
+		"snapshot build     <file> [--base base] [--filter filter] [--attrs a,b,c] [--sort attribute]\n"
+		"                                                   save the objects below base to file, for search, list\n"
+		"                                                   and attributeget to answer with --snapshot file\n"
+		"\n"
+		"batch              [file|-]                        run operations read one per line from a file or stdin\n"
 		"\n",
 		system_config_file);
 }
 
-void useradd(char **argv) {
+int useradd(char **argv) {
 	char *username;
 	char *container;
         int result, dn_length;
@@ -84,73 +129,205 @@ void useradd(char **argv) {
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\nCan't create %s\n",
                         ad_get_error(), dn);
-		exit(1);
+		return 1;
         }
+	return 0;
+}
+
+void report_group_add(int sequence, char *dn, int result, char *message, void *data) {
+	if(result!=LDAP_SUCCESS)
+		fprintf(stderr, "error adding user %s to group %s:\n%s\n",
+			(char *)data, dn, message);
+}
+
+int userprovision(char **argv) {
+	char *username;
+	char *container;
+	char *password=NULL, *password2;
+	char *option, *equals;
+	char **groups, **group_dn;
+	ad_change *attributes;
+	ad_pipeline *p;
+	int i, j, num_attributes=0, num_groups=0, resolved=0, dn_length, result=1;
+	int differ;
+	char *dn=NULL;
+
+	username=argv[0];
+	container=argv[1];
+
+	for(i=2; argv[i]!=NULL; i++);
+	attributes=malloc(sizeof(ad_change)*i);
+	groups=malloc(sizeof(char *)*i);
+
+	/* --password[=password] --attr attribute=value --group group.
+		the password is only ever held in a copy which is wiped once
+		it's used */
+	for(i=2; argv[i]!=NULL; i++) {
+		option=argv[i];
+		if(!strcmp(option, "--password")) {
+			if(password!=NULL) {
+				memset(password, 0, strlen(password));
+				free(password);
+			}
+			option=getpass("Password:");
+			password2=strdup(option);
+			memset(option, 0, strlen(option));
+			option=getpass("Re-enter password:");
+			password=strdup(option);
+			memset(option, 0, strlen(option));
+			differ=strcmp(password, password2);
+			memset(password2, 0, strlen(password2));
+			free(password2);
+			if(differ) {
+				fprintf(stderr, "Error: passwords don't match\n");
+				goto done;
+			}
+		} else if(!strncmp(option, "--password=", 11)) {
+			if(password!=NULL) {
+				memset(password, 0, strlen(password));
+				free(password);
+			}
+			password=strdup(option+11);
+			memset(option+11, 0, strlen(option+11));
+		} else if(!strcmp(option, "--attr") && argv[i+1]!=NULL) {
+			option=strdup(argv[++i]);
+			equals=strchr(option, '=');
+			if(equals==NULL || equals==option) {
+				fprintf(stderr, "error: bad attribute %s\n", argv[i]);
+				free(option);
+				goto done;
+			}
+			*equals='\0';
+			attributes[num_attributes].op=LDAP_MOD_ADD;
+			attributes[num_attributes].attribute=option;
+			attributes[num_attributes].value=equals+1;
+			attributes[num_attributes].length=-1;
+			num_attributes++;
+		} else if(!strcmp(option, "--group") && argv[i+1]!=NULL) {
+			groups[num_groups++]=argv[++i];
+		} else {
+			fprintf(stderr, "error: unknown userprovision option %s\n", option);
+			goto done;
+		}
+	}
+	attributes[num_attributes].attribute=NULL;
+
+	/* resolve the groups first so that a bad name doesn't leave a
+		half provisioned user behind */
+	for(; resolved<num_groups; resolved++) {
+		group_dn=ad_resolve("cn", groups[resolved]);
+		if(ad_get_error_num()!=AD_SUCCESS) {
+			fprintf(stderr, "error: %s\n", ad_get_error());
+			goto done;
+		}
+		groups[resolved]=group_dn[0];
+		for(j=1; group_dn[j]!=NULL; j++) free(group_dn[j]);
+		free(group_dn);
+	}
+
+	dn_length=strlen(username)+strlen(container)+5;
+	dn=malloc(dn_length);
+	snprintf(dn, dn_length, "cn=%s,%s", username, container);
+
+	if(ad_provision_user(username, dn, password, attributes)!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\nCan't create %s\n",
+			ad_get_error(), dn);
+		goto done;
+	}
+
+	/* add the new user to every group in one round trip */
+	result=0;
+	if(num_groups>0) {
+		p=ad_pipeline_new(0, report_group_add, dn);
+		if(p==NULL) {
+			fprintf(stderr, "error: %s\n", ad_get_error());
+			result=1;
+		} else {
+			for(i=0; i<num_groups; i++)
+				ad_pipeline_mod_add(p, groups[i], "member", dn);
+			if(ad_pipeline_free(p)!=AD_SUCCESS) result=1;
+		}
+	}
+
+done:
+	if(password!=NULL) {
+		memset(password, 0, strlen(password));
+		free(password);
+	}
+	for(i=0; i<num_attributes; i++) free(attributes[i].attribute);
+	free(attributes);
+	for(i=0; i<resolved; i++) free(groups[i]);
+	free(groups);
+	if(dn!=NULL) free(dn);
+	return result;
 }
 
-void userdelete(char **argv){
+int userdelete(char **argv){
 	char *user;
         int result;
         char **dn;
 
 	user=argv[0];
 
-        dn=ad_search("name", user);
+        dn=ad_resolve("name", user);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_object_delete(*dn);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error, user %s could not be deleted:\n%s\n", *dn, ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void userlock(char **argv) {
+int userlock(char **argv) {
 	char *username;
         char **dn;
         int result;
 
 	username=argv[0];
 
-        dn=ad_search("sAMAccountName", username);
+        dn=ad_resolve("sAMAccountName", username);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_lock_user(*dn);
 
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-		exit(1);
+		return 1;
 	}
+	return 0;
 }
 
-void userunlock(char **argv) {
+int userunlock(char **argv) {
 	char *username;
         char **dn;
         int result;
 
 	username=argv[0];
 
-        dn=ad_search("sAMAccountName", username);
+        dn=ad_resolve("sAMAccountName", username);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_unlock_user(*dn);
 
         if(result!=AD_SUCCESS) {
 		fprintf(stderr, "error: %s\n", ad_get_error());
-		exit(1);
+		return 1;
 	}
+	return 0;
 }
 
-void setpass(char **argv) {
+int setpass(char **argv) {
 	char *username;
 	char *password;
 	char *password2;
@@ -165,28 +342,29 @@ void setpass(char **argv) {
 		password=getpass("Re-enter password:");
 		if(strcmp(password, password2)) {
 			fprintf(stderr, "Error: passwords don't match\n");
-			exit(1);
+			return 1;
 		}
 	} else {
 		password=strdup(argv[1]);
 		memset(argv[1], 0, strlen(argv[1]));
 	}
 
-	dn=ad_search("sAMAccountName", username);
+	dn=ad_resolve("sAMAccountName", username);
 	if(ad_get_error_num()!=AD_SUCCESS) {
 		fprintf(stderr, "error: %s\n", ad_get_error());
-		exit(1);
+		return 1;
 	}
 	result=ad_setpass(*dn, password);
 	free(password);
 	if(result!=AD_SUCCESS) {
 		fprintf(stderr, "error: %s\n", ad_get_error());
 		fprintf(stderr, "Ensure openldap is built with ssl support, and that you are using a secure connection to your active directory server (ldaps:// rather than plain ldap://).\n");
-		exit(1);
+		return 1;
 	}
+	return 0;
 }
 
-void usermove(char **argv) {
+int usermove(char **argv) {
 	char *username;
 	char *new_container;
         char **dn;
@@ -195,10 +373,10 @@ void usermove(char **argv) {
 	username=argv[0];
 	new_container=argv[1];
 
-        dn=ad_search("name", username);
+        dn=ad_resolve("name", username);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_move_user(*dn, new_container);
@@ -206,11 +384,12 @@ void usermove(char **argv) {
 
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
 	}
+	return 0;
 }
 
-void userrename(char **argv) {
+int userrename(char **argv) {
 	char *old_username;
 	char *new_username;
         char **dn;
@@ -219,21 +398,22 @@ void userrename(char **argv) {
 	old_username=argv[0];
 	new_username=argv[1];
 
-        dn=ad_search("name", old_username);
+        dn=ad_resolve("name", old_username);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_rename_user(*dn, new_username);
         free(dn);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
 	}
+	return 0;
 }
 
-void computercreate(char **argv) {
+int computercreate(char **argv) {
 	char *name;
 	char *container;
         int result, dn_length;
@@ -249,11 +429,12 @@ void computercreate(char **argv) {
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\nCan't create %s\n",
                         ad_get_error(), dn);
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void groupadd(char **argv) {
+int groupadd(char **argv) {
 	char *group;
 	char *container;
         int result, dn_length;
@@ -268,31 +449,33 @@ void groupadd(char **argv) {
         result=ad_group_create(group, dn);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void groupdelete(char **argv){
+int groupdelete(char **argv){
 	char *group;
         int result;
         char **dn;
 
 	group=argv[0];
 
-        dn=ad_search("name", group);
+        dn=ad_resolve("name", group);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_object_delete(*dn);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error, group %s could not be deleted:\n%s\n", *dn, ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void groupadduser(char **argv) {
+int groupadduser(char **argv) {
 	char *group;
 	char *user;
         char **group_dn, **user_dn;
@@ -300,26 +483,202 @@ void groupadduser(char **argv) {
 	group=argv[0];
 	user=argv[1];
 
-        group_dn=ad_search("cn", group);
+        group_dn=ad_resolve("cn", group);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
-        user_dn=ad_search("name", user);
+        user_dn=ad_resolve("name", user);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         if(ad_group_add_user(*group_dn, *user_dn)!=AD_SUCCESS) {
                 fprintf(stderr, "error adding user %s to group %s:\n%s",
                         *user_dn, *group_dn, ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void groupremoveuser(char **argv) {
+int groupsync(char **argv) {
+	char *group;
+	char *filename;
+	FILE *file;
+	char **group_dn, **dns;
+	char **members, **names;
+	char *line=NULL;
+	size_t line_size=0;
+	int length, count=0, size=1024, num_names=0, names_size=1024;
+	int i, result, added, removed;
+
+	group=argv[0];
+	filename=argv[1];
+
+	group_dn=ad_resolve("cn", group);
+	if(ad_get_error_num()!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+
+	if(!strcmp(filename, "-")) {
+		file=stdin;
+	} else {
+		file=fopen(filename, "r");
+		if(file==NULL) {
+			fprintf(stderr, "error: can't open %s\n", filename);
+			return 1;
+		}
+	}
+
+	/* one member per line, a dn or a name to look up.  the names are
+		looked up together once the file is read */
+	result=0;
+	members=malloc(sizeof(char *)*size);
+	names=malloc(sizeof(char *)*names_size);
+	while((length=getline(&line, &line_size, file))>=0) {
+		while(length>0 && (line[length-1]=='\n' || line[length-1]=='\r'))
+			line[--length]='\0';
+		if(length==0 || line[0]=='#') continue;
+		if(strchr(line, '=')!=NULL) {
+			if(count+1==size) {
+				size*=2;
+				members=realloc(members, sizeof(char *)*size);
+			}
+			members[count++]=strdup(line);
+		} else {
+			if(num_names+1==names_size) {
+				names_size*=2;
+				names=realloc(names, sizeof(char *)*names_size);
+			}
+			names[num_names++]=strdup(line);
+		}
+	}
+	names[num_names]=NULL;
+	if(file!=stdin) fclose(file);
+	if(line!=NULL) free(line);
+
+	if(num_names>0) {
+		dns=ad_resolve_names("name", names);
+		if(dns==NULL) {
+			fprintf(stderr, "error: %s\n", ad_get_error());
+			result=1;
+		} else {
+			members=realloc(members, sizeof(char *)*(count+num_names+1));
+			for(i=0; i<num_names; i++) {
+				if(dns[i]!=NULL) {
+					members[count++]=dns[i];
+				} else {
+					fprintf(stderr, "error: %s not found\n", names[i]);
+					result=1;
+				}
+			}
+			free(dns);
+		}
+	}
+	for(i=0; i<num_names; i++) free(names[i]);
+	free(names);
+	members[count]=NULL;
+
+	/* don't remove the members whose names couldn't be looked up */
+	if(result==0) {
+		if(ad_group_sync(*group_dn, members, &added, &removed)!=AD_SUCCESS) {
+			fprintf(stderr, "error: %s\n", ad_get_error());
+			result=1;
+		}
+		printf("added %d, removed %d members of %s\n", added, removed, *group_dn);
+	}
+
+	for(i=0; i<count; i++) free(members[i]);
+	free(members);
+	for(i=0; group_dn[i]!=NULL; i++) free(group_dn[i]);
+	free(group_dn);
+	return result;
+}
+
+int print_member(char *dn, int flags, void *data) {
+	if(flags&AD_MEMBER_CYCLE)
+		fprintf(stderr, "warning: group nesting loops back to %s\n", dn);
+	else
+		printf("%s\n", dn);
+	return 0;
+}
+
+int groupmembers(char **argv) {
+	char *group=NULL;
+	char **group_dn;
+	int i, result=0, method=AD_MEMBERS_DIRECT;
+
+	/* --recursive lets the server follow nested groups, --walk
+		follows them here.  either may come before the group */
+	for(i=0; argv[i]!=NULL; i++) {
+		if(!strcmp(argv[i], "--recursive")) {
+			if(method==AD_MEMBERS_DIRECT) method=AD_MEMBERS_CHAIN;
+		} else if(!strcmp(argv[i], "--walk")) {
+			method=AD_MEMBERS_WALK;
+		} else if(!strncmp(argv[i], "--", 2)) {
+			fprintf(stderr, "error: unknown groupmembers option %s\n", argv[i]);
+			return 1;
+		} else if(group==NULL) {
+			group=argv[i];
+		} else {
+			fprintf(stderr, "error: groupmembers takes one group, not %s and %s\n", group, argv[i]);
+			return 1;
+		}
+	}
+	if(group==NULL) {
+		fprintf(stderr, "error: groupmembers needs a group\n");
+		return 1;
+	}
+
+	group_dn=ad_resolve("name", group);
+	if(ad_get_error_num()!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+
+	if(ad_group_members(*group_dn, method, print_member, NULL)!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		result=1;
+	}
+	for(i=0; group_dn[i]!=NULL; i++) free(group_dn[i]);
+	free(group_dn);
+	return result;
+}
+
+int usergroups(char **argv) {
+	char *user;
+	char **user_dn, **groups;
+	int i, effective=0;
+
+	user=argv[0];
+	for(i=1; argv[i]!=NULL; i++) {
+		if(!strcmp(argv[i], "--effective")) {
+			effective=1;
+		} else {
+			fprintf(stderr, "error: unknown usergroups option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	user_dn=ad_resolve("name", user);
+	if(ad_get_error_num()!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+
+	groups=ad_user_groups(*user_dn, effective);
+	if(groups==NULL) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+	for(i=0; groups[i]!=NULL; i++) printf("%s\n", groups[i]);
+	return 0;
+}
+
+int groupremoveuser(char **argv) {
 	char *group;
 	char *user;
         char **group_dn, **user_dn;
@@ -327,26 +686,27 @@ void groupremoveuser(char **argv) {
 	group=argv[0];
 	user=argv[1];
 
-        group_dn=ad_search("name", group);
+        group_dn=ad_resolve("name", group);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
-        user_dn=ad_search("name", user);
+        user_dn=ad_resolve("name", user);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         if(ad_group_remove_user(*group_dn, *user_dn)!=AD_SUCCESS) {
                 fprintf(stderr, "error removing user %s from group %s:\n%s",
                         *user_dn, *group_dn, ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void groupsubtreeremove(char **argv) {
+int groupsubtreeremove(char **argv) {
 	char *container;
 	char *user;
         char **user_dn;
@@ -354,48 +714,141 @@ void groupsubtreeremove(char **argv) {
 	container=argv[0];
 	user=argv[1];
 
-        user_dn=ad_search("name", user);
+        user_dn=ad_resolve("name", user);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         if(ad_group_subtree_remove_user(container, *user_dn)!=AD_SUCCESS) {
-                fprintf(stderr, "error removing user %s from subtree %s:\n%s",
+                fprintf(stderr, "error removing user %s from subtree %s:\n%s\n",
                         *user_dn, container, ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
+}
+
+/* take a --snapshot file option out of argv, opening the snapshot, or
+	leaving *snapshot NULL if there is no such option.  returns -1 if
+	the snapshot can't be opened */
+int snapshot_option(char **argv, ad_snapshot **snapshot) {
+	int i, j;
+
+	*snapshot=NULL;
+	for(i=0; argv[i]!=NULL; i++) {
+		if(strcmp(argv[i], "--snapshot")) continue;
+		if(argv[i+1]==NULL) {
+			fprintf(stderr, "error: --snapshot needs a value\n");
+			return -1;
+		}
+		*snapshot=ad_snapshot_open(argv[i+1]);
+		if(*snapshot==NULL) {
+			fprintf(stderr, "error: %s\n", ad_get_error());
+			return -1;
+		}
+		for(j=i; (argv[j]=argv[j+2])!=NULL; j++);
+		return 0;
+	}
+	return 0;
 }
 
-void attributeget(char **argv) {
+/* prints the values of one attribute for attributeget --snapshot */
+struct snapshot_values {
+	char *label;
+	int found;
+};
+
+int print_snapshot_value(struct berval *value, void *data) {
+	struct snapshot_values *values=data;
+
+	if(values->label!=NULL) printf("%s: ", values->label);
+	fwrite(value->bv_val, 1, value->bv_len, stdout);
+	printf("\n");
+	values->found++;
+	return 0;
+}
+
+int snapshot_attributeget(ad_snapshot *snapshot, char **argv) {
+	struct snapshot_values values;
+	int i, entry;
+
+	entry=ad_snapshot_find(snapshot, "sAMAccountName", argv[0], strlen(argv[0]));
+	if(entry<0) {
+		fprintf(stderr, "error: %s isn't in the snapshot\n", argv[0]);
+		return 1;
+	}
+	values.found=0;
+	for(i=1; argv[i]!=NULL; i++) {
+		values.label=argv[2]!=NULL ? argv[i] : NULL;
+		ad_snapshot_values(snapshot, entry, argv[i], print_snapshot_value, &values);
+	}
+	if(values.found==0) {
+		fprintf(stderr, "error: no values found for %s\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
+
+int attributeget(char **argv) {
 	char *object;
-	char *attribute;
-        int i;
-        char **dn, **values;
+	char *filter, *escaped;
+	int filter_length;
+        int i, j, k, found=0;
+        ad_attribute *attributes;
+        struct berval **values;
+	ad_snapshot *snapshot;
+
+	if(snapshot_option(argv, &snapshot)<0) return 1;
+	if(argv[0]==NULL || argv[1]==NULL) {
+		fprintf(stderr, "error: attributeget needs an object and an attribute\n");
+		if(snapshot!=NULL) ad_snapshot_close(snapshot);
+		return 1;
+	}
+	if(snapshot!=NULL) {
+		i=snapshot_attributeget(snapshot, argv);
+		ad_snapshot_close(snapshot);
+		return i;
+	}
 
 	object=argv[0];
-	attribute=argv[1];
 
-        dn=ad_search("sAMAccountName", object);
-        if(ad_get_error_num()!=AD_SUCCESS) {
+	/* find the object and read its attributes in the same search */
+	escaped=ad_escape_filter(object);
+	filter_length=strlen(escaped)+19;
+	filter=malloc(filter_length);
+	snprintf(filter, filter_length, "(sAMAccountName=%s)", escaped);
+	free(escaped);
+
+        attributes=ad_get_attributes(filter, argv+1);
+        free(filter);
+        if(attributes==NULL) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
-        values=ad_get_attribute(*dn, attribute);
-        if(ad_get_error_num()!=AD_SUCCESS) {
-                fprintf(stderr, "error: %s\n", ad_get_error());
-		exit(1);
-        } 
+	/* a single attribute prints just its values, several are labelled */
+	for(i=1; argv[i]!=NULL; i++) {
+		for(j=0; attributes[j].name!=NULL; j++) {
+			if(!ad_attribute_matches(attributes[j].name, argv[i])) continue;
+			values=attributes[j].values;
+			for(k=0; values!=NULL && values[k]!=NULL; k++) {
+				if(argv[2]!=NULL) printf("%s: ", argv[i]);
+				fwrite(values[k]->bv_val, 1, values[k]->bv_len, stdout);
+				printf("\n");
+				found++;
+			}
+		}
+	}
+	ad_free_attributes(attributes);
 
-	if(values!=NULL) {
-                for(i=0; values[i]!=NULL; i++) {
-                        printf("%s\n", values[i]);
-                }
+	if(found==0) {
+		fprintf(stderr, "error: no values found for %s\n", object);
+		return 1;
 	}
+	return 0;
 }
 
-void attributeadd(char **argv) {
+int attributeadd(char **argv) {
 	char *object;
 	char *attribute;
 	char *value;
@@ -406,20 +859,21 @@ void attributeadd(char **argv) {
 	attribute=argv[1];
 	value=argv[2];
 
-        dn=ad_search("name", object);
+        dn=ad_resolve("name", object);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_mod_add(*dn, attribute, value);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error in attribute add: %s\n", ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void attributeaddbinary(char **argv) {
+int attributeaddbinary(char **argv) {
 	char *object;
 	char *attribute;
 	char *filename;
@@ -434,16 +888,16 @@ void attributeaddbinary(char **argv) {
 	attribute=argv[1];
 	filename=argv[2];
 
-        dn=ad_search("name", object);
+        dn=ad_resolve("name", object);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         data_fd=fopen(filename, "r");
         if(data_fd==NULL) {
                 fprintf(stderr, "error: couldn't open file %s\n", filename);
-                exit(1);
+                return 1;
         }
 
         stat(filename, &data_stat);
@@ -454,14 +908,15 @@ void attributeaddbinary(char **argv) {
         result=ad_mod_add_binary(*dn, attribute, data, filesize);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error in attribute add: %s\n", ad_get_error());
-		exit(1);
+		return 1;
         }
 
         free(dn);
         free(data);
+	return 0;
 }
 
-void attributereplace(char **argv) {
+int attributereplace(char **argv) {
 	char *object;
 	char *attribute;
 	char *value;
@@ -472,21 +927,22 @@ void attributereplace(char **argv) {
 	attribute=argv[1];
 	value=argv[2];
 
-        dn=ad_search("sAMAccountName", object);
+        dn=ad_resolve("sAMAccountName", object);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_mod_replace(*dn, attribute, value);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error in attribute replace: %s\n", ad_get_error
 ());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void attributedelete(char **argv) {
+int attributedelete(char **argv) {
 	char *object;
 	char *attribute;
 	char *value;
@@ -497,41 +953,789 @@ void attributedelete(char **argv) {
 	attribute=argv[1];
 	value=argv[2];
 
-        dn=ad_search("name", object);
+        dn=ad_resolve("name", object);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_mod_delete(*dn, attribute, value);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error in attribute replace: %s\n", ad_get_error
 ());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void search(char **argv) {
+int attributeset(char **argv) {
+	char *object;
+	char *change;
+        int result, i, num_changes;
+        char **dn;
+        ad_change *changes;
+        char *equals;
+
+	object=argv[0];
+
+	for(num_changes=0; argv[num_changes+1]!=NULL; num_changes++);
+	changes=malloc(sizeof(ad_change)*(num_changes+1));
+
+	/* attr=value replaces, +attr=value adds, -attr=value deletes
+		a value and -attr deletes the attribute */
+	for(i=0; i<num_changes; i++) {
+		change=strdup(argv[i+1]);
+		changes[i].length=-1;
+		if(change[0]=='+') {
+			changes[i].op=LDAP_MOD_ADD;
+			change++;
+		} else if(change[0]=='-') {
+			changes[i].op=LDAP_MOD_DELETE;
+			change++;
+		} else {
+			changes[i].op=LDAP_MOD_REPLACE;
+		}
+		changes[i].attribute=change;
+		equals=strchr(change, '=');
+		if(equals!=NULL) {
+			*equals='\0';
+			changes[i].value=equals+1;
+			if(changes[i].op==LDAP_MOD_REPLACE && *changes[i].value=='\0')
+				changes[i].value=NULL;
+		} else {
+			changes[i].value=NULL;
+		}
+		if(changes[i].attribute[0]=='\0'
+				|| (changes[i].value==NULL && changes[i].op!=LDAP_MOD_DELETE
+				&& equals==NULL)) {
+			fprintf(stderr, "error: bad attribute change %s\n", argv[i+1]);
+			free(changes);
+			return 1;
+		}
+	}
+	changes[num_changes].attribute=NULL;
+
+        dn=ad_resolve("name", object);
+        if(ad_get_error_num()!=AD_SUCCESS) {
+                fprintf(stderr, "error: %s\n", ad_get_error());
+                free(changes);
+                return 1;
+        }
+
+        result=ad_modify(*dn, changes);
+        free(changes);
+        if(result!=AD_SUCCESS) {
+                fprintf(stderr, "error in attribute set: %s\n", ad_get_error());
+		return 1;
+        }
+	return 0;
+}
+
+int print_dn(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	printf("%s\n", dn);
+	return 0;
+}
+
+int print_snapshot_dn(ad_snapshot *snapshot, int entry, void *data) {
+	printf("%s\n", ad_snapshot_dn(snapshot, entry));
+	return 0;
+}
+
+int search(char **argv) {
 	char *attribute;
 	char *value;
-        char **results;
-        int i;
+	char *filter;
+	int filter_length;
+	ad_snapshot *snapshot;
+
+	if(snapshot_option(argv, &snapshot)<0) return 1;
+	if(argv[0]==NULL || argv[1]==NULL) {
+		fprintf(stderr, "error: search needs an attribute and a value\n");
+		if(snapshot!=NULL) ad_snapshot_close(snapshot);
+		return 1;
+	}
 
 	attribute=argv[0];
 	value=argv[1];
 
-        results=ad_search(attribute, value);
-        if(results==(char **)-1) {
-                fprintf(stderr, "Error: %s\n", ad_get_error());
-                exit(1);
-        }
-        if(results!=NULL) {
-                for(i=0; results[i]!=NULL; i++)
-                        printf("%s\n", results[i]);
-        }
+	if(snapshot!=NULL) {
+		ad_snapshot_search(snapshot, attribute, value, print_snapshot_dn, NULL);
+		ad_snapshot_close(snapshot);
+		return 0;
+	}
+
+	filter_length=strlen(attribute)+strlen(value)+4;
+	filter=malloc(filter_length);
+	snprintf(filter, filter_length, "(%s=%s)", attribute, value);
+
+	if(ad_search_each(NULL, LDAP_SCOPE_SUBTREE, filter, NULL, print_dn, NULL)!=AD_SUCCESS) {
+		fprintf(stderr, "Error: %s\n", ad_get_error());
+		free(filter);
+		return 1;
+	}
+	free(filter);
+	return 0;
+}
+
+/* split a comma separated attribute list into a NULL terminated array */
+char **split_attributes(char *list) {
+	char **attrs;
+	char *attribute;
+	int i, count;
+
+	list=strdup(list);
+	for(count=1, i=0; list[i]; i++) if(list[i]==',') count++;
+	attrs=malloc(sizeof(char *)*(count+1));
+	count=0;
+	for(attribute=strtok(list, ","); attribute!=NULL; attribute=strtok(NULL, ","))
+		attrs[count++]=attribute;
+	attrs[count]=NULL;
+	return attrs;
+}
+
+int export_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	/* a failed write abandons the search */
+	return ldif_write_entry((output *)data, ds, entry, dn)<0;
+}
+
+int export_ldif(char **argv) {
+	char *base;
+	char *filter="(objectclass=*)";
+	char *filename=NULL, *compressor=NULL;
+	char *all_attrs[]={"*", NULL};
+	char **attrs=all_attrs;
+	output *out;
+	int i, result;
+
+	base=argv[0];
+
+	/* --filter filter --attrs a,b,c --output file --compress command */
+	for(i=1; argv[i]!=NULL; i++) {
+		if(argv[i+1]==NULL) {
+			fprintf(stderr, "error: %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(!strcmp(argv[i], "--filter")) {
+			filter=argv[++i];
+		} else if(!strcmp(argv[i], "--attrs")) {
+			attrs=split_attributes(argv[++i]);
+		} else if(!strcmp(argv[i], "--output")) {
+			filename=argv[++i];
+		} else if(!strcmp(argv[i], "--compress")) {
+			compressor=argv[++i];
+		} else {
+			fprintf(stderr, "error: unknown export option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	out=output_open(filename, compressor);
+	if(out==NULL) return 1;
+
+	output_printf(out, "version: 1\n\n");
+	result=ad_search_each(base, LDAP_SCOPE_SUBTREE, filter, attrs, export_entry, out);
+	if(result!=AD_SUCCESS)
+		fprintf(stderr, "error: %s\n", ad_get_error());
+	if(output_close(out)<0) result=AD_LDAP_OPERATION_FAILURE;
+
+	return result!=AD_SUCCESS;
+}
+
+int print_change(LDAP *ds, LDAPMessage *entry, char *dn, int deleted, void *data) {
+	output *out=data;
+
+	if(deleted) {
+		if(ldif_write_value(out, "dn", dn, strlen(dn))<0) return 1;
+		return output_printf(out, "changetype: delete\n\n")<0;
+	}
+	return ldif_write_entry(out, ds, entry, dn)<0;
+}
+
+/* read a cookie saved by an earlier run, NULL if there is none */
+char *read_cookie(char *filename) {
+	FILE *file;
+	char line[8192];
+
+	file=fopen(filename, "r");
+	if(file==NULL) return NULL;
+	if(fgets(line, sizeof(line), file)==NULL) {
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	line[strcspn(line, "\n")]='\0';
+	return strdup(line);
+}
+
+/* replace the saved cookie, so that an interrupted run leaves the old */
+int save_cookie(char *filename, char *cookie) {
+	FILE *file;
+	char *temp;
+	int length, result;
+
+	length=strlen(filename)+5;
+	temp=malloc(length);
+	snprintf(temp, length, "%s.new", filename);
+	file=fopen(temp, "w");
+	if(file==NULL) {
+		fprintf(stderr, "error: can't write %s: %s\n", temp, strerror(errno));
+		free(temp);
+		return -1;
+	}
+	fprintf(file, "%s\n", cookie);
+	result=fclose(file);
+	if(result==0) result=rename(temp, filename);
+	if(result!=0) {
+		fprintf(stderr, "error: can't write %s: %s\n", filename, strerror(errno));
+		unlink(temp);
+	}
+	free(temp);
+	return result;
+}
+
+int changes_ldif(char **argv) {
+	char *base=NULL;
+	char *filter=NULL;
+	char *filename=NULL, *cookie_file=NULL;
+	char *cookie=NULL, *new_cookie;
+	char **attrs=NULL;
+	int method=AD_CHANGES_AUTO;
+	output *out;
+	int i, result;
+
+	/* --since cookie --cookie file --base base --filter filter
+		--attrs a,b,c --method dirsync|usn --output file */
+	for(i=0; argv[i]!=NULL; i++) {
+		if(argv[i+1]==NULL) {
+			fprintf(stderr, "error: %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(!strcmp(argv[i], "--since")) {
+			cookie=argv[++i];
+		} else if(!strcmp(argv[i], "--cookie")) {
+			cookie_file=argv[++i];
+		} else if(!strcmp(argv[i], "--base")) {
+			base=argv[++i];
+		} else if(!strcmp(argv[i], "--filter")) {
+			filter=argv[++i];
+		} else if(!strcmp(argv[i], "--attrs")) {
+			attrs=split_attributes(argv[++i]);
+		} else if(!strcmp(argv[i], "--output")) {
+			filename=argv[++i];
+		} else if(!strcmp(argv[i], "--method")) {
+			i++;
+			if(!strcmp(argv[i], "dirsync")) method=AD_CHANGES_DIRSYNC;
+			else if(!strcmp(argv[i], "usn")) method=AD_CHANGES_USN;
+			else {
+				fprintf(stderr, "error: unknown changes method %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "error: unknown changes option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(cookie==NULL && cookie_file!=NULL) cookie=read_cookie(cookie_file);
+
+	out=output_open(filename, NULL);
+	if(out==NULL) return 1;
+
+	output_printf(out, "version: 1\n\n");
+	result=ad_changes(base, filter, attrs, cookie, method, print_change, out, &new_cookie);
+	if(result!=AD_SUCCESS)
+		fprintf(stderr, "error: %s\n", ad_get_error());
+	else if(new_cookie!=NULL)
+		output_printf(out, "# cookie: %s\n", new_cookie);
+	if(output_close(out)<0) result=AD_LDAP_OPERATION_FAILURE;
+
+	/* only move the saved cookie on once the changes are written */
+	if(result==AD_SUCCESS && new_cookie!=NULL && cookie_file!=NULL
+			&& save_cookie(cookie_file, new_cookie)<0)
+		result=AD_LDAP_OPERATION_FAILURE;
+	free(new_cookie);
+
+	return result!=AD_SUCCESS;
+}
+
+int snapshot(char **argv) {
+	char *filename;
+	char *base=NULL;
+	char *filter=NULL;
+	char *sorted=NULL;
+	char **attrs=NULL;
+	int i;
+
+	if(strcmp(argv[0], "build")) {
+		fprintf(stderr, "error: unknown snapshot command %s\n", argv[0]);
+		return 1;
+	}
+	filename=argv[1];
+
+	/* --base base --filter filter --attrs a,b,c --sort attribute */
+	for(i=2; argv[i]!=NULL; i++) {
+		if(argv[i+1]==NULL) {
+			fprintf(stderr, "error: %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(!strcmp(argv[i], "--base")) {
+			base=argv[++i];
+		} else if(!strcmp(argv[i], "--filter")) {
+			filter=argv[++i];
+		} else if(!strcmp(argv[i], "--attrs")) {
+			attrs=split_attributes(argv[++i]);
+		} else if(!strcmp(argv[i], "--sort")) {
+			sorted=argv[++i];
+		} else {
+			fprintf(stderr, "error: unknown snapshot option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if(ad_snapshot_build(filename, base, filter, attrs, sorted)!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+	return 0;
 }
 
-void oucreate(char **argv) {
+/* where watch writes its events, through a report for json */
+struct watch_output {
+	output *out;
+	report *r;
+};
+
+int print_watch(LDAP *ds, LDAPMessage *entry, char *dn, int deleted, void *data) {
+	struct watch_output *w=data;
+	int failed;
+
+	if(entry==NULL) {
+		fprintf(stderr, "warning: reconnected to the server, changes made while disconnected were missed\n");
+		return 0;
+	}
+	if(w->r!=NULL) failed=report_change(ds, entry, dn, deleted, w->r);
+	else failed=print_change(ds, entry, dn, deleted, w->out);
+	/* each event is passed on as soon as it happens */
+	return output_flush(w->out)<0 || failed;
+}
+
+int watch(char **argv) {
+	char *base;
+	char *filter=NULL;
+	char *no_attrs[]={NULL};
+	char **attrs=NULL;
+	int scope=LDAP_SCOPE_SUBTREE, json=0;
+	struct watch_output w;
+	int i, result;
+
+	base=argv[0];
+
+	/* --filter filter --attrs a,b,c --format ldif|json
+		--scope base|one|sub */
+	for(i=1; argv[i]!=NULL; i++) {
+		if(argv[i+1]==NULL) {
+			fprintf(stderr, "error: %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(!strcmp(argv[i], "--filter")) {
+			filter=argv[++i];
+		} else if(!strcmp(argv[i], "--attrs")) {
+			attrs=split_attributes(argv[++i]);
+		} else if(!strcmp(argv[i], "--format")) {
+			i++;
+			if(!strcmp(argv[i], "ldif")) json=0;
+			else if(!strcmp(argv[i], "json")) json=1;
+			else {
+				fprintf(stderr, "error: unknown watch format %s\n", argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--scope")) {
+			i++;
+			if(!strcmp(argv[i], "base")) scope=LDAP_SCOPE_BASE;
+			else if(!strcmp(argv[i], "one")) scope=LDAP_SCOPE_ONELEVEL;
+			else if(!strcmp(argv[i], "sub")) scope=LDAP_SCOPE_SUBTREE;
+			else {
+				fprintf(stderr, "error: unknown watch scope %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "error: unknown watch option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	w.out=output_open(NULL, NULL);
+	if(w.out==NULL) return 1;
+	w.r=NULL;
+	if(json) {
+		w.r=report_new(w.out, REPORT_JSON_LINES, attrs?attrs:no_attrs, ";");
+	} else {
+		if(attrs==NULL) attrs=split_attributes("*");
+		output_printf(w.out, "version: 1\n\n");
+		output_flush(w.out);
+	}
+
+	result=ad_watch(base, scope, filter, attrs, print_watch, &w);
+	if(result!=AD_SUCCESS)
+		fprintf(stderr, "error: %s\n", ad_get_error());
+	if(w.r!=NULL && report_finish(w.r)<0) result=AD_LDAP_OPERATION_FAILURE;
+	if(output_close(w.out)<0) result=AD_LDAP_OPERATION_FAILURE;
+
+	return result!=AD_SUCCESS;
+}
+
+int report_attributes(char **argv) {
+	char *base=NULL;
+	char *filter="(objectclass=*)";
+	char *filename=NULL;
+	char *join=";";
+	char **attrs=NULL;
+	int format=REPORT_CSV;
+	output *out;
+	report *r;
+	int i, result;
+
+	/* --base base --filter filter --attrs a,b,c --format csv|tsv|json
+		--join separator --output file */
+	for(i=0; argv[i]!=NULL; i++) {
+		if(argv[i+1]==NULL) {
+			fprintf(stderr, "error: %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(!strcmp(argv[i], "--base")) {
+			base=argv[++i];
+		} else if(!strcmp(argv[i], "--filter")) {
+			filter=argv[++i];
+		} else if(!strcmp(argv[i], "--attrs")) {
+			attrs=split_attributes(argv[++i]);
+		} else if(!strcmp(argv[i], "--join")) {
+			join=argv[++i];
+		} else if(!strcmp(argv[i], "--output")) {
+			filename=argv[++i];
+		} else if(!strcmp(argv[i], "--format")) {
+			i++;
+			if(!strcmp(argv[i], "csv")) format=REPORT_CSV;
+			else if(!strcmp(argv[i], "tsv")) format=REPORT_TSV;
+			else if(!strcmp(argv[i], "json")) format=REPORT_JSON;
+			else {
+				fprintf(stderr, "error: unknown report format %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "error: unknown report option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(attrs==NULL) {
+		fprintf(stderr, "error: report needs --attrs\n");
+		return 1;
+	}
+
+	out=output_open(filename, NULL);
+	if(out==NULL) return 1;
+	r=report_new(out, format, attrs, join);
+
+	result=ad_search_each(base, LDAP_SCOPE_SUBTREE, filter, attrs, report_entry, r);
+	if(result!=AD_SUCCESS)
+		fprintf(stderr, "error: %s\n", ad_get_error());
+	if(report_finish(r)<0) result=AD_LDAP_OPERATION_FAILURE;
+	if(output_close(out)<0) result=AD_LDAP_OPERATION_FAILURE;
+
+	return result!=AD_SUCCESS;
+}
+
+/* import keeps the position of each outstanding record so results can
+	be reported with it.  the pipeline reports a record before it takes
+	the slot of a new one, hence the extra entry.  the normalized dns
+	each outstanding record works on, at most two for a modrdn, are
+	kept in names and in dns, and their parents counted in parents, so
+	a record that depends on one still in flight can wait for it */
+struct import_state {
+	long *offsets;
+	long *end_offsets;
+	char **names;
+	struct ad_hash *dns;
+	struct ad_hash *parents;
+	int size;
+	int submitted;
+	int failed;
+};
+
+/* the parent part of a dn, empty for a top level one */
+char *import_parent(char *dn) {
+	for(; *dn; dn++) {
+		if(*dn=='\\' && dn[1]!='\0') dn++;
+		else if(*dn==',') return dn+1;
+	}
+	return dn;
+}
+
+/* a record must wait if an outstanding one works on its dn, on its
+	parent, say adding the container it is to be added to, or on one
+	of its children, say deleting a child before it is deleted */
+int import_depends(struct import_state *state, char *dn) {
+	return ad_hash_find(state->dns, dn)!=NULL
+		|| ad_hash_find(state->dns, import_parent(dn))!=NULL
+		|| ad_hash_find(state->parents, dn)!=NULL;
+}
+
+void import_hold(struct import_state *state, char *dn) {
+	void **count;
+
+	ad_hash_insert(state->dns, dn, NULL);
+	count=ad_hash_insert(state->parents, import_parent(dn), NULL);
+	*count=(void *)((long)*count+1);
+}
+
+void import_release(struct import_state *state, char *dn) {
+	void **count;
+
+	ad_hash_remove(state->dns, dn);
+	count=ad_hash_find(state->parents, import_parent(dn));
+	if(count==NULL) return;
+	*count=(void *)((long)*count-1);
+	if(*count==NULL) ad_hash_remove(state->parents, import_parent(dn));
+}
+
+/* called just before a record is sent, new_dn being where a modrdn
+	moves it to.  the outstanding records are waited for if it depends
+	on any of them */
+void import_order(ad_pipeline *p, struct import_state *state, char *dn, char *new_dn) {
+	char **names;
+
+	names=&state->names[(state->submitted%state->size)*2];
+	names[0]=ad_normalize_dn(dn);
+	names[1]=new_dn?ad_normalize_dn(new_dn):NULL;
+	if(import_depends(state, names[0])
+			|| (names[1]!=NULL && import_depends(state, names[1])))
+		ad_pipeline_flush(p);
+	import_hold(state, names[0]);
+	if(names[1]!=NULL) import_hold(state, names[1]);
+}
+
+void import_report(int sequence, char *dn, int result, char *message, void *data) {
+	struct import_state *state=data;
+	char **names;
+	int i;
+
+	i=sequence%state->size;
+	if(result==LDAP_SUCCESS) {
+		printf("%ld %ld ok %s\n", state->offsets[i], state->end_offsets[i], dn);
+	} else {
+		printf("%ld %ld error %s: %s\n", state->offsets[i], state->end_offsets[i], dn, message);
+		state->failed++;
+	}
+
+	names=&state->names[i*2];
+	for(i=0; i<2; i++) {
+		if(names[i]==NULL) continue;
+		import_release(state, names[i]);
+		free(names[i]);
+		names[i]=NULL;
+	}
+}
+
+/* report a record that couldn't be sent, after the ones before it */
+void import_error(ad_pipeline *p, struct import_state *state, ldif_record *record, char *message) {
+	ad_pipeline_flush(p);
+	printf("%ld %ld error %s: %s\n", record->offset, record->end_offset,
+		record->dn?record->dn:"-", message);
+	state->failed++;
+}
+
+/* turn the lines of a modify record into ad_changes */
+ad_change *import_modify_changes(ldif_record *record) {
+	ad_change *changes;
+	ldif_attribute *line;
+	char *attribute=NULL;
+	int i, op=0, num_changes=0, values=0;
+
+	changes=malloc(sizeof(ad_change)*(record->count+1));
+	for(i=0; i<record->count; i++) {
+		line=&record->attributes[i];
+		if(attribute==NULL) {
+			if(!strcasecmp(line->name, "add")) op=LDAP_MOD_ADD;
+			else if(!strcasecmp(line->name, "delete")) op=LDAP_MOD_DELETE;
+			else if(!strcasecmp(line->name, "replace")) op=LDAP_MOD_REPLACE;
+			else break;
+			attribute=line->value;
+			values=0;
+		} else if(!strcmp(line->name, "-")) {
+			/* no values deletes or replaces the whole attribute */
+			if(values==0) {
+				if(op==LDAP_MOD_ADD) break;
+				changes[num_changes].op=op;
+				changes[num_changes].attribute=attribute;
+				changes[num_changes].value=NULL;
+				changes[num_changes].length=-1;
+				num_changes++;
+			}
+			attribute=NULL;
+		} else if(!strcasecmp(line->name, attribute)) {
+			changes[num_changes].op=op;
+			changes[num_changes].attribute=attribute;
+			changes[num_changes].value=line->value;
+			changes[num_changes].length=line->length;
+			num_changes++;
+			values++;
+		} else {
+			break;
+		}
+	}
+	/* the last "-" may be left off */
+	if(i==record->count && attribute!=NULL) {
+		if(values==0 && op!=LDAP_MOD_ADD) {
+			changes[num_changes].op=op;
+			changes[num_changes].attribute=attribute;
+			changes[num_changes].value=NULL;
+			changes[num_changes].length=-1;
+			num_changes++;
+		} else if(values==0) {
+			i=-1;
+		}
+	}
+	if(i!=record->count || num_changes==0) {
+		free(changes);
+		return NULL;
+	}
+	changes[num_changes].attribute=NULL;
+	return changes;
+}
+
+/* send one record through the pipeline */
+void import_record(ad_pipeline *p, struct import_state *state, ldif_record *record) {
+	ad_change *changes;
+	char *new_rdn=NULL, *new_parent=NULL, *new_dn;
+	int i, delete_old_rdn=1, new_dn_length;
+
+	i=state->submitted%state->size;
+	state->offsets[i]=record->offset;
+	state->end_offsets[i]=record->end_offset;
+
+	switch(record->changetype) {
+	case LDIF_ADD:
+		changes=malloc(sizeof(ad_change)*(record->count+1));
+		for(i=0; i<record->count; i++) {
+			changes[i].attribute=record->attributes[i].name;
+			changes[i].value=record->attributes[i].value;
+			changes[i].length=record->attributes[i].length;
+			if(changes[i].value==NULL) break;
+		}
+		changes[i].attribute=NULL;
+		if(i!=record->count || i==0) {
+			free(changes);
+			import_error(p, state, record, "bad add record");
+			return;
+		}
+		import_order(p, state, record->dn, NULL);
+		ad_pipeline_create(p, record->dn, changes);
+		free(changes);
+		break;
+	case LDIF_MODIFY:
+		changes=import_modify_changes(record);
+		if(changes==NULL) {
+			import_error(p, state, record, "bad modify record");
+			return;
+		}
+		import_order(p, state, record->dn, NULL);
+		ad_pipeline_change(p, record->dn, changes);
+		free(changes);
+		break;
+	case LDIF_DELETE:
+		if(record->count>0) {
+			import_error(p, state, record, "bad delete record");
+			return;
+		}
+		import_order(p, state, record->dn, NULL);
+		ad_pipeline_delete(p, record->dn);
+		break;
+	case LDIF_MODRDN:
+		for(i=0; i<record->count; i++) {
+			if(!strcasecmp(record->attributes[i].name, "newrdn"))
+				new_rdn=record->attributes[i].value;
+			else if(!strcasecmp(record->attributes[i].name, "deleteoldrdn"))
+				delete_old_rdn=strcmp(record->attributes[i].value, "0");
+			else if(!strcasecmp(record->attributes[i].name, "newsuperior"))
+				new_parent=record->attributes[i].value;
+		}
+		if(new_rdn==NULL) {
+			import_error(p, state, record, "modrdn record without newrdn");
+			return;
+		}
+		if(new_parent==NULL) new_parent=import_parent(record->dn);
+		new_dn_length=strlen(new_rdn)+strlen(new_parent)+2;
+		new_dn=malloc(new_dn_length);
+		snprintf(new_dn, new_dn_length, "%s,%s", new_rdn, new_parent);
+		import_order(p, state, record->dn, new_dn);
+		free(new_dn);
+		ad_pipeline_rename(p, record->dn, new_rdn, new_parent, delete_old_rdn);
+		break;
+	}
+	state->submitted++;
+}
+
+int import_ldif(char **argv) {
+	char *filename;
+	long offset=0;
+	ldif_reader *r;
+	ldif_record record;
+	ad_pipeline *p;
+	struct import_state state;
+	int i, result, records=0;
+
+	filename=argv[0];
+	for(i=1; argv[i]!=NULL; i++) {
+		if(!strcmp(argv[i], "--offset") && argv[i+1]!=NULL) {
+			offset=atol(argv[++i]);
+		} else {
+			fprintf(stderr, "error: unknown import option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	r=ldif_open(filename, offset);
+	if(r==NULL) return 1;
+
+	p=ad_pipeline_new(AD_PIPELINE_WINDOW, import_report, &state);
+	if(p==NULL) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		ldif_close(r);
+		return 1;
+	}
+
+	state.size=AD_PIPELINE_WINDOW+1;
+	state.offsets=malloc(sizeof(long)*state.size);
+	state.end_offsets=malloc(sizeof(long)*state.size);
+	state.names=calloc(state.size*2, sizeof(char *));
+	state.dns=ad_hash_new(state.size*2);
+	state.parents=ad_hash_new(state.size*2);
+	state.submitted=0;
+	state.failed=0;
+
+	while((result=ldif_read(r, &record))!=0) {
+		records++;
+		if(result<0) {
+			import_error(p, &state, &record, ldif_error(r));
+			continue;
+		}
+		import_record(p, &state, &record);
+		ldif_free_record(&record);
+	}
+	ad_pipeline_free(p);
+	ldif_close(r);
+
+	free(state.offsets);
+	free(state.end_offsets);
+	free(state.names);
+	ad_hash_free(state.dns, NULL);
+	ad_hash_free(state.parents, NULL);
+	if(state.failed>0) {
+		fprintf(stderr, "error: %d of %d records failed\n", state.failed, records);
+		return 1;
+	}
+	return 0;
+}
+
+int oucreate(char **argv) {
 	char *ou,     *container;
   int   result,  dn_length;
   char *dn;
@@ -545,55 +1749,78 @@ void oucreate(char **argv) {
         result=ad_ou_create(ou, dn);
         if(result!=AD_SUCCESS) {
             fprintf(stderr, "error: %s\n", ad_get_error());
-		        exit(1);
+		        return 1;
         }
+	return 0;
 }
 
-void oudelete(char **argv){
+int oudelete(char **argv){
 	char *ou;
         int result;
         char **dn;
 
 	ou=argv[0];
 
-        dn=ad_search("ou", ou);
+        dn=ad_resolve("ou", ou);
         if(ad_get_error_num()!=AD_SUCCESS) {
                 fprintf(stderr, "error: %s\n", ad_get_error());
-                exit(1);
+                return 1;
         }
 
         result=ad_object_delete(*dn);
         if(result!=AD_SUCCESS) {
                 fprintf(stderr, "error, ou %s could not be deleted:\n%s\n", *dn, ad_get_error());
-		exit(1);
+		return 1;
         }
+	return 0;
 }
 
-void list(char **argv) {
+int list(char **argv) {
 	char *dn;
-	char **results;
-	int i;
+	ad_snapshot *snapshot;
+	int result;
+
+	if(snapshot_option(argv, &snapshot)<0) return 1;
+	if(argv[0]==NULL) {
+		fprintf(stderr, "error: list needs a dn\n");
+		if(snapshot!=NULL) ad_snapshot_close(snapshot);
+		return 1;
+	}
 
 	dn=argv[0];
 
-	results=ad_list(dn);
-	if(results!=NULL) {
-		for(i=0; results[i]!=NULL; i++) {
-			printf("%s\n", results[i]);
-		}
+	if(snapshot!=NULL) {
+		result=ad_snapshot_children(snapshot, dn, print_snapshot_dn, NULL);
+		if(result!=AD_SUCCESS) fprintf(stderr, "error: %s\n", ad_get_error());
+		ad_snapshot_close(snapshot);
+		return result!=AD_SUCCESS;
+	}
+
+	if(ad_search_each(dn, LDAP_SCOPE_ONELEVEL, NULL, NULL, print_dn, NULL)!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
 	}
+	return 0;
 }
 
+/* second_object is set for operations whose second argument also names
+	an object, such as the user in groupadduser, which parallel batches
+	must keep in order with the other operations on it */
 struct function {
 	char *name;
-	void *operation;
+	int (*operation)(char **);
 	int num_args;
+	int second_object;
 };
 
+int batch(char **argv);
+
 struct function function_table[] = {
 	{"useradd", useradd, 2}, /* old name */
 	{"usercreate", useradd, 2},
 
+	{"userprovision", userprovision, 2},
+
 	{"userdelete", userdelete, 1},
 
 	{"userlock", userlock, 1},
@@ -604,7 +1831,7 @@ struct function function_table[] = {
 
 	{"usermove", usermove, 2},
 
-	{"userrename", userrename, 2},
+	{"userrename", userrename, 2, 1},
 
 	{"computercreate", computercreate, 2},
 
@@ -613,11 +1840,17 @@ struct function function_table[] = {
 
 	{"groupdelete", groupdelete, 1},
 
-	{"groupadduser", groupadduser, 2},
+	{"groupadduser", groupadduser, 2, 1},
+
+	{"groupremoveuser", groupremoveuser, 2, 1},
+
+	{"groupsync", groupsync, 2},
 
-	{"groupremoveuser", groupremoveuser, 2},
+	{"groupmembers", groupmembers, 1},
 
-	{"groupsubtreeremove", groupsubtreeremove, 2},
+	{"usergroups", usergroups, 1},
+
+	{"groupsubtreeremove", groupsubtreeremove, 2, 1},
 
 	{"attributeget", attributeget, 2},
 
@@ -629,25 +1862,554 @@ struct function function_table[] = {
 
 	{"attributedelete", attributedelete, 2},
 
+	{"attributeset", attributeset, 2},
+
 	{"search", search, 2},
 
+	{"export", export_ldif, 1},
+
+	{"import", import_ldif, 1},
+
+	{"changes", changes_ldif, 0},
+
+	{"watch", watch, 1},
+
+	{"snapshot", snapshot, 2},
+
+	{"report", report_attributes, 2},
+
 	{"oucreate", oucreate, 2},
 
 	{"oudelete", oudelete, 1},
 
-	{"list", list, 1}
+	{"list", list, 1},
+
+	{"batch", batch, 0}
+};
+
+/* look up an operation by name in the function table
+	returns NULL if there is no such operation */
+struct function *find_function(char *name) {
+	int i, num_functions;
+
+	num_functions=(sizeof(function_table)/sizeof(struct function));
+	for(i=0; i<num_functions; i++) {
+		if(!strcmp(name, function_table[i].name))
+			return &function_table[i];
+	}
+	return NULL;
+}
+
+#define MAX_BATCH_ARGS 64
+
+/* number of connections to spread batch operations over (-j) */
+int jobs=1;
+
+/* split a batch line into whitespace separated words in place.
+	words may be quoted with ' or " and a backslash escapes the
+	next character.  returns the number of words or -1 if there
+	are too many or a quote is left open */
+int split_line(char *line, char **words, int max_words) {
+	char *in, *out;
+	char quote;
+	int num_words=0;
+
+	in=line;
+	while(1) {
+		while(*in==' '||*in=='\t'||*in=='\r'||*in=='\n') in++;
+		if(*in=='\0') break;
+		if(num_words==max_words) return -1;
+
+		words[num_words++]=out=in;
+		quote='\0';
+		while(*in!='\0') {
+			if(*in=='\\' && in[1]!='\0') {
+				in++;
+				*out++=*in++;
+			} else if(quote) {
+				if(*in==quote) {
+					quote='\0';
+					in++;
+				} else *out++=*in++;
+			} else if(*in=='"'||*in=='\'') {
+				quote=*in++;
+			} else if(*in==' '||*in=='\t'||*in=='\r'||*in=='\n') {
+				in++;
+				break;
+			} else *out++=*in++;
+		}
+		if(quote) return -1;
+		*out='\0';
+	}
+	words[num_words]=NULL;
+	return num_words;
+}
+
+/* parse one batch line.  returns 1 with words and function filled in,
+	0 for a blank or comment line, or -1 after reporting an error */
+int batch_parse(char *line, char **words, struct function **function,
+		char *filename, int line_number) {
+	int num_words;
+
+	num_words=split_line(line, words, MAX_BATCH_ARGS);
+	if(num_words<0) {
+		fprintf(stderr, "%s:%d: error: unbalanced quotes or too many arguments\n", filename, line_number);
+		return -1;
+	}
+	if(num_words==0||words[0][0]=='#') return 0;
+
+	*function=find_function(words[0]);
+	if(*function==NULL||(*function)->operation==batch) {
+		fprintf(stderr, "%s:%d: error: unknown operation %s\n", filename, line_number, words[0]);
+		return -1;
+	}
+	if(num_words-1<(*function)->num_args) {
+		fprintf(stderr, "%s:%d: error: %s needs %d arguments\n", filename, line_number, words[0], (*function)->num_args);
+		return -1;
+	}
+	return 1;
+}
+
+/* run a parsed batch line, returns 0 on success */
+int batch_run(struct function *function, char **words,
+		char *filename, int line_number) {
+	if((*function->operation)(words+1)!=0) {
+		fprintf(stderr, "%s:%d: %s failed\n", filename, line_number, words[0]);
+		return 1;
+	}
+	return 0;
+}
+
+/* a batch line waiting to be run by a parallel batch */
+struct batch_op {
+	int line_number;
+	char *line;
+	char *words[MAX_BATCH_ARGS+1];
+	struct function *function;
+	int set;
+	struct batch_op *next;
+};
+
+/* all the operations on a group of objects, in file order.  a strand is
+	only ever run by one worker so its operations can't overtake each
+	other */
+struct batch_strand {
+	struct batch_op *first;
+	struct batch_op *last;
+};
+
+/* an object named in a batch, and the set of objects it must be kept in
+	order with */
+struct batch_key {
+	char *key;
+	int set;
+	struct batch_key *next;
+};
+
+/* each worker takes strands from the front of its own queue and, once
+	that is empty, steals from the back of the others' */
+struct batch_queue {
+	pthread_mutex_t lock;
+	struct batch_strand **strands;
+	int head;
+	int tail;
+};
+
+struct batch_workers {
+	struct batch_queue *queues;
+	int num_workers;
+	char *filename;
+	pthread_mutex_t lock;
+	int failures;
 };
 
+struct batch_worker {
+	struct batch_workers *workers;
+	int index;
+};
+
+struct batch_strand *batch_take(struct batch_workers *workers, int index) {
+	struct batch_queue *queue;
+	struct batch_strand *strand=NULL;
+	int i;
+
+	queue=&workers->queues[index];
+	pthread_mutex_lock(&queue->lock);
+	if(queue->head<queue->tail) strand=queue->strands[queue->head++];
+	pthread_mutex_unlock(&queue->lock);
+
+	for(i=1; strand==NULL && i<workers->num_workers; i++) {
+		queue=&workers->queues[(index+i)%workers->num_workers];
+		pthread_mutex_lock(&queue->lock);
+		if(queue->head<queue->tail) strand=queue->strands[--queue->tail];
+		pthread_mutex_unlock(&queue->lock);
+	}
+	return strand;
+}
+
+void *batch_worker(void *data) {
+	struct batch_worker *worker=data;
+	struct batch_workers *workers=worker->workers;
+	struct batch_strand *strand;
+	struct batch_op *op;
+	int failures=0;
+
+	if(ad_pool_checkout()!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		pthread_mutex_lock(&workers->lock);
+		workers->failures++;
+		pthread_mutex_unlock(&workers->lock);
+		return NULL;
+	}
+
+	while((strand=batch_take(workers, worker->index))!=NULL) {
+		for(op=strand->first; op!=NULL; op=op->next) {
+			failures+=batch_run(op->function, op->words,
+				workers->filename, op->line_number);
+		}
+	}
+	fflush(stdout);
+	ad_pool_checkin();
+
+	pthread_mutex_lock(&workers->lock);
+	workers->failures+=failures;
+	pthread_mutex_unlock(&workers->lock);
+	return NULL;
+}
+
+unsigned int batch_hash(char *key) {
+	unsigned int hash=5381;
+
+	while(*key) hash=hash*33+tolower((unsigned char)*key++);
+	return hash;
+}
+
+int batch_find(int *sets, int set) {
+	while(sets[set]!=set) set=sets[set]=sets[sets[set]];
+	return set;
+}
+
+/* the set holding key, starting a new one if key hasn't been seen */
+int batch_key_set(struct batch_key **keys, int num_buckets, char *key,
+		int *sets, int *num_sets) {
+	struct batch_key *entry;
+	int i;
+
+	i=batch_hash(key)&(num_buckets-1);
+	for(entry=keys[i]; entry!=NULL; entry=entry->next) {
+		if(!strcasecmp(entry->key, key)) return entry->set;
+	}
+	entry=malloc(sizeof(struct batch_key));
+	entry->key=key;
+	entry->set=*num_sets;
+	entry->next=keys[i];
+	keys[i]=entry;
+	sets[*num_sets]=*num_sets;
+	return (*num_sets)++;
+}
+
+/* run a batch across jobs connections.  the whole file is read first
+	and its lines grouped by the objects they work on, their first
+	argument and for operations like groupadduser their second, so
+	that operations on one object stay in order.  operations sharing
+	any object are grouped together, so groupadduser staff alice
+	runs in order with both the other operations on staff and those
+	on alice */
+int batch_parallel(FILE *batch_fd, char *filename) {
+	char *line=NULL;
+	size_t line_size=0;
+	int line_number=0, failures=0, parsed;
+	struct batch_op *op, *ops=NULL, *last_op=NULL;
+	int num_ops=0, num_strands=0, num_buckets, num_sets=0, i, set;
+	struct batch_strand **strands, **set_strands, *strand;
+	struct batch_key **keys, *entry;
+	struct batch_queue *queue;
+	struct batch_workers workers;
+	struct batch_worker *worker;
+	pthread_t *threads;
+	int *sets;
+
+	while(getline(&line, &line_size, batch_fd)!=-1) {
+		line_number++;
+		op=malloc(sizeof(struct batch_op));
+		op->line_number=line_number;
+		op->line=strdup(line);
+		op->next=NULL;
+		parsed=batch_parse(op->line, op->words, &op->function,
+				filename, line_number);
+		if(parsed<=0) {
+			if(parsed<0) failures++;
+			free(op->line);
+			free(op);
+			continue;
+		}
+		if(last_op==NULL) ops=op;
+		else last_op->next=op;
+		last_op=op;
+		num_ops++;
+	}
+	free(line);
+
+	/* join the sets of the objects each operation names */
+	for(num_buckets=64; num_buckets<num_ops*4; num_buckets*=2);
+	keys=calloc(num_buckets, sizeof(struct batch_key *));
+	sets=malloc(sizeof(int)*(num_ops*2+1));
+	for(op=ops; op!=NULL; op=op->next) {
+		op->set=batch_key_set(keys, num_buckets,
+			op->words[1]?op->words[1]:"", sets, &num_sets);
+		if(op->function->second_object && op->words[1]!=NULL
+				&& op->words[2]!=NULL) {
+			set=batch_key_set(keys, num_buckets, op->words[2],
+				sets, &num_sets);
+			sets[batch_find(sets, set)]=batch_find(sets, op->set);
+		}
+	}
+
+	/* a strand for each set, made in the order of their first lines
+		so early lines tend to run first */
+	strands=malloc(sizeof(struct batch_strand *)*(num_sets+1));
+	set_strands=calloc(num_sets+1, sizeof(struct batch_strand *));
+	while(ops!=NULL) {
+		op=ops;
+		ops=op->next;
+		op->next=NULL;
+
+		set=batch_find(sets, op->set);
+		strand=set_strands[set];
+		if(strand==NULL) {
+			strand=malloc(sizeof(struct batch_strand));
+			strand->first=op;
+			set_strands[set]=strand;
+			strands[num_strands++]=strand;
+		} else {
+			strand->last->next=op;
+		}
+		strand->last=op;
+	}
+	for(i=0; i<num_buckets; i++) {
+		while(keys[i]!=NULL) {
+			entry=keys[i];
+			keys[i]=entry->next;
+			free(entry);
+		}
+	}
+	free(keys);
+	free(sets);
+	free(set_strands);
+
+	/* deal the strands out to the workers in file order */
+	workers.num_workers=jobs;
+	workers.filename=filename;
+	workers.failures=0;
+	pthread_mutex_init(&workers.lock, NULL);
+	workers.queues=malloc(sizeof(struct batch_queue)*jobs);
+	for(i=0; i<jobs; i++) {
+		pthread_mutex_init(&workers.queues[i].lock, NULL);
+		workers.queues[i].strands=malloc(sizeof(struct batch_strand *)*(num_strands/jobs+1));
+		workers.queues[i].head=0;
+		workers.queues[i].tail=0;
+	}
+	for(i=0; i<num_strands; i++) {
+		queue=&workers.queues[i%jobs];
+		queue->strands[queue->tail++]=strands[i];
+	}
+
+	if(ad_pool_init(jobs)!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+
+	threads=malloc(sizeof(pthread_t)*jobs);
+	worker=malloc(sizeof(struct batch_worker)*jobs);
+	for(i=0; i<jobs; i++) {
+		worker[i].workers=&workers;
+		worker[i].index=i;
+		pthread_create(&threads[i], NULL, batch_worker, &worker[i]);
+	}
+	for(i=0; i<jobs; i++) pthread_join(threads[i], NULL);
+	ad_pool_destroy();
+
+	for(i=0; i<num_strands; i++) {
+		while(strands[i]->first!=NULL) {
+			op=strands[i]->first;
+			strands[i]->first=op->next;
+			free(op->line);
+			free(op);
+		}
+		free(strands[i]);
+	}
+	for(i=0; i<jobs; i++) {
+		free(workers.queues[i].strands);
+		pthread_mutex_destroy(&workers.queues[i].lock);
+	}
+	free(workers.queues);
+	free(strands);
+	free(threads);
+	free(worker);
+
+	return (failures+workers.failures)?1:0;
+}
+
+/* run operations read one per line from a file or standard input.
+	every operation shares the connection held by ad_login(),
+	so the server is only bound to once per batch.  failures are
+	reported against their line number and don't stop the run.
+	with -j the operations are spread over several connections */
+int batch(char **argv) {
+	FILE *batch_fd;
+	char *filename;
+	char *line=NULL;
+	size_t line_size=0;
+	char *words[MAX_BATCH_ARGS+1];
+	int line_number=0, failures=0, parsed;
+	struct function *function;
+
+	filename=argv[0];
+	if(filename==NULL||!strcmp(filename, "-")) {
+		filename="standard input";
+		batch_fd=stdin;
+	} else {
+		batch_fd=fopen(filename, "r");
+		if(batch_fd==NULL) {
+			fprintf(stderr, "error: couldn't open batch file %s\n", filename);
+			return 1;
+		}
+	}
+
+	if(jobs>1) {
+		failures=batch_parallel(batch_fd, filename);
+		if(batch_fd!=stdin) fclose(batch_fd);
+		return failures;
+	}
+
+	while(getline(&line, &line_size, batch_fd)!=-1) {
+		line_number++;
+
+		parsed=batch_parse(line, words, &function, filename, line_number);
+		if(parsed<0) failures++;
+		if(parsed<=0) continue;
+
+		failures+=batch_run(function, words, filename, line_number);
+		fflush(stdout);
+	}
+
+	free(line);
+	if(batch_fd!=stdin) fclose(batch_fd);
+	return failures?1:0;
+}
+
+/* run an operation for adtoold, as main would */
+int run_operation(char **argv) {
+	struct function *function;
+	int count;
+
+	for(count=0; argv[count]!=NULL; count++);
+	function=find_function(argv[0]);
+	if(function==NULL || count-1<function->num_args) {
+		usage();
+		return 1;
+	}
+	return (*function->operation)(argv+1);
+}
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+#define STATS_HISTOGRAM 3
+
+/* report the library's counts and timings on stderr, see --stats */
+void print_stats(int format, struct timespec *start) {
+	ad_stats s;
+	struct ad_op_stats *op;
+	struct timespec now;
+	char *phases[AD_PHASES]={"config", "connect", "tls", "bind"};
+	long long round_trips=0;
+	double wall;
+	int i, first=1;
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wall=(now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1e9;
+	ad_stats_get(&s);
+	for(i=0; i<AD_OP_KINDS; i++) round_trips+=s.ops[i].round_trips;
+
+	if(format==STATS_JSON) {
+		fprintf(stderr, "{\"wall\":%.6f,\"phases\":{", wall);
+		for(i=0; i<AD_PHASES; i++)
+			fprintf(stderr, "%s\"%s\":%.6f", i?",":"", phases[i],
+				s.phase_seconds[i]);
+		fprintf(stderr, "},\"connections\":%d,"
+			"\"tls\":{\"connections\":%d,\"resumed\":%d},"
+			"\"operations\":{",
+			s.connections, s.tls_connections, s.tls_resumed);
+		for(i=0; i<AD_OP_KINDS; i++) {
+			op=&s.ops[i];
+			if(!op->count) continue;
+			fprintf(stderr, "%s\"%s\":{\"count\":%lld,\"failed\":%lld,"
+				"\"round_trips\":%lld,\"entries\":%lld,"
+				"\"bytes\":%lld,\"seconds\":%.6f}",
+				first?"":",", ad_op_name(i), op->count, op->failed,
+				op->round_trips, op->entries, op->bytes, op->seconds);
+			first=0;
+		}
+		fprintf(stderr, "},\"round_trips\":%lld,"
+			"\"resolve\":{\"searches\":%lld,\"cached\":%lld},"
+			"\"bytes\":{\"sent\":%lld,\"received\":%lld}}\n",
+			round_trips, s.resolve_searches, s.resolve_cached,
+			s.bytes_sent, s.bytes_received);
+		return;
+	}
+
+	fprintf(stderr, "wall: %.6fs\n", wall);
+	fprintf(stderr, "setup:");
+	for(i=0; i<AD_PHASES; i++)
+		fprintf(stderr, "%s %s %.6fs", i?",":"", phases[i],
+			s.phase_seconds[i]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "connections: %d\n", s.connections);
+	fprintf(stderr, "tls: %d connections, %d resumed\n",
+		s.tls_connections, s.tls_resumed);
+	for(i=0; i<AD_OP_KINDS; i++) {
+		op=&s.ops[i];
+		if(!op->count) continue;
+		fprintf(stderr, "%s: %lld operations, %lld failed, "
+			"%lld round trips, %lld entries, %lld bytes, %.6fs\n",
+			ad_op_name(i), op->count, op->failed, op->round_trips,
+			op->entries, op->bytes, op->seconds);
+	}
+	fprintf(stderr, "round trips: %lld\n", round_trips);
+	fprintf(stderr, "resolve: %lld searches, %lld cached\n",
+		s.resolve_searches, s.resolve_cached);
+	fprintf(stderr, "bytes: %lld sent, %lld received\n",
+		s.bytes_sent, s.bytes_received);
+}
+
 int main(int argc, char **argv) {
-	int c, i;
+	int c, status;
 	int print_help=0;
 	int print_version=0;
-	char *operation_name;
-	void (*operation)(char **);
-	int num_functions;
-	int num_args;
-
-	while((c=getopt(argc, argv, "hvH:D:w:b:"))!=-1) {
+	int forward=1;
+	int stats_format=0;
+	char *name, *format;
+	struct function *function;
+	struct timespec start;
+	ad_histogram *histogram=NULL;
+	struct option long_options[]={
+		{"stats", optional_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* adtoold is adtool run under that name */
+	name=strrchr(argv[0], '/');
+	name=(name!=NULL)?name+1:argv[0];
+	if(!strcmp(name, "adtoold"))
+		exit(daemon_main(argc, argv, run_operation));
+
+	/* stop at the operation so that attributeset's "-attr" changes
+		are not taken for options */
+	format=getenv("ADTOOL_STATS");
+	while((c=getopt_long(argc, argv, "+hvH:D:w:b:j:", long_options, NULL))!=-1) {
 		switch(c) {
 			case 'h':
 				print_help=1;
@@ -657,19 +2419,44 @@ int main(int argc, char **argv) {
 				break;
 			case 'H':
 				uri=strdup(optarg);
+				forward=0;
 				break;
 			case 'D':
 				binddn=strdup(optarg);
+				forward=0;
 				break;
 			case 'w':
 				bindpw=strdup(optarg);
 				memset(optarg, 0, strlen(optarg));
+				forward=0;
 				break;
 			case 'b':
 				search_base=strdup(optarg);
+				break;
+			case 'j':
+				jobs=atoi(optarg);
+				if(jobs<1) jobs=1;
+				forward=0;
+				break;
+			case 's':
+				format=optarg?optarg:"text";
+				break;
 		}
 	}
 
+	/* the numbers are this process's, so the operation isn't
+		handed to adtoold */
+	if(format!=NULL && !strcasecmp(format, "histogram")) {
+		stats_format=STATS_HISTOGRAM;
+		histogram=ad_histogram_new();
+		ad_set_observer(ad_histogram_observer, histogram);
+		forward=0;
+	} else if(format!=NULL) {
+		stats_format=strcasecmp(format, "json")?STATS_TEXT:STATS_JSON;
+		ad_stats_enable();
+		forward=0;
+	}
+
 	if(print_version) {
 		printf("adtool version %s\n"
 				"http://gp2x.org/adtool/\n"
@@ -683,22 +2470,22 @@ int main(int argc, char **argv) {
 		exit(0);
 	}
 
-	operation_name=argv[optind];
-	num_functions=(sizeof(function_table)/sizeof(struct function));
-	num_args=0;
-	operation=NULL;
-
-	for(i=0; i<num_functions; i++) {
-		if(!strcmp(operation_name, function_table[i].name)) {
-			operation=function_table[i].operation;
-			num_args=function_table[i].num_args;
-			break;
+	function=find_function(argv[optind]);
+	if(function!=NULL && (argc-(optind+1))>=function->num_args) {
+		/* hand the operation to adtoold if one is running, unless
+			the connection options say to use another server.
+			watch runs until killed and would hold a worker */
+		if(forward && function->operation!=watch
+				&& daemon_forward(daemon_socket(), argv+optind, &status)==0)
+			exit(status);
+		status=(*function->operation)(argv+optind+1);
+		if(stats_format==STATS_HISTOGRAM) {
+			fflush(stdout);
+			ad_histogram_dump(histogram, stderr);
+		} else if(stats_format) {
+			print_stats(stats_format, &start);
 		}
-	}
-
-	if(operation!=NULL && (argc-(optind+1))>=num_args) {
-		(*operation)(argv+optind+1);
-		exit(0);
+		exit(status);
 	}
 
 	usage();
@@ -0,0 +1,551 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* daemon.c
+ * adtoold and the client side of its protocol
+ *
+ * The daemon listens on a unix domain socket and leaves a number of
+ * worker processes accepting from it.  Each worker holds one bound
+ * connection and runs requests one at a time in process, so a request
+ * costs no process start, config parsing, TLS handshake or bind.
+ *
+ * Messages are frames of a four byte big endian length, a type byte
+ * and the payload, the length counting the type and payload.  A
+ * request is
+ *	'R' cwd \0 searchbase \0 operation \0 argument \0 ...
+ * sent with the client's standard input, output and error attached.
+ * The worker runs the operation with those as its own, so output goes
+ * straight to the client, and answers with
+ *	'S' status
+ * where status is the exit status as four big endian bytes. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+/* for struct ucred */
+#define _GNU_SOURCE 1
+
+#include "daemon.h"
+#include "active_directory.h"
+
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define FRAME_REQUEST 'R'
+#define FRAME_STATUS 'S'
+#define FRAME_HEADER 5
+
+volatile sig_atomic_t daemon_stopping=0;
+
+void daemon_put_int(unsigned char *buffer, unsigned int value) {
+	buffer[0]=value>>24;
+	buffer[1]=value>>16;
+	buffer[2]=value>>8;
+	buffer[3]=value;
+}
+
+unsigned int daemon_get_int(unsigned char *buffer) {
+	return ((unsigned int)buffer[0]<<24)|(buffer[1]<<16)
+		|(buffer[2]<<8)|buffer[3];
+}
+
+/* read or write all of length bytes.  return 0, or -1 on error or end
+	of file */
+int daemon_read(int fd, void *buffer, int length) {
+	int done, result;
+
+	for(done=0; done<length; done+=result) {
+		result=read(fd, (char *)buffer+done, length-done);
+		if(result<0 && errno==EINTR) result=0;
+		else if(result<=0) return -1;
+	}
+	return 0;
+}
+
+int daemon_write(int fd, void *buffer, int length) {
+	int done, result;
+
+	for(done=0; done<length; done+=result) {
+		result=send(fd, (char *)buffer+done, length-done, MSG_NOSIGNAL);
+		if(result<0 && errno==EINTR) result=0;
+		else if(result<0) return -1;
+	}
+	return 0;
+}
+
+int daemon_address(char *socket_path, struct sockaddr_un *address) {
+	if(strlen(socket_path)>=sizeof(address->sun_path)) return -1;
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family=AF_UNIX;
+	strcpy(address->sun_path, socket_path);
+	return 0;
+}
+
+char *daemon_socket() {
+	char *path, *home;
+	int path_length;
+
+	/* an empty ADTOOL_SOCKET keeps adtool from using the daemon */
+	path=getenv("ADTOOL_SOCKET");
+	if(path!=NULL) return path[0]!='\0'?path:NULL;
+
+	home=getenv("HOME");
+	if(home==NULL) return NULL;
+	path_length=strlen(home)+strlen("/.adtool.sock")+1;
+	path=malloc(path_length);
+	snprintf(path, path_length, "%s/.adtool.sock", home);
+	return path;
+}
+
+/* client side */
+
+int daemon_forward(char *socket_path, char **argv, int *status) {
+	struct sockaddr_un address;
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	char control_buffer[CMSG_SPACE(sizeof(int)*3)];
+	int fds[3]={0, 1, 2};
+	unsigned char reply[FRAME_HEADER+4];
+	char cwd[PATH_MAX];
+	char *base;
+	char *frame, *end;
+	int fd, i, length, sent;
+
+	if(socket_path==NULL || daemon_address(socket_path, &address)<0)
+		return -1;
+	if(getcwd(cwd, sizeof(cwd))==NULL) return -1;
+	base=(search_base!=NULL)?search_base:"";
+
+	length=1+strlen(cwd)+1+strlen(base)+1;
+	for(i=0; argv[i]!=NULL; i++) length+=strlen(argv[i])+1;
+	if(length>DAEMON_MAX_FRAME) return -1;
+
+	fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd<0) return -1;
+	if(connect(fd, (struct sockaddr *)&address, sizeof(address))<0) {
+		close(fd);
+		return -1;
+	}
+
+	frame=malloc(length+4);
+	daemon_put_int((unsigned char *)frame, length);
+	frame[4]=FRAME_REQUEST;
+	end=frame+FRAME_HEADER;
+	end+=sprintf(end, "%s", cwd)+1;
+	end+=sprintf(end, "%s", base)+1;
+	for(i=0; argv[i]!=NULL; i++) end+=sprintf(end, "%s", argv[i])+1;
+
+	/* the descriptors go with the first part of the frame */
+	memset(&message, 0, sizeof(message));
+	iov.iov_base=frame;
+	iov.iov_len=length+4;
+	message.msg_iov=&iov;
+	message.msg_iovlen=1;
+	message.msg_control=control_buffer;
+	message.msg_controllen=sizeof(control_buffer);
+	control=CMSG_FIRSTHDR(&message);
+	control->cmsg_level=SOL_SOCKET;
+	control->cmsg_type=SCM_RIGHTS;
+	control->cmsg_len=CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(control), fds, sizeof(fds));
+
+	/* the daemon does nothing with a request it didn't get all of,
+		so on failure here the operation can still be run locally */
+	sent=sendmsg(fd, &message, MSG_NOSIGNAL);
+	if(sent<0 || (sent<length+4
+			&& daemon_write(fd, frame+sent, length+4-sent)<0)) {
+		free(frame);
+		close(fd);
+		return -1;
+	}
+	free(frame);
+
+	if(daemon_read(fd, reply, sizeof(reply))<0
+			|| daemon_get_int(reply)!=FRAME_HEADER
+			|| reply[4]!=FRAME_STATUS) {
+		fprintf(stderr, "error: lost connection to adtoold\n");
+		*status=1;
+	} else {
+		*status=daemon_get_int(reply+FRAME_HEADER);
+	}
+	close(fd);
+	return 0;
+}
+
+/* daemon side */
+
+/* read a request and the descriptors sent with it.  returns the
+	payload, nul terminated, with its length in length, or NULL */
+char *daemon_receive(int client, int *fds, int *length) {
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	char control_buffer[CMSG_SPACE(sizeof(int)*3)];
+	unsigned char header[FRAME_HEADER];
+	char *payload;
+	int received, count;
+
+	memset(&message, 0, sizeof(message));
+	iov.iov_base=header;
+	iov.iov_len=sizeof(header);
+	message.msg_iov=&iov;
+	message.msg_iovlen=1;
+	message.msg_control=control_buffer;
+	message.msg_controllen=sizeof(control_buffer);
+
+	received=recvmsg(client, &message, 0);
+	if(received<=0) return NULL;
+	for(control=CMSG_FIRSTHDR(&message); control!=NULL;
+			control=CMSG_NXTHDR(&message, control)) {
+		if(control->cmsg_level!=SOL_SOCKET
+				|| control->cmsg_type!=SCM_RIGHTS)
+			continue;
+		count=(control->cmsg_len-CMSG_LEN(0))/sizeof(int);
+		if(count>3) count=3;
+		memcpy(fds, CMSG_DATA(control), sizeof(int)*count);
+	}
+
+	if(received<FRAME_HEADER && daemon_read(client,
+			header+received, FRAME_HEADER-received)<0)
+		return NULL;
+	*length=daemon_get_int(header)-1;
+	if(header[4]!=FRAME_REQUEST || *length<0
+			|| *length>=DAEMON_MAX_FRAME)
+		return NULL;
+
+	payload=malloc(*length+1);
+	if(daemon_read(client, payload, *length)<0) {
+		free(payload);
+		return NULL;
+	}
+	payload[*length]='\0';
+	return payload;
+}
+
+/* run one request with the client's descriptors in place of our own */
+void daemon_serve(int client, int *saved_fds, daemon_operation operation) {
+	int fds[3]={-1, -1, -1};
+	unsigned char reply[FRAME_HEADER+4];
+	char **argv;
+	char *payload, *cwd, *base, *saved_base;
+	int i, count, length, status;
+
+	payload=daemon_receive(client, fds, &length);
+	if(payload==NULL || fds[0]<0 || fds[1]<0 || fds[2]<0) {
+		for(i=0; i<3; i++) if(fds[i]>=0) close(fds[i]);
+		if(payload!=NULL) free(payload);
+		return;
+	}
+
+	/* split the payload into cwd, searchbase and arguments */
+	for(count=0, i=0; i<length; i++) {
+		if(payload[i]=='\0') count++;
+	}
+	argv=malloc(sizeof(char *)*(count+1));
+	for(count=0, i=0; i<length; i+=strlen(payload+i)+1)
+		argv[count++]=payload+i;
+	argv[count]=NULL;
+
+	status=1;
+	if(count>=3) {
+		cwd=argv[0];
+		base=argv[1];
+		saved_base=search_base;
+		if(base[0]!='\0') search_base=base;
+
+		for(i=0; i<3; i++) dup2(fds[i], i);
+		clearerr(stdin);
+		if(chdir(cwd)<0) {
+			fprintf(stderr, "error: adtoold can't change to %s: %s\n",
+				cwd, strerror(errno));
+		} else if(ad_pool_checkout()!=AD_SUCCESS) {
+			fprintf(stderr, "error: %s\n", ad_get_error());
+		} else {
+			status=operation(argv+2);
+			ad_pool_checkin();
+		}
+
+		/* leave nothing of this client in the stdio buffers */
+		fflush(stdout);
+		fflush(stderr);
+		__fpurge(stdin);
+		clearerr(stdin);
+		clearerr(stdout);
+		clearerr(stderr);
+		for(i=0; i<3; i++) dup2(saved_fds[i], i);
+		if(chdir("/")<0) status=1;
+		search_base=saved_base;
+	}
+
+	for(i=0; i<3; i++) close(fds[i]);
+	free(argv);
+	free(payload);
+
+	daemon_put_int(reply, FRAME_HEADER);
+	reply[4]=FRAME_STATUS;
+	daemon_put_int(reply+FRAME_HEADER, status);
+	daemon_write(client, reply, sizeof(reply));
+}
+
+/* only the user running the daemon may use its connections */
+int daemon_peer_allowed(int client) {
+#ifdef SO_PEERCRED
+	struct ucred credentials;
+	socklen_t length=sizeof(credentials);
+
+	if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length)<0)
+		return 0;
+	return credentials.uid==getuid();
+#else
+	return 1;
+#endif
+}
+
+int daemon_ignore_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	return 0;
+}
+
+void daemon_worker(int listener, daemon_operation operation) {
+	struct pollfd poller;
+	int saved_fds[3];
+	int i, client, requests=0;
+	time_t last_used;
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	for(i=0; i<3; i++) saved_fds[i]=dup(i);
+
+	if(ad_pool_init(1)!=AD_SUCCESS) {
+		fprintf(stderr, "adtoold: %s\n", ad_get_error());
+		exit(1);
+	}
+	last_used=time(NULL);
+
+	while(requests<DAEMON_REQUESTS) {
+		poller.fd=listener;
+		poller.events=POLLIN;
+		poll(&poller, 1, DAEMON_KEEPALIVE*1000);
+
+		/* the server drops idle connections, so read the root dse
+			now and then.  a connection found dropped is reopened
+			on the next checkout, or if that fails the next time
+			round */
+		if(time(NULL)-last_used>=DAEMON_KEEPALIVE) {
+			if(ad_pool_checkout()==AD_SUCCESS) {
+				ad_search_each("", LDAP_SCOPE_BASE, "(objectclass=*)",
+					NULL, daemon_ignore_entry, NULL);
+				ad_pool_checkin();
+			}
+			last_used=time(NULL);
+		}
+
+		/* every worker wakes for a connection but only one gets it */
+		client=accept(listener, NULL, NULL);
+		if(client<0) continue;
+		if(daemon_peer_allowed(client)) {
+			daemon_serve(client, saved_fds, operation);
+			requests++;
+			last_used=time(NULL);
+		}
+		close(client);
+	}
+
+	ad_pool_destroy();
+	exit(0);
+}
+
+pid_t daemon_start_worker(int listener, daemon_operation operation) {
+	pid_t pid;
+
+	pid=fork();
+	if(pid==0) daemon_worker(listener, operation);
+	return pid;
+}
+
+int daemon_listen(char *socket_path) {
+	struct sockaddr_un address;
+	mode_t old_umask;
+	int fd;
+
+	if(daemon_address(socket_path, &address)<0) {
+		fprintf(stderr, "error: socket path %s is too long\n", socket_path);
+		return -1;
+	}
+
+	/* don't take the socket over from a daemon that's running */
+	fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd<0) {
+		fprintf(stderr, "error: socket: %s\n", strerror(errno));
+		return -1;
+	}
+	if(connect(fd, (struct sockaddr *)&address, sizeof(address))==0) {
+		fprintf(stderr, "error: adtoold is already running on %s\n", socket_path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	unlink(socket_path);
+
+	fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	old_umask=umask(077);
+	if(fd<0 || bind(fd, (struct sockaddr *)&address, sizeof(address))<0
+			|| listen(fd, 64)<0) {
+		umask(old_umask);
+		fprintf(stderr, "error: can't listen on %s: %s\n",
+			socket_path, strerror(errno));
+		if(fd>=0) close(fd);
+		return -1;
+	}
+	umask(old_umask);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+void daemon_stop(int signal_number) {
+	daemon_stopping=1;
+}
+
+void daemon_usage() {
+	printf(
+		"usage:\n"
+		"adtoold [connection options] [-j workers] [-s socket] [-F]\n"
+		"\n"
+		"options:\n"
+		"-h		print this help text\n"
+		"-H uri         server uri, eg. ldaps://ad1.example.com\n"
+		"-D binddn      dn to bind to server with\n"
+		"-w password    password to bind to server with\n"
+		"-b basedn      base for operations that involve searches\n"
+		"-j workers     number of workers, each with its own connection (default %d)\n"
+		"-s socket      socket to listen on, instead of $ADTOOL_SOCKET or ~/.adtool.sock\n"
+		"-F             stay in the foreground\n",
+		DAEMON_WORKERS);
+}
+
+int daemon_main(int argc, char **argv, daemon_operation operation) {
+	struct sigaction action;
+	char *socket_path;
+	pid_t *pids, pid;
+	int c, i, listener, status, null_fd;
+	int workers=DAEMON_WORKERS, foreground=0;
+
+	socket_path=daemon_socket();
+	while((c=getopt(argc, argv, "hH:D:w:b:j:s:F"))!=-1) {
+		switch(c) {
+			case 'H':
+				uri=strdup(optarg);
+				break;
+			case 'D':
+				binddn=strdup(optarg);
+				break;
+			case 'w':
+				bindpw=strdup(optarg);
+				memset(optarg, 0, strlen(optarg));
+				break;
+			case 'b':
+				search_base=strdup(optarg);
+				break;
+			case 'j':
+				workers=atoi(optarg);
+				if(workers<1) workers=1;
+				break;
+			case 's':
+				socket_path=optarg;
+				break;
+			case 'F':
+				foreground=1;
+				break;
+			default:
+				daemon_usage();
+				return c!='h';
+		}
+	}
+	if(socket_path==NULL) {
+		fprintf(stderr, "error: no socket to listen on, use -s\n");
+		return 1;
+	}
+
+	/* fail here rather than in every worker if the server can't be
+		reached or the bind is refused */
+	if(ad_pool_init(1)!=AD_SUCCESS) {
+		fprintf(stderr, "error: %s\n", ad_get_error());
+		return 1;
+	}
+	ad_pool_destroy();
+
+	listener=daemon_listen(socket_path);
+	if(listener<0) return 1;
+
+	if(!foreground) {
+		pid=fork();
+		if(pid<0) {
+			fprintf(stderr, "error: fork: %s\n", strerror(errno));
+			return 1;
+		}
+		if(pid>0) return 0;
+		setsid();
+		if(chdir("/")<0) return 1;
+		null_fd=open("/dev/null", O_RDWR);
+		for(i=0; i<3; i++) dup2(null_fd, i);
+		if(null_fd>2) close(null_fd);
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler=daemon_stop;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pids=malloc(sizeof(pid_t)*workers);
+	for(i=0; i<workers; i++) pids[i]=daemon_start_worker(listener, operation);
+
+	/* replace workers as they retire or die */
+	while(!daemon_stopping) {
+		pid=wait(&status);
+		if(pid<0) {
+			if(errno==EINTR) continue;
+			break;
+		}
+		for(i=0; i<workers; i++) {
+			if(pids[i]!=pid) continue;
+			/* don't spin on a server that can't be reached */
+			if(!WIFEXITED(status) || WEXITSTATUS(status)!=0) sleep(1);
+			pids[i]=daemon_stopping?-1:daemon_start_worker(listener, operation);
+		}
+	}
+
+	for(i=0; i<workers; i++) {
+		if(pids[i]>0) kill(pids[i], SIGTERM);
+	}
+	while(wait(NULL)>0);
+	close(listener);
+	unlink(socket_path);
+	free(pids);
+	return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* daemon.h
+ * adtoold, which runs adtool operations over connections it keeps bound */
+
+#ifndef DAEMON_H
+#define DAEMON_H 1
+
+/* worker processes started by default, each with its own connection */
+#define DAEMON_WORKERS 4
+
+/* requests a worker serves before it is replaced, bounding the memory
+	operations leave behind */
+#define DAEMON_REQUESTS 1000
+
+/* seconds a worker's connection may sit idle before it is used to keep
+	the server from dropping it */
+#define DAEMON_KEEPALIVE 300
+
+/* largest request accepted */
+#define DAEMON_MAX_FRAME (1024*1024)
+
+/* runs the operation named by argv[0] with the arguments after it,
+	returning its exit status */
+typedef int (*daemon_operation)(char **argv);
+
+/* daemon_socket() returns the path of the daemon's socket, from
+| $ADTOOL_SOCKET or else ~/.adtool.sock.  NULL if there is none.
+*/
+char *daemon_socket();
+
+/* daemon_forward() asks the daemon listening on socket_path to run an
+| operation, passing it this process's standard input, output and error
+| and working directory, and the searchbase if one was given.
+|  Returns 0 with status set to the operation's exit status, or -1 if
+| no daemon is running, in which case nothing was done.
+*/
+int daemon_forward(char *socket_path, char **argv, int *status);
+
+/* daemon_main() is adtoold.  It checks that it can bind to the server,
+| listens on the socket and leaves workers accepting requests, which
+| each run an operation with operation().
+|  Returns the exit status.
+*/
+int daemon_main(int argc, char **argv, daemon_operation operation);
+
+#endif /* DAEMON_H */
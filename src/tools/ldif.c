@@ -0,0 +1,489 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* ldif.c
+ * reading and writing of LDIF (RFC 2849)
+ *
+ * The reader keeps one physical line of look ahead, which is all that
+ * is needed to unfold continuation lines, so records are read one at a
+ * time whatever the size of the file. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "ldif.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#define LDIF_LINE_WIDTH 76
+
+static char base64_chars[]=
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int ldif_base64_encode(unsigned char *data, int length, char *encoded) {
+	char *out=encoded;
+	int i;
+
+	for(i=0; i+2<length; i+=3) {
+		*out++=base64_chars[data[i]>>2];
+		*out++=base64_chars[((data[i]&0x03)<<4)|(data[i+1]>>4)];
+		*out++=base64_chars[((data[i+1]&0x0f)<<2)|(data[i+2]>>6)];
+		*out++=base64_chars[data[i+2]&0x3f];
+	}
+	if(i<length) {
+		*out++=base64_chars[data[i]>>2];
+		if(i+1<length) {
+			*out++=base64_chars[((data[i]&0x03)<<4)|(data[i+1]>>4)];
+			*out++=base64_chars[(data[i+1]&0x0f)<<2];
+		} else {
+			*out++=base64_chars[(data[i]&0x03)<<4];
+			*out++='=';
+		}
+		*out++='=';
+	}
+	*out='\0';
+	return out-encoded;
+}
+
+/* whether a value can be written as it is (SAFE-STRING in RFC 2849) */
+int ldif_is_safe(unsigned char *value, int length) {
+	int i;
+
+	if(length==0) return 1;
+	if(value[0]==' ' || value[0]==':' || value[0]=='<') return 0;
+	if(value[length-1]==' ') return 0;
+	for(i=0; i<length; i++) {
+		if(value[i]=='\0' || value[i]=='\n' || value[i]=='\r'
+				|| value[i]>=0x80)
+			return 0;
+	}
+	return 1;
+}
+
+/* write text, folding lines longer than LDIF_LINE_WIDTH */
+int ldif_write_folded(output *o, char *text, int length) {
+	int width=LDIF_LINE_WIDTH;
+
+	while(length>width) {
+		if(output_write(o, text, width)<0) return -1;
+		if(output_write(o, "\n ", 2)<0) return -1;
+		text+=width;
+		length-=width;
+		/* continuation lines start with the extra space */
+		width=LDIF_LINE_WIDTH-1;
+	}
+	if(output_write(o, text, length)<0) return -1;
+	return output_write(o, "\n", 1);
+}
+
+/* write one "name: value" or "name:: base64" line */
+int ldif_write_value(output *o, char *name, char *value, int length) {
+	char buffer[1024];
+	char *line=buffer;
+	int name_length, line_length, needed, result;
+
+	name_length=strlen(name);
+	needed=name_length+3+((length+2)/3)*4+1;
+	if(needed>sizeof(buffer)) line=malloc(needed);
+
+	memcpy(line, name, name_length);
+	line_length=name_length;
+	line[line_length++]=':';
+	if(ldif_is_safe((unsigned char *)value, length)) {
+		line[line_length++]=' ';
+		memcpy(line+line_length, value, length);
+		line_length+=length;
+	} else {
+		line[line_length++]=':';
+		line[line_length++]=' ';
+		line_length+=ldif_base64_encode((unsigned char *)value, length, line+line_length);
+	}
+
+	result=ldif_write_folded(o, line, line_length);
+	if(line!=buffer) free(line);
+	return result;
+}
+
+/* writes the rest of a ranged attribute as it arrives */
+struct ldif_range {
+	output *o;
+	char *attribute;
+	int result;
+};
+
+int ldif_range_value(struct berval *value, void *data) {
+	struct ldif_range *range=data;
+
+	range->result=ldif_write_value(range->o, range->attribute,
+		value->bv_val, value->bv_len);
+	return range->result<0;
+}
+
+int ldif_write_entry(output *o, LDAP *ds, LDAPMessage *entry, char *dn) {
+	BerElement *ber;
+	struct berval **values;
+	struct ldif_range range;
+	char *attribute, *option;
+	int i, next, result=0;
+
+	if(ldif_write_value(o, "dn", dn, strlen(dn))<0) return -1;
+
+	for(attribute=ldap_first_attribute(ds, entry, &ber);
+			attribute!=NULL;
+			attribute=ldap_next_attribute(ds, entry, ber)) {
+		/* member;range=0-1499 is written as member, with every value */
+		next=ad_next_range(attribute);
+		for(option=strchr(attribute, ';'); option!=NULL; option=strchr(option+1, ';')) {
+			if(!strncasecmp(option, ";range=", 7)) break;
+		}
+		values=ldap_get_values_len(ds, entry, attribute);
+		if(option!=NULL) *option='\0';
+		if(values!=NULL) {
+			for(i=0; values[i]!=NULL && result==0; i++)
+				result=ldif_write_value(o, attribute,
+					values[i]->bv_val, values[i]->bv_len);
+			ldap_value_free_len(values);
+		}
+		if(next>0 && result==0) {
+			range.o=o;
+			range.attribute=attribute;
+			range.result=0;
+			if(ad_get_range_values(dn, attribute, next, ldif_range_value, &range)!=AD_SUCCESS)
+				result=-1;
+			else result=range.result;
+		}
+		ldap_memfree(attribute);
+		if(result<0) break;
+	}
+	if(ber!=NULL) ber_free(ber, 0);
+	if(result<0) return -1;
+
+	return output_write(o, "\n", 1);
+}
+
+/* reading */
+
+struct ldif_reader {
+	FILE *file;
+	char *line;
+	size_t line_size;
+	int line_length;
+	long offset;
+	long next_offset;
+	int line_number;
+	char *logical;
+	int logical_size;
+	int logical_length;
+	char error[256];
+};
+
+/* read the next physical line, without its line end, into r->line.
+	line_length is -1 at the end of the file */
+void ldif_next_line(ldif_reader *r) {
+	ssize_t length;
+
+	r->offset=r->next_offset;
+	length=getline(&r->line, &r->line_size, r->file);
+	if(length<0) {
+		r->line_length=-1;
+		return;
+	}
+	r->next_offset+=length;
+	r->line_number++;
+	if(length>0 && r->line[length-1]=='\n') length--;
+	if(length>0 && r->line[length-1]=='\r') length--;
+	r->line[length]='\0';
+	r->line_length=length;
+}
+
+void ldif_append_logical(ldif_reader *r, char *text, int length) {
+	if(r->logical_length+length+1>r->logical_size) {
+		r->logical_size=(r->logical_length+length+1)*2;
+		r->logical=realloc(r->logical, r->logical_size);
+	}
+	memcpy(r->logical+r->logical_length, text, length);
+	r->logical_length+=length;
+	r->logical[r->logical_length]='\0';
+}
+
+/* join the current line and its continuation lines into r->logical,
+	leaving the line after them in r->line */
+void ldif_next_logical(ldif_reader *r) {
+	r->logical_length=0;
+	ldif_append_logical(r, r->line, r->line_length);
+	for(;;) {
+		ldif_next_line(r);
+		if(r->line_length<=0 || r->line[0]!=' ') break;
+		ldif_append_logical(r, r->line+1, r->line_length-1);
+	}
+}
+
+ldif_reader *ldif_open(char *filename, long offset) {
+	ldif_reader *r;
+	FILE *file;
+	char buffer[4096];
+	long skip;
+	int length;
+
+	if(!strcmp(filename, "-")) {
+		file=stdin;
+	} else {
+		file=fopen(filename, "r");
+		if(file==NULL) {
+			fprintf(stderr, "error opening %s: %s\n", filename, strerror(errno));
+			return NULL;
+		}
+	}
+
+	/* pipes can't seek, so read up to the offset instead */
+	if(offset>0 && fseek(file, offset, SEEK_SET)<0) {
+		for(skip=offset; skip>0; skip-=length) {
+			length=fread(buffer, 1, (skip<sizeof(buffer))?skip:sizeof(buffer), file);
+			if(length<=0) break;
+		}
+	}
+
+	r=malloc(sizeof(ldif_reader));
+	r->file=file;
+	r->line=NULL;
+	r->line_size=0;
+	r->next_offset=offset;
+	r->line_number=0;
+	r->logical=NULL;
+	r->logical_size=0;
+	r->logical_length=0;
+	r->error[0]='\0';
+	ldif_next_line(r);
+	return r;
+}
+
+void ldif_close(ldif_reader *r) {
+	if(r->file!=stdin) fclose(r->file);
+	free(r->line);
+	free(r->logical);
+	free(r);
+}
+
+char *ldif_error(ldif_reader *r) {
+	return r->error;
+}
+
+/* decode base64 text in place of value, returns the decoded length or
+	-1 if the text isn't valid base64 */
+int ldif_base64_decode(char *text, unsigned char *value) {
+	unsigned int bits=0;
+	int count=0, length=0;
+	char *c;
+
+	for(; *text; text++) {
+		if(*text=='=' || *text==' ') continue;
+		c=strchr(base64_chars, *text);
+		if(c==NULL) return -1;
+		bits=(bits<<6)|(c-base64_chars);
+		count+=6;
+		if(count>=8) {
+			count-=8;
+			value[length++]=(bits>>count)&0xff;
+		}
+	}
+	return length;
+}
+
+/* the contents of a file:// url */
+char *ldif_read_url(ldif_reader *r, char *url, int *length) {
+	FILE *file;
+	char *value;
+	long size;
+
+	if(strncasecmp(url, "file://", 7)) {
+		snprintf(r->error, sizeof(r->error), "unsupported url %s", url);
+		return NULL;
+	}
+	file=fopen(url+7, "r");
+	if(file==NULL) {
+		snprintf(r->error, sizeof(r->error), "can't open %s: %s", url+7, strerror(errno));
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	size=ftell(file);
+	rewind(file);
+	value=malloc(size+1);
+	*length=fread(value, 1, size, file);
+	value[*length]='\0';
+	fclose(file);
+	return value;
+}
+
+/* split the logical line into its attribute name and decoded value */
+int ldif_parse_line(ldif_reader *r, char **name, char **value, int *length) {
+	char *colon, *text;
+
+	colon=strchr(r->logical, ':');
+	if(colon==NULL || colon==r->logical) {
+		snprintf(r->error, sizeof(r->error), "bad line \"%.64s\"", r->logical);
+		return -1;
+	}
+
+	text=colon+1;
+	if(*text==':' || *text=='<') text++;
+	while(*text==' ') text++;
+
+	if(colon[1]==':') {
+		*value=malloc(strlen(text)+1);
+		*length=ldif_base64_decode(text, (unsigned char *)*value);
+		if(*length<0) {
+			snprintf(r->error, sizeof(r->error), "bad base64 value for %.*s", (int)(colon-r->logical), r->logical);
+			free(*value);
+			return -1;
+		}
+		(*value)[*length]='\0';
+	} else if(colon[1]=='<') {
+		*value=ldif_read_url(r, text, length);
+		if(*value==NULL) return -1;
+	} else {
+		*value=strdup(text);
+		*length=strlen(text);
+	}
+
+	*name=malloc(colon-r->logical+1);
+	memcpy(*name, r->logical, colon-r->logical);
+	(*name)[colon-r->logical]='\0';
+	return 0;
+}
+
+void ldif_add_attribute(ldif_record *record, char *name, char *value, int length) {
+	if(record->count==record->size) {
+		record->size=record->size?record->size*2:16;
+		record->attributes=realloc(record->attributes, sizeof(ldif_attribute)*record->size);
+	}
+	record->attributes[record->count].name=name;
+	record->attributes[record->count].value=value;
+	record->attributes[record->count].length=length;
+	record->count++;
+}
+
+void ldif_free_record(ldif_record *record) {
+	int i;
+
+	for(i=0; i<record->count; i++) {
+		free(record->attributes[i].name);
+		if(record->attributes[i].value!=NULL)
+			free(record->attributes[i].value);
+	}
+	if(record->attributes!=NULL) free(record->attributes);
+	if(record->dn!=NULL) free(record->dn);
+	memset(record, 0, sizeof(ldif_record));
+}
+
+int ldif_changetype(char *value) {
+	if(!strcasecmp(value, "add")) return LDIF_ADD;
+	if(!strcasecmp(value, "modify")) return LDIF_MODIFY;
+	if(!strcasecmp(value, "delete")) return LDIF_DELETE;
+	if(!strcasecmp(value, "modrdn") || !strcasecmp(value, "moddn"))
+		return LDIF_MODRDN;
+	return -1;
+}
+
+int ldif_read(ldif_reader *r, ldif_record *record) {
+	char *name, *value;
+	long offset;
+	int length, failed, line_number;
+
+	memset(record, 0, sizeof(ldif_record));
+	r->error[0]='\0';
+
+	for(;;) {
+		/* skip blank lines and comments between records */
+		while(r->line_length==0 || (r->line_length>0 && r->line[0]=='#')) {
+			if(r->line_length==0) ldif_next_line(r);
+			else ldif_next_logical(r);
+		}
+		if(r->line_length<0) return 0;
+
+		record->offset=r->offset;
+		record->line_number=r->line_number;
+		failed=0;
+
+		/* the record runs to the next blank line.  after an error the
+			rest of it is skipped so the next read starts cleanly */
+		while(r->line_length>0) {
+			line_number=r->line_number;
+			ldif_next_logical(r);
+			if(failed || r->logical[0]=='#') continue;
+
+			if(!strcmp(r->logical, "-")) {
+				ldif_add_attribute(record, strdup("-"), NULL, 0);
+				continue;
+			}
+			if(ldif_parse_line(r, &name, &value, &length)<0) {
+				failed=line_number;
+				continue;
+			}
+
+			if(record->dn==NULL) {
+				if(!strcasecmp(name, "version") && record->count==0) {
+					free(name);
+					free(value);
+					continue;
+				}
+				if(strcasecmp(name, "dn")) {
+					snprintf(r->error, sizeof(r->error), "expected dn: but found %s:", name);
+					failed=line_number;
+					free(name);
+					free(value);
+					continue;
+				}
+				record->dn=value;
+				free(name);
+				continue;
+			}
+
+			if(record->count==0 && record->changetype==LDIF_ADD
+					&& !strcasecmp(name, "changetype")) {
+				record->changetype=ldif_changetype(value);
+				if(record->changetype<0) {
+					snprintf(r->error, sizeof(r->error), "unknown changetype %s", value);
+					failed=line_number;
+				}
+				free(name);
+				free(value);
+				continue;
+			}
+			ldif_add_attribute(record, name, value, length);
+		}
+		record->end_offset=r->offset;
+
+		if(failed) {
+			/* put the line number in front of the reason */
+			name=strdup(r->error);
+			snprintf(r->error, sizeof(r->error), "line %d: %s", failed, name);
+			free(name);
+			offset=record->offset;
+			line_number=record->line_number;
+			ldif_free_record(record);
+			/* keep the position so the caller can report it */
+			record->offset=offset;
+			record->end_offset=r->offset;
+			record->line_number=line_number;
+			return -1;
+		}
+		/* a version line on its own isn't a record */
+		if(record->dn!=NULL) return 1;
+		ldif_free_record(record);
+	}
+}
@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* ldif.h
+ * reading and writing of LDIF (RFC 2849) */
+
+#ifndef LDIF_H
+#define LDIF_H 1
+
+#include <active_directory.h>
+#include "output.h"
+
+/* ldif_write_entry() writes a search result entry as an LDIF record.
+|  Values that aren't printable ascii are base64 encoded and long lines
+| are folded.  The rest of an attribute the server returned only a range
+| of values of is fetched, and written under the attribute's own name.
+|  Returns 0, or -1 if writing or fetching values failed.
+*/
+int ldif_write_entry(output *o, LDAP *ds, LDAPMessage *entry, char *dn);
+
+/* ldif_write_value() writes one name: value line, encoded and folded
+| as for ldif_write_entry().
+|  Returns 0, or -1 if writing failed.
+*/
+int ldif_write_value(output *o, char *name, char *value, int length);
+
+/* ldif_base64_encode() encodes length bytes of data into encoded,
+| which must have room for ((length+2)/3)*4+1 bytes.
+|  Returns the encoded length.
+*/
+int ldif_base64_encode(unsigned char *data, int length, char *encoded);
+
+/* a record read from an LDIF file.  changetype is one of the LDIF_
+| values below, records without a changetype are adds.  attributes holds
+| the record's lines after the dn and changetype in order, with values
+| decoded.  In modify records the "-" separator lines appear as
+| attributes named "-" with a NULL value.
+*/
+#define LDIF_ADD 0
+#define LDIF_MODIFY 1
+#define LDIF_DELETE 2
+#define LDIF_MODRDN 3
+
+typedef struct {
+	char *name;
+	char *value;
+	int length;
+} ldif_attribute;
+
+typedef struct {
+	long offset;
+	long end_offset;
+	int line_number;
+	char *dn;
+	int changetype;
+	ldif_attribute *attributes;
+	int count;
+	int size;
+} ldif_record;
+
+typedef struct ldif_reader ldif_reader;
+
+/* ldif_open() opens filename, or standard input if it is "-", for
+| reading records starting at byte offset, which should be the offset of
+| a record reported by an earlier read.
+|  The file is read a line at a time so it can be any size.
+|  Returns NULL with a message on standard error on failure.
+*/
+ldif_reader *ldif_open(char *filename, long offset);
+
+/* ldif_read() reads the next record into record, which is freed with
+| ldif_free_record() when no longer needed.  offset and end_offset are
+| the record's position in the file, so a later ldif_open() at
+| end_offset carries on after it.
+|  Returns 1 if a record was read, 0 at the end of the file or -1 if the
+| record was malformed, with the reason from ldif_error().  Reading can
+| carry on with the next record after an error.
+*/
+int ldif_read(ldif_reader *r, ldif_record *record);
+void ldif_free_record(ldif_record *record);
+char *ldif_error(ldif_reader *r);
+void ldif_close(ldif_reader *r);
+
+#endif /* LDIF_H */
@@ -0,0 +1,261 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* output.c
+ * buffered output written from a separate thread
+ *
+ * The caller fills one chunk at a time.  Full chunks are queued in a
+ * ring which the writer thread empties to the file, or to the pipe of a
+ * compressor running as a child process, so formatting and reading
+ * from the server carry on while earlier data is being compressed and
+ * written.  The caller only waits when every chunk is queued. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct output {
+	int fd;
+	int close_fd;
+	pid_t compressor;
+	char *chunks[OUTPUT_CHUNKS];
+	int lengths[OUTPUT_CHUNKS];
+	int head;
+	int count;
+	int fill;
+	int done;
+	int failed;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t written;
+};
+
+/* write all of a buffer, returns -1 on failure */
+int output_write_fd(int fd, char *data, int length) {
+	int written;
+
+	while(length>0) {
+		written=write(fd, data, length);
+		if(written<0) {
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		data+=written;
+		length-=written;
+	}
+	return 0;
+}
+
+void *output_writer(void *arg) {
+	output *o=arg;
+	int i;
+
+	pthread_mutex_lock(&o->lock);
+	for(;;) {
+		while(o->count==0 && !o->done)
+			pthread_cond_wait(&o->queued, &o->lock);
+		if(o->count==0) break;
+
+		i=o->head;
+		pthread_mutex_unlock(&o->lock);
+		if(!o->failed && output_write_fd(o->fd, o->chunks[i], o->lengths[i])<0) {
+			perror("error writing output");
+			o->failed=1;
+		}
+		pthread_mutex_lock(&o->lock);
+
+		o->lengths[i]=0;
+		o->head=(o->head+1)%OUTPUT_CHUNKS;
+		o->count--;
+		pthread_cond_signal(&o->written);
+	}
+	pthread_mutex_unlock(&o->lock);
+	return NULL;
+}
+
+/* start a compressor writing to fd, returns the fd to write to it */
+int output_compressor(output *o, int fd, char *compressor) {
+	int pipe_fds[2];
+
+	if(pipe(pipe_fds)<0) {
+		perror("error creating pipe");
+		return -1;
+	}
+	o->compressor=fork();
+	if(o->compressor<0) {
+		perror("error starting compressor");
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return -1;
+	}
+	if(o->compressor==0) {
+		dup2(pipe_fds[0], 0);
+		dup2(fd, 1);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		if(fd>1) close(fd);
+		execl("/bin/sh", "sh", "-c", compressor, (char *)NULL);
+		_exit(127);
+	}
+	close(pipe_fds[0]);
+	if(fd>1) close(fd);
+
+	/* a compressor that dies shows up as a failed write */
+	signal(SIGPIPE, SIG_IGN);
+	return pipe_fds[1];
+}
+
+output *output_open(char *filename, char *compressor) {
+	output *o;
+	int fd, i;
+
+	if(filename==NULL || !strcmp(filename, "-")) {
+		fd=1;
+	} else {
+		fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		if(fd<0) {
+			fprintf(stderr, "error opening %s: %s\n", filename, strerror(errno));
+			return NULL;
+		}
+	}
+
+	o=malloc(sizeof(output));
+	o->compressor=0;
+	o->fd=fd;
+	o->close_fd=(fd>1);
+	if(compressor!=NULL) {
+		o->fd=output_compressor(o, fd, compressor);
+		o->close_fd=1;
+		if(o->fd<0) {
+			if(fd>1) close(fd);
+			free(o);
+			return NULL;
+		}
+	}
+
+	for(i=0; i<OUTPUT_CHUNKS; i++) {
+		o->chunks[i]=malloc(OUTPUT_CHUNK_SIZE);
+		o->lengths[i]=0;
+	}
+	o->head=0;
+	o->count=0;
+	o->fill=0;
+	o->done=0;
+	o->failed=0;
+	pthread_mutex_init(&o->lock, NULL);
+	pthread_cond_init(&o->queued, NULL);
+	pthread_cond_init(&o->written, NULL);
+	pthread_create(&o->writer, NULL, output_writer, o);
+	return o;
+}
+
+/* queue the chunk being filled and wait for a free one.  the chunk
+	after the queued ones is always the one being filled */
+void output_submit(output *o) {
+	pthread_mutex_lock(&o->lock);
+	o->count++;
+	o->fill=(o->fill+1)%OUTPUT_CHUNKS;
+	pthread_cond_signal(&o->queued);
+	while(o->count==OUTPUT_CHUNKS)
+		pthread_cond_wait(&o->written, &o->lock);
+	pthread_mutex_unlock(&o->lock);
+}
+
+int output_write(output *o, char *data, int length) {
+	int i, space;
+
+	while(length>0) {
+		i=o->fill;
+		space=OUTPUT_CHUNK_SIZE-o->lengths[i];
+		if(space>length) space=length;
+		memcpy(o->chunks[i]+o->lengths[i], data, space);
+		o->lengths[i]+=space;
+		data+=space;
+		length-=space;
+
+		if(o->lengths[i]==OUTPUT_CHUNK_SIZE) output_submit(o);
+	}
+	return o->failed?-1:0;
+}
+
+int output_flush(output *o) {
+	if(o->lengths[o->fill]>0) output_submit(o);
+	return o->failed?-1:0;
+}
+
+int output_printf(output *o, char *format, ...) {
+	char buffer[1024];
+	char *text;
+	va_list ap;
+	int length, result;
+
+	va_start(ap, format);
+	length=vsnprintf(buffer, sizeof(buffer), format, ap);
+	va_end(ap);
+	if(length<sizeof(buffer))
+		return output_write(o, buffer, length);
+
+	text=malloc(length+1);
+	va_start(ap, format);
+	vsnprintf(text, length+1, format, ap);
+	va_end(ap);
+	result=output_write(o, text, length);
+	free(text);
+	return result;
+}
+
+int output_close(output *o) {
+	int i, status, result;
+
+	pthread_mutex_lock(&o->lock);
+	if(o->lengths[o->fill]>0) o->count++;
+	o->done=1;
+	pthread_cond_signal(&o->queued);
+	pthread_mutex_unlock(&o->lock);
+	pthread_join(o->writer, NULL);
+
+	result=o->failed?-1:0;
+	if(o->close_fd && close(o->fd)<0) {
+		perror("error writing output");
+		result=-1;
+	}
+	if(o->compressor>0) {
+		if(waitpid(o->compressor, &status, 0)<0
+				|| !WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+			fprintf(stderr, "error: compressor failed\n");
+			result=-1;
+		}
+	}
+
+	for(i=0; i<OUTPUT_CHUNKS; i++) free(o->chunks[i]);
+	pthread_mutex_destroy(&o->lock);
+	pthread_cond_destroy(&o->queued);
+	pthread_cond_destroy(&o->written);
+	free(o);
+	return result;
+}
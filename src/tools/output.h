@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* output.h
+ * buffered output for operations that write large amounts of data */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H 1
+
+/* output_open() opens filename for writing, or standard output if
+| filename is NULL or "-".
+|  If compressor isn't NULL it is run through the shell with the output
+| as its standard output, eg. "gzip" or "xz -T0", and the data is piped
+| through it.
+|  Data is collected in large chunks which a separate thread writes
+| out, so a slow disk or compressor doesn't hold up the caller (for
+| example the thread reading from the server) until OUTPUT_CHUNKS
+| chunks are waiting.  Memory use is bounded by that.
+|  Returns NULL with a message on standard error on failure.
+*/
+#define OUTPUT_CHUNK_SIZE 65536
+#define OUTPUT_CHUNKS 16
+
+typedef struct output output;
+
+output *output_open(char *filename, char *compressor);
+
+/* output_write() and output_printf() append to the output.
+|  Return 0, or -1 once a write has failed.
+*/
+int output_write(output *o, char *data, int length);
+int output_printf(output *o, char *format, ...);
+
+/* output_flush() hands what has been written so far to the writer
+| thread, for output that is read as it is produced.
+|  Returns 0, or -1 once a write has failed.
+*/
+int output_flush(output *o);
+
+/* output_close() writes out whatever is left, waits for the writer
+| thread and compressor to finish and frees the output.
+|  Returns 0, or -1 if anything failed to be written.
+*/
+int output_close(output *o);
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,301 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* report.c
+ * tabular reports of search results
+ *
+ * A row's fields are gathered in a scratch buffer which is reused for
+ * every row, then written to the output with the quoting the format
+ * needs, so a report costs no allocation per value. */
+
+#if HAVE_CONFIG_H
+#	include <config.h>
+#endif
+
+#include "report.h"
+#include "ldif.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct report {
+	output *out;
+	int format;
+	char **attrs;
+	char *join;
+	int join_length;
+	int rows;
+	int failed;
+	char *field;
+	int field_length;
+	int field_size;
+};
+
+/* whether a value is utf-8 text without nul characters */
+int report_is_text(unsigned char *value, int length) {
+	int i, extra;
+
+	for(i=0; i<length; i++) {
+		if(value[i]==0) return 0;
+		if(value[i]<0x80) continue;
+		if((value[i]&0xe0)==0xc0) extra=1;
+		else if((value[i]&0xf0)==0xe0) extra=2;
+		else if((value[i]&0xf8)==0xf0) extra=3;
+		else return 0;
+		if(i+extra>=length) return 0;
+		for(; extra>0; extra--)
+			if((value[++i]&0xc0)!=0x80) return 0;
+	}
+	return 1;
+}
+
+void report_append(report *r, char *data, int length) {
+	if(r->field_length+length>r->field_size) {
+		r->field_size=(r->field_length+length)*2;
+		r->field=realloc(r->field, r->field_size);
+	}
+	memcpy(r->field+r->field_length, data, length);
+	r->field_length+=length;
+}
+
+/* put a value in the scratch buffer, base64 encoding binary data */
+void report_value(report *r, struct berval *value) {
+	if(report_is_text((unsigned char *)value->bv_val, value->bv_len)) {
+		report_append(r, value->bv_val, value->bv_len);
+		return;
+	}
+	if(r->field_length+(value->bv_len+2)/3*4+1>r->field_size) {
+		r->field_size=(r->field_length+(value->bv_len+2)/3*4+1)*2;
+		r->field=realloc(r->field, r->field_size);
+	}
+	r->field_length+=ldif_base64_encode((unsigned char *)value->bv_val,
+		value->bv_len, r->field+r->field_length);
+}
+
+void report_write(report *r, char *data, int length) {
+	if(output_write(r->out, data, length)<0) r->failed=1;
+}
+
+/* write data, replacing the characters in special with the matching
+	escape sequences */
+void report_write_escaped(report *r, char *data, int length, char *special, char **escapes) {
+	char *c;
+	int i, start=0;
+
+	for(i=0; i<length; i++) {
+		c=strchr(special, data[i]);
+		if(c==NULL || data[i]=='\0') continue;
+		report_write(r, data+start, i-start);
+		report_write(r, escapes[c-special], strlen(escapes[c-special]));
+		start=i+1;
+	}
+	report_write(r, data+start, length-start);
+}
+
+/* csv fields are quoted when they need to be, doubling quotes */
+char *csv_special="\"";
+char *csv_escapes[]={"\"\""};
+
+void report_csv_field(report *r) {
+	int i, quote=0;
+
+	for(i=0; i<r->field_length; i++) {
+		if(r->field[i]==',' || r->field[i]=='"' || r->field[i]=='\n'
+				|| r->field[i]=='\r') {
+			quote=1;
+			break;
+		}
+	}
+	if(!quote) {
+		report_write(r, r->field, r->field_length);
+		return;
+	}
+	report_write(r, "\"", 1);
+	report_write_escaped(r, r->field, r->field_length, csv_special, csv_escapes);
+	report_write(r, "\"", 1);
+}
+
+/* tsv can't quote, so tabs and line ends are backslash escaped */
+char *tsv_special="\t\n\r\\";
+char *tsv_escapes[]={"\\t", "\\n", "\\r", "\\\\"};
+
+void report_tsv_field(report *r) {
+	report_write_escaped(r, r->field, r->field_length, tsv_special, tsv_escapes);
+}
+
+char *json_special="\"\\\n\r\t\b\f\001\002\003\004\005\006\007\013\016\017"
+	"\020\021\022\023\024\025\026\027\030\031\032\033\034\035\036\037";
+char *json_escapes[]={"\\\"", "\\\\", "\\n", "\\r", "\\t", "\\b", "\\f",
+	"\\u0001", "\\u0002", "\\u0003", "\\u0004", "\\u0005", "\\u0006",
+	"\\u0007", "\\u000b", "\\u000e", "\\u000f", "\\u0010", "\\u0011",
+	"\\u0012", "\\u0013", "\\u0014", "\\u0015", "\\u0016", "\\u0017",
+	"\\u0018", "\\u0019", "\\u001a", "\\u001b", "\\u001c", "\\u001d",
+	"\\u001e", "\\u001f"};
+
+void report_json_string(report *r, char *data, int length) {
+	report_write(r, "\"", 1);
+	report_write_escaped(r, data, length, json_special, json_escapes);
+	report_write(r, "\"", 1);
+}
+
+/* write the scratch buffer as a csv or tsv field */
+void report_field(report *r) {
+	if(r->format==REPORT_CSV) report_csv_field(r);
+	else report_tsv_field(r);
+}
+
+report *report_new(output *o, int format, char **attrs, char *join) {
+	report *r;
+	int i;
+
+	r=malloc(sizeof(report));
+	r->out=o;
+	r->format=format;
+	r->attrs=attrs;
+	r->join=join;
+	r->join_length=strlen(join);
+	r->rows=0;
+	r->failed=0;
+	r->field_size=4096;
+	r->field=malloc(r->field_size);
+	r->field_length=0;
+
+	if(format==REPORT_JSON) {
+		report_write(r, "[", 1);
+		return r;
+	}
+	if(format==REPORT_JSON_LINES) return r;
+
+	/* header row */
+	report_write(r, "dn", 2);
+	for(i=0; attrs[i]!=NULL; i++) {
+		report_write(r, (format==REPORT_CSV)?",":"\t", 1);
+		r->field_length=0;
+		report_append(r, attrs[i], strlen(attrs[i]));
+		report_field(r);
+	}
+	report_write(r, "\n", 1);
+	return r;
+}
+
+/* adds a value of a ranged attribute to the end of the others */
+int report_range_value(struct berval *value, void *data) {
+	struct berval ***values=data;
+
+	return ber_bvecadd(values, ber_bvdup(value))<0;
+}
+
+/* the values of one of the report's attributes, NULL if there are none.
+	the server names an attribute it returned only some values of
+	member;range=0-1499, so that is looked for too and the rest of its
+	values fetched.  free with ldap_value_free_len() */
+struct berval **report_values(report *r, LDAP *ds, LDAPMessage *entry, char *dn, char *attribute) {
+	BerElement *ber;
+	struct berval **values;
+	char *name;
+	int next=-1;
+
+	values=ldap_get_values_len(ds, entry, attribute);
+	if(values!=NULL) return values;
+
+	for(name=ldap_first_attribute(ds, entry, &ber);
+			name!=NULL;
+			name=ldap_next_attribute(ds, entry, ber)) {
+		if(values==NULL && ad_attribute_matches(name, attribute)) {
+			next=ad_next_range(name);
+			values=ldap_get_values_len(ds, entry, name);
+		}
+		ldap_memfree(name);
+	}
+	if(ber!=NULL) ber_free(ber, 0);
+
+	if(next>0 && ad_get_range_values(dn, attribute, next, report_range_value, &values)!=AD_SUCCESS)
+		r->failed=1;
+	return values;
+}
+
+void report_json_entry(report *r, LDAP *ds, LDAPMessage *entry, char *dn, int deleted) {
+	struct berval **values;
+	int i, j, count;
+
+	if(r->format==REPORT_JSON_LINES)
+		report_write(r, "{\"dn\":", 6);
+	else
+		report_write(r, (r->rows==0)?"\n{\"dn\":":",\n{\"dn\":", (r->rows==0)?7:8);
+	report_json_string(r, dn, strlen(dn));
+	if(deleted) report_write(r, ",\"deleted\":true", 15);
+	for(i=0; r->attrs[i]!=NULL; i++) {
+		report_write(r, ",", 1);
+		report_json_string(r, r->attrs[i], strlen(r->attrs[i]));
+		report_write(r, ":", 1);
+
+		values=report_values(r, ds, entry, dn, r->attrs[i]);
+		count=(values==NULL)?0:ldap_count_values_len(values);
+		if(count==0) report_write(r, "null", 4);
+		if(count>1) report_write(r, "[", 1);
+		for(j=0; j<count; j++) {
+			if(j>0) report_write(r, ",", 1);
+			r->field_length=0;
+			report_value(r, values[j]);
+			report_json_string(r, r->field, r->field_length);
+		}
+		if(count>1) report_write(r, "]", 1);
+		if(values!=NULL) ldap_value_free_len(values);
+	}
+	report_write(r, (r->format==REPORT_JSON_LINES)?"}\n":"}",
+		(r->format==REPORT_JSON_LINES)?2:1);
+}
+
+int report_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data) {
+	return report_change(ds, entry, dn, 0, data);
+}
+
+int report_change(LDAP *ds, LDAPMessage *entry, char *dn, int deleted, void *data) {
+	report *r=data;
+	struct berval **values;
+	int i, j;
+
+	if(r->format==REPORT_JSON || r->format==REPORT_JSON_LINES) {
+		report_json_entry(r, ds, entry, dn, deleted);
+	} else {
+		r->field_length=0;
+		report_append(r, dn, strlen(dn));
+		report_field(r);
+		for(i=0; r->attrs[i]!=NULL; i++) {
+			report_write(r, (r->format==REPORT_CSV)?",":"\t", 1);
+			r->field_length=0;
+			values=report_values(r, ds, entry, dn, r->attrs[i]);
+			for(j=0; values!=NULL && values[j]!=NULL; j++) {
+				if(j>0) report_append(r, r->join, r->join_length);
+				report_value(r, values[j]);
+			}
+			if(values!=NULL) ldap_value_free_len(values);
+			report_field(r);
+		}
+		report_write(r, "\n", 1);
+	}
+	r->rows++;
+	return r->failed;
+}
+
+int report_finish(report *r) {
+	int result;
+
+	if(r->format==REPORT_JSON)
+		report_write(r, (r->rows==0)?"]\n":"\n]\n", (r->rows==0)?2:3);
+	result=r->failed?-1:0;
+	free(r->field);
+	free(r);
+	return result;
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) by: Mike Dawson mike _at_ no spam gp2x.org
+ *
+ * This file may be used subject to the terms and conditions of the
+ * GNU Library General Public License Version 2, or any later version
+ * at your option, as published by the Free Software Foundation.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+**/
+
+/* report.h
+ * tabular reports of search results */
+
+#ifndef REPORT_H
+#define REPORT_H 1
+
+#include <active_directory.h>
+#include "output.h"
+
+#define REPORT_CSV 0
+#define REPORT_TSV 1
+#define REPORT_JSON 2
+#define REPORT_JSON_LINES 3
+
+typedef struct report report;
+
+/* report_new() starts a report of the given attributes in format,
+| written to o.  Each row is an object's dn followed by its values of
+| the attributes.  Several values of an attribute are joined with join
+| in csv and tsv, and become an array in json.  Values which aren't
+| text, such as objectGUID, are written in base64.
+|  REPORT_JSON_LINES writes each row as a json object on a line of its
+| own, without an enclosing array, for output that is read as it comes.
+*/
+report *report_new(output *o, int format, char **attrs, char *join);
+
+/* report_entry() writes a search result entry as a row.  It is an
+| ad_search_callback taking the report as data, so rows can be written
+| as they arrive from ad_search_each().  The rest of an attribute the
+| server returned only a range of values of, such as the member attribute
+| of a large group, is fetched so the row has every value.
+|  Returns non-zero if writing or fetching values failed.
+*/
+int report_entry(LDAP *ds, LDAPMessage *entry, char *dn, void *data);
+
+/* report_change() is report_entry() as an ad_change_callback.  Rows of
+| deleted objects have "deleted":true in json.
+*/
+int report_change(LDAP *ds, LDAPMessage *entry, char *dn, int deleted, void *data);
+
+/* report_finish() ends the report and frees it.
+|  Returns 0, or -1 if writing failed.
+*/
+int report_finish(report *r);
+
+#endif /* REPORT_H */
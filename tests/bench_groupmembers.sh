@@ -0,0 +1,58 @@
+#!/bin/bash
+# compare the two ways groupmembers follows nested groups.
+# builds a tree of groups below $base, depth levels deep with fanout
+# subgroups and users users in each group, then times listing every
+# member of the top group with --recursive and with --walk.
+#
+# usage: bench_groupmembers.sh [depth] [fanout] [users]
+
+base="ou=test,dc=nowhere,dc=net"
+adtool="adtool -b $base"
+depth=${1:-6}
+fanout=${2:-2}
+users=${3:-5}
+
+# one batch of operations to build the tree and one to remove it
+build=bench_build.txt
+clean=bench_clean.txt
+>$build
+>$clean
+groups="bg"
+echo "groupcreate bg $base" >>$build
+for ((level=1; level<depth; level++))
+do
+ next=""
+ for group in $groups
+ do
+  for ((i=0; i<users; i++))
+  do
+   echo "usercreate ${group}u$i $base" >>$build
+   echo "groupadduser $group ${group}u$i" >>$build
+   echo "userdelete ${group}u$i" >>$clean
+  done
+  for ((i=0; i<fanout; i++))
+  do
+   echo "groupcreate ${group}$i $base" >>$build
+   echo "groupadduser $group ${group}$i" >>$build
+   echo "groupdelete ${group}$i" >>$clean
+   next="$next ${group}$i"
+  done
+ done
+ groups=$next
+done
+echo "groupdelete bg" >>$clean
+
+$adtool batch $build >/dev/null || exit 1
+
+for method in --recursive --walk
+do
+ echo "groupmembers $method:"
+ time $adtool groupmembers $method bg >bench_$method.txt
+ wc -l <bench_$method.txt
+done
+sort -o bench_--recursive.txt bench_--recursive.txt
+sort -o bench_--walk.txt bench_--walk.txt
+cmp -s bench_--recursive.txt bench_--walk.txt || echo "the member lists differ"
+
+$adtool batch $clean >/dev/null
+rm -f $build $clean bench_--recursive.txt bench_--walk.txt
@@ -90,6 +90,18 @@ then
 fi
 echo -e attributeget $ok >&6
 
+#test attributeget with several attributes
+$adtool usercreate testuser $base
+$adtool attributeget testuser name sAMAccountName >tmp.txt
+$adtool userdelete testuser
+grep "name: testuser" tmp.txt && grep "sAMAccountName: testuser" tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e "attributeget (several)" $broken >&6
+ exit
+fi
+echo -e "attributeget (several)" $ok >&6
+
 #test attributereplace
 $adtool usercreate testuser $base
 $adtool attributereplace testuser description blah
@@ -221,6 +233,334 @@ then
 fi
 echo -e groupdelete $ok >&6
 
+#test batch
+$adtool batch - >tmp.txt <<EOF
+usercreate testuser $base
+attributereplace testuser description "batch test"
+nosuchoperation
+attributeget testuser description
+userdelete testuser
+EOF
+result=$?
+grep "batch test" tmp.txt
+if [ $? -ne 0 ] || [ $result -eq 0 ]
+then
+ echo -e batch $broken >&6
+ exit
+fi
+echo -e batch $ok >&6
+
+#test attributeset
+$adtool usercreate testuser $base
+$adtool attributeset testuser description="set test" +telephoneNumber=123
+$adtool attributeget testuser description | grep "set test"
+result=$?
+$adtool attributeget testuser telephoneNumber | grep 123
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e attributeset $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+echo -e attributeset $ok >&6
+
+#test userprovision
+$adtool groupcreate testgroup $base
+$adtool userprovision testuser $base --password=Test-Pass-123 --attr description="provision test" --group testgroup
+result=$?
+$adtool attributeget testuser description | grep "provision test"
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e userprovision $broken >&6
+ exit
+fi
+$adtool attributeget testgroup member | grep testuser
+if [ $? -ne 0 ]
+then
+ echo -e userprovision $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+$adtool groupdelete testgroup
+echo -e userprovision $ok >&6
+
+#test export
+$adtool usercreate testuser $base
+$adtool attributereplace testuser description "export test"
+$adtool export $base --filter "(cn=testuser)" --attrs cn,description >tmp.txt
+result=$?
+grep "description: export test" tmp.txt
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e export $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+echo -e export $ok >&6
+
+#test import
+$adtool import - >tmp.txt <<EOF
+dn: cn=testuser,$base
+objectClass: user
+sAMAccountName: testuser
+description: import test
+
+dn: cn=testuser,$base
+changetype: modify
+replace: description
+description: import modified
+EOF
+result=$?
+$adtool attributeget testuser description | grep "import modified"
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e import $broken >&6
+ exit
+fi
+$adtool import - >tmp.txt <<EOF
+dn: cn=testuser,$base
+changetype: delete
+EOF
+$adtool list $base >tmp.txt
+grep testuser tmp.txt
+if [ $? -eq 0 ]
+then
+ echo -e import $broken >&6
+ exit
+fi
+echo -e import $ok >&6
+
+#test report
+$adtool usercreate testuser $base
+$adtool attributereplace testuser description "report, test"
+$adtool report --base $base --filter "(cn=testuser)" --attrs sAMAccountName,description >tmp.txt
+result=$?
+grep 'testuser,"report, test"' tmp.txt
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e report $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+echo -e report $ok >&6
+
+#test groupsync
+$adtool groupcreate testgroup $base
+$adtool usercreate testuser $base
+$adtool usercreate testuser2 $base
+$adtool groupadduser testgroup testuser2
+echo testuser | $adtool groupsync testgroup -
+result=$?
+$adtool attributeget testgroup member >tmp.txt
+grep testuser, tmp.txt && ! grep testuser2 tmp.txt
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e groupsync $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+$adtool userdelete testuser2
+$adtool groupdelete testgroup
+echo -e groupsync $ok >&6
+
+#test groupmembers
+$adtool groupcreate testgroup $base
+$adtool groupcreate testgroup2 $base
+$adtool usercreate testuser $base
+$adtool groupadduser testgroup testgroup2
+$adtool groupadduser testgroup2 testuser
+$adtool groupmembers testgroup >tmp.txt
+grep testgroup2 tmp.txt && ! grep testuser tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e groupmembers $broken >&6
+ exit
+fi
+for method in --recursive --walk
+do
+ $adtool groupmembers $method testgroup >tmp.txt
+ grep testuser tmp.txt
+ if [ $? -ne 0 ]
+ then
+  echo -e groupmembers $method $broken >&6
+  exit
+ fi
+done
+$adtool userdelete testuser
+$adtool groupdelete testgroup2
+$adtool groupdelete testgroup
+echo -e groupmembers $ok >&6
+
+#test usergroups
+$adtool groupcreate testgroup $base
+$adtool groupcreate testgroup2 $base
+$adtool usercreate testuser $base
+$adtool groupadduser testgroup testgroup2
+$adtool groupadduser testgroup2 testuser
+$adtool usergroups testuser >tmp.txt
+grep testgroup2 tmp.txt && ! grep testgroup, tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e usergroups $broken >&6
+ exit
+fi
+$adtool usergroups testuser --effective >tmp.txt
+grep testgroup, tmp.txt && grep testgroup2 tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e usergroups --effective $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+$adtool groupdelete testgroup2
+$adtool groupdelete testgroup
+echo -e usergroups $ok >&6
+
+#test groupsubtreeremove
+$adtool groupcreate testgroup $base
+$adtool groupcreate testgroup2 $base
+$adtool usercreate testuser $base
+$adtool groupadduser testgroup testuser
+$adtool groupadduser testgroup2 testuser
+$adtool groupsubtreeremove $base testuser
+result=$?
+$adtool usergroups testuser >tmp.txt
+grep testgroup tmp.txt
+if [ $? -eq 0 ] || [ $result -ne 0 ]
+then
+ echo -e groupsubtreeremove $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+$adtool groupdelete testgroup2
+$adtool groupdelete testgroup
+echo -e groupsubtreeremove $ok >&6
+
+#test adtoold
+adtoold -F -b $base -s $PWD/adtoold.sock &
+daemon=$!
+sleep 2
+$adtool usercreate testuser $base
+ADTOOL_SOCKET=$PWD/adtoold.sock adtool list $base >tmp.txt
+result=$?
+kill $daemon
+wait $daemon
+grep testuser tmp.txt
+if [ $? -ne 0 ] || [ $result -ne 0 ] || [ -e adtoold.sock ]
+then
+ echo -e adtoold $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+echo -e adtoold $ok >&6
 
+#test tls session resumption, when the config has an ldaps uri and a tlscachefile
+ADTOOL_STATS=text $adtool list $base 2>tmp.txt
+ADTOOL_STATS=text $adtool list $base 2>tmp.txt
+grep "tls: 0 connections" tmp.txt
+if [ $? -ne 0 ]
+then
+ grep "tls: 1 connections, 1 resumed" tmp.txt
+ if [ $? -ne 0 ]
+ then
+  echo -e tlscachefile $broken >&6
+  exit
+ fi
+ echo -e tlscachefile $ok >&6
+fi
 
+#test stats
+$adtool --stats=json list $base 2>tmp.txt >/dev/null
+grep '"search":{"count":' tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e stats $broken >&6
+ exit
+fi
+$adtool --stats attributeget Administrator cn >/dev/null 2>tmp.txt
+grep "^bind: 1 operations" tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e stats $broken >&6
+ exit
+fi
+echo -e stats $ok >&6
 
+#test histogram
+echo -e "list $base\nlist $base" | $adtool --stats=histogram batch 2>tmp.txt >/dev/null
+grep "^search: [0-9]* operations, 0 failed, .* p99 " tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e histogram $broken >&6
+ exit
+fi
+echo -e histogram $ok >&6
+
+#test changes
+$adtool changes --base $base --cookie $PWD/changes.cookie >tmp.txt
+result=$?
+$adtool usercreate testuser $base
+$adtool changes --base $base --cookie $PWD/changes.cookie >tmp.txt
+grep -i "^dn: cn=testuser" tmp.txt
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e changes $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+$adtool changes --base $base --cookie $PWD/changes.cookie >tmp.txt
+grep -i -A1 "^dn: cn=testuser" tmp.txt | grep "changetype: delete"
+if [ $? -ne 0 ]
+then
+ echo -e changes $broken >&6
+ exit
+fi
+rm -f changes.cookie
+echo -e changes $ok >&6
+
+#test watch
+$adtool watch $base --format json --attrs sAMAccountName >watch.txt &
+watcher=$!
+sleep 2
+$adtool usercreate testuser $base
+sleep 2
+kill $watcher
+wait $watcher
+grep -i '"dn":"cn=testuser' watch.txt
+if [ $? -ne 0 ]
+then
+ echo -e watch $broken >&6
+ exit
+fi
+$adtool userdelete testuser
+rm -f watch.txt
+echo -e watch $ok >&6
+
+#test snapshot
+$adtool usercreate testuser $base
+$adtool snapshot build $PWD/test.snap --base $base --sort sAMAccountName
+result=$?
+$adtool userdelete testuser
+$adtool search sAMAccountName 'testu*' --snapshot $PWD/test.snap >tmp.txt
+grep -i "^cn=testuser" tmp.txt
+if [ $? -ne 0 ] || [ $result -ne 0 ]
+then
+ echo -e snapshot $broken >&6
+ exit
+fi
+$adtool attributeget testuser sAMAccountName --snapshot $PWD/test.snap >tmp.txt
+grep -i "^testuser" tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e snapshot $broken >&6
+ exit
+fi
+$adtool list $base --snapshot $PWD/test.snap >tmp.txt
+grep -i "^cn=testuser" tmp.txt
+if [ $? -ne 0 ]
+then
+ echo -e snapshot $broken >&6
+ exit
+fi
+rm -f test.snap
+echo -e snapshot $ok >&6